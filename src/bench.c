@@ -0,0 +1,633 @@
+/*
+  Benchmarks for MyFS. Run them on files inside a mounted MyFS (see bench.sh).
+
+  ./bench io <file> <file size> [operations]
+      Writes and then reads the whole file sequentially in 64KB chunks,
+      then does random 4KB reads and writes inside it.
+      Prints the throughput of each phase, which should not depend on the file size.
+
+  ./bench write <file> <file size> <chunk size>
+      Writes the file sequentially in chunks of the given size and prints the throughput.
+      Used to compare the .write_buf and .write paths (mount with -o nowrite_buf for the latter).
+
+  ./bench dedup <file>
+      Prints the deduplication counters of the file system that holds the file (mount with -o dedup).
+
+  ./bench small <directory> <files> <file size>
+      Creates the files in the directory, then reads each of them once and prints the
+      number of database lookups per read. Used to compare inline small files with -o inline_max=0.
+
+  ./bench lookup <directory> <entries> [operations]
+      Fills the directory up to the given number of entries (e0, e1, ...), then stats random
+      entries and prints the time per lookup, which should not depend on the number of entries.
+      Mount with -o entry_timeout=0,attr_timeout=0 so that every stat reaches the file system.
+
+  ./bench icache <file>
+      Prints the hit and miss counters of the inode cache of the file system that holds the file.
+
+  ./bench list <directory> <entries>
+      Fills the directory up to the given number of entries like lookup does, then lists it and stats
+      every entry, like ls -l, and prints the time per listing and the database lookups per entry.
+      Used to compare the prefetching readdir with -o noprefetch. Mount with -o entry_timeout=0,attr_timeout=0.
+
+  ./bench create <directory> <entries>
+      Creates the entries a1, a2, ... of an empty directory like touch a{1..N}, lists them, then removes them,
+      and prints the time per create and per remove in each quarter of the run, and the time per listed entry.
+      All should stay flat as the directory grows. Fails if the listing does not have every entry once.
+
+  ./bench rmlist <directory> <entries>
+      Creates the entries like create does, then lists the directory and removes each entry as it is listed,
+      like rm -r, and prints the time per entry. Fails if the listing misses an entry or has one twice,
+      or if the directory is not empty afterwards. Then creates the entries again, stops a listing after a few,
+      removes every entry, creates b1, b2, ... and goes on with the listing where it stopped,
+      which fails unless it gives just the new entries.
+
+  ./bench find <directory> <files>
+      Fills the directory with the files, FIND_FANOUT to a subdirectory, then walks the tree like find -type f,
+      going into the entries that readdir gives as directories, and prints the time and the database lookups
+      per entry, and how many entries came without a type and needed a stat. Mount with -o noprefetch
+      to see the types come from the dentries alone, and with entry_timeout=0,attr_timeout=0.
+*/
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "myfs_ioctl.h"
+
+#define SEQ_CHUNK 65536
+#define RAND_CHUNK 4096
+#define DEFAULT_OPERATIONS 2000
+#define FIND_FANOUT 1000
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static double mb_per_sec(long long bytes, double seconds) {
+    return bytes / (1024.0 * 1024.0) / (seconds > 0 ? seconds : 1e-9);
+}
+
+static off_t random_offset(off_t file_size) {
+    off_t chunks = file_size / RAND_CHUNK;
+    if (chunks < 1) return 0;
+    return (((off_t) rand() << 31 | rand()) % chunks) * RAND_CHUNK;
+}
+
+static int bench_io(const char* path, off_t file_size, int operations) {
+    char buf[SEQ_CHUNK];
+    memset(buf, 'x', sizeof(buf));
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        perror("open");
+        return errno;
+    }
+
+    double start = now();
+    for (off_t done = 0; done < file_size; done += SEQ_CHUNK) {
+        size_t n = (size_t) (file_size - done < SEQ_CHUNK ? file_size - done : SEQ_CHUNK);
+        if (pwrite(fd, buf, n, done) != (ssize_t) n) {
+            perror("sequential write");
+            return errno;
+        }
+    }
+    double seq_write = mb_per_sec(file_size, now() - start);
+
+    start = now();
+    for (off_t done = 0; done < file_size; done += SEQ_CHUNK) {
+        if (pread(fd, buf, SEQ_CHUNK, done) < 0) {
+            perror("sequential read");
+            return errno;
+        }
+    }
+    double seq_read = mb_per_sec(file_size, now() - start);
+
+    size_t n = (size_t) (file_size < RAND_CHUNK ? file_size : RAND_CHUNK);
+    start = now();
+    for (int i = 0; i < operations; ++i) {
+        if (pread(fd, buf, n, random_offset(file_size)) < 0) {
+            perror("random read");
+            return errno;
+        }
+    }
+    double rand_read = mb_per_sec((long long) operations * n, now() - start);
+
+    start = now();
+    for (int i = 0; i < operations; ++i) {
+        if (pwrite(fd, buf, n, random_offset(file_size)) != (ssize_t) n) {
+            perror("random write");
+            return errno;
+        }
+    }
+    double rand_write = mb_per_sec((long long) operations * n, now() - start);
+
+    close(fd);
+    printf("%14lld bytes  seq write %9.2f MB/s  seq read %9.2f MB/s  "
+           "rand read %9.2f MB/s  rand write %9.2f MB/s\n",
+           (long long) file_size, seq_write, seq_read, rand_read, rand_write);
+    return 0;
+}
+
+static int bench_write(const char* path, off_t file_size, size_t chunk) {
+    char* buf = malloc(chunk);
+    if (buf == NULL) {
+        perror("malloc");
+        return errno;
+    }
+    memset(buf, 'x', chunk);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        perror("open");
+        return errno;
+    }
+
+    double start = now();
+    for (off_t done = 0; done < file_size; done += chunk) {
+        size_t n = (size_t) (file_size - done < (off_t) chunk ? file_size - done : (off_t) chunk);
+        if (write(fd, buf, n) != (ssize_t) n) {
+            perror("write");
+            return errno;
+        }
+    }
+    fsync(fd);
+    double seconds = now() - start;
+
+    close(fd);
+    free(buf);
+    printf("%14lld bytes  chunk %8zu  write %9.2f MB/s\n", (long long) file_size, chunk,
+           mb_per_sec(file_size, seconds));
+    return 0;
+}
+
+static int bench_dedup(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return errno;
+    }
+
+    struct myfs_dedup_stats stats;
+    if (ioctl(fd, MYFS_IOC_DEDUP_STATS, &stats) == -1) {
+        perror("ioctl");
+        return errno;
+    }
+    close(fd);
+
+    printf("%llu block references to %llu shared blocks, %llu bytes referenced, %llu bytes stored, ratio %.2f\n",
+           (unsigned long long) stats.references, (unsigned long long) stats.shared,
+           (unsigned long long) stats.referenced_bytes, (unsigned long long) stats.stored_bytes,
+           stats.stored_bytes ? (double) stats.referenced_bytes / stats.stored_bytes : 1.0);
+    return 0;
+}
+
+static int bench_icache(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return errno;
+    }
+
+    struct myfs_icache_stats stats;
+    if (ioctl(fd, MYFS_IOC_ICACHE_STATS, &stats) == -1) {
+        perror("ioctl");
+        return errno;
+    }
+    close(fd);
+
+    unsigned long long lookups = stats.hits + stats.misses;
+    printf("%llu inode cache hits, %llu misses, hit rate %.2f%%\n", (unsigned long long) stats.hits,
+           (unsigned long long) stats.misses, lookups ? 100.0 * stats.hits / lookups : 0.0);
+    return 0;
+}
+
+static int bench_small(const char* dir, int files, size_t file_size) {
+    if (files < 1) return EINVAL;
+    char* buf = malloc(file_size ? file_size : 1);
+    int* fds = malloc(files * sizeof(int));
+    if (buf == NULL || fds == NULL) {
+        perror("malloc");
+        return errno;
+    }
+    memset(buf, 'x', file_size);
+
+    char path[4096];
+    for (int i = 0; i < files; ++i) {
+        snprintf(path, sizeof(path), "%s/small%d", dir, i);
+        fds[i] = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fds[i] == -1 || write(fds[i], buf, file_size) != (ssize_t) file_size) {
+            perror("create");
+            return errno;
+        }
+    }
+
+    // Only the reads happen between the two samples, the files are already open.
+    struct myfs_lookup_stats before, after;
+    if (ioctl(fds[0], MYFS_IOC_LOOKUP_STATS, &before) == -1) {
+        perror("ioctl");
+        return errno;
+    }
+    double start = now();
+    for (int i = 0; i < files; ++i) {
+        if (pread(fds[i], buf, file_size, 0) != (ssize_t) file_size) {
+            perror("read");
+            return errno;
+        }
+    }
+    double seconds = now() - start;
+    if (ioctl(fds[0], MYFS_IOC_LOOKUP_STATS, &after) == -1) {
+        perror("ioctl");
+        return errno;
+    }
+
+    for (int i = 0; i < files; ++i) close(fds[i]);
+    free(fds);
+    free(buf);
+    unsigned long long reads = after.reads - before.reads;
+    unsigned long long lookups = after.lookups - before.lookups;
+    printf("%6d files of %8zu bytes  %llu reads  %.2f lookups per read  %9.0f reads/s\n", files, file_size, reads,
+           reads ? (double) lookups / reads : 0.0, files / (seconds > 0 ? seconds : 1e-9));
+    return 0;
+}
+
+// Creates the entries e0, e1, ... of a directory.
+// Entries left by a smaller run are kept, so that growing sizes can share the directory.
+static int fill_dir(const char* dir, int entries) {
+    char path[4096];
+    struct stat st;
+    for (int i = 0; i < entries; ++i) {
+        snprintf(path, sizeof(path), "%s/e%d", dir, i);
+        if (stat(path, &st) == 0) continue;
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+        if (fd == -1) {
+            perror("create");
+            return errno;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+static int bench_lookup(const char* dir, int entries, int operations) {
+    if (entries < 1) return EINVAL;
+    char path[4096];
+    struct stat st;
+
+    double start = now();
+    int rc = fill_dir(dir, entries);
+    if (rc) return rc;
+    double fill = now() - start;
+
+    start = now();
+    for (int i = 0; i < operations; ++i) {
+        snprintf(path, sizeof(path), "%s/e%d", dir, rand() % entries);
+        if (stat(path, &st) == -1) {
+            perror("stat");
+            return errno;
+        }
+    }
+    double seconds = now() - start;
+
+    printf("%8d entries  filled in %8.2f s  %8.1f us per lookup\n", entries, fill,
+           seconds * 1e6 / (operations > 0 ? operations : 1));
+    return 0;
+}
+
+static int bench_list(const char* dir, int entries) {
+    if (entries < 1) return EINVAL;
+    int rc = fill_dir(dir, entries);
+    if (rc) return rc;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/e0", dir);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return errno;
+    }
+    struct myfs_lookup_stats before, after;
+    if (ioctl(fd, MYFS_IOC_LOOKUP_STATS, &before) == -1) {
+        perror("ioctl");
+        return errno;
+    }
+
+    double start = now();
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        perror("opendir");
+        return errno;
+    }
+    int listed = 0;
+    struct dirent* entry;
+    struct stat st;
+    while ((entry = readdir(d)) != NULL) {
+        if (fstatat(dirfd(d), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            perror("stat");
+            return errno;
+        }
+        listed++;
+    }
+    closedir(d);
+    double seconds = now() - start;
+
+    if (ioctl(fd, MYFS_IOC_LOOKUP_STATS, &after) == -1) {
+        perror("ioctl");
+        return errno;
+    }
+    close(fd);
+    printf("%8d entries  listed with attributes in %9.2f ms  %.2f lookups per entry\n", listed, seconds * 1e3,
+           listed ? (double) (after.lookups - before.lookups) / listed : 0.0);
+    return 0;
+}
+
+// Lists the entries that bench_create made, removing each one as it is listed if asked to,
+// and checks that each of them is there once.
+static int list_created(const char* dir, int entries, int remove) {
+    char* seen = calloc((size_t) entries + 1, 1);
+    if (seen == NULL) return ENOMEM;
+    double start = now();
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        perror("opendir");
+        free(seen);
+        return errno;
+    }
+    int listed = 0, wrong = 0;
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+        int i = e->d_name[0] == 'a' ? atoi(e->d_name + 1) : 0;
+        if (i < 1 || i > entries || seen[i]++) wrong++;
+        listed++;
+        if (remove && unlinkat(dirfd(d), e->d_name, 0) == -1) {
+            perror("unlink");
+            closedir(d);
+            free(seen);
+            return errno;
+        }
+    }
+    closedir(d);
+    double seconds = now() - start;
+    free(seen);
+
+    printf("%8d entries  listed %sin %9.2f ms  %8.2f us per entry\n", listed, remove ? "and removed " : "",
+           seconds * 1e3, listed ? seconds * 1e6 / listed : 0.0);
+    if (listed != entries || wrong) {
+        fprintf(stderr, "list: %d entries listed, %d of them wrong, %d expected\n", listed, wrong, entries);
+        return EIO;
+    }
+    return 0;
+}
+
+static int bench_create(const char* dir, int entries) {
+    if (entries < 4) return EINVAL;
+    char path[4096];
+    for (int pass = 0; pass < 2; ++pass) {
+        printf("%8d entries  %s", entries, pass ? "remove" : "create");
+        double start = now();
+        for (int i = 1; i <= entries; ++i) {
+            snprintf(path, sizeof(path), "%s/a%d", dir, i);
+            if (pass == 0) {
+                int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+                if (fd == -1) {
+                    perror("create");
+                    return errno;
+                }
+                close(fd);
+            }
+            else if (unlink(path) == -1) {
+                perror("unlink");
+                return errno;
+            }
+            if (i % (entries / 4) == 0) {
+                printf("  %8.1f us", (now() - start) * 1e6 / (entries / 4));
+                start = now();
+            }
+        }
+        printf("\n");
+        if (pass == 0) {
+            int rc = list_created(dir, entries, 0);
+            if (rc) return rc;
+        }
+    }
+    return 0;
+}
+
+static int create_entries(const char* dir, char prefix, int entries) {
+    char path[4096];
+    for (int i = 1; i <= entries; ++i) {
+        snprintf(path, sizeof(path), "%s/%c%d", dir, prefix, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+        if (fd == -1) {
+            perror("create");
+            return errno;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+// Removes every entry and creates new ones while a listing is stopped part way, then goes on with it.
+static int relist(const char* dir, int entries) {
+    int rc = create_entries(dir, 'a', entries);
+    if (rc) return rc;
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        perror("opendir");
+        return errno;
+    }
+    for (int i = 0; i < 4 && readdir(d) != NULL; ++i);
+    long stopped = telldir(d);
+
+    char path[4096];
+    for (int i = 1; i <= entries; ++i) {
+        snprintf(path, sizeof(path), "%s/a%d", dir, i);
+        if (unlink(path) == -1) {
+            perror("unlink");
+            closedir(d);
+            return errno;
+        }
+    }
+    rc = create_entries(dir, 'b', entries);
+    if (rc) {
+        closedir(d);
+        return rc;
+    }
+    // seekdir drops what the listing read ahead, so the rest comes from the directory as it is now.
+    seekdir(d, stopped);
+    int old = 0, new = 0;
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL) {
+        old += e->d_name[0] == 'a';
+        new += e->d_name[0] == 'b';
+    }
+    closedir(d);
+    printf("%8d entries  relisted, %d new and %d removed ones\n", entries, new, old);
+    if (old || new != entries) {
+        fprintf(stderr, "rmlist: the listing went on with %d new and %d removed entries, %d expected\n", new, old, entries);
+        return EIO;
+    }
+    for (int i = 1; i <= entries; ++i) {
+        snprintf(path, sizeof(path), "%s/b%d", dir, i);
+        if (unlink(path) == -1) {
+            perror("unlink");
+            return errno;
+        }
+    }
+    return 0;
+}
+
+static int bench_rmlist(const char* dir, int entries) {
+    int rc = create_entries(dir, 'a', entries);
+    if (rc) return rc;
+    rc = list_created(dir, entries, 1);
+    if (rc) return rc;
+
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        perror("opendir");
+        return errno;
+    }
+    int left = 0;
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL) left += strcmp(e->d_name, ".") && strcmp(e->d_name, "..");
+    closedir(d);
+    if (left) {
+        fprintf(stderr, "rmlist: %d entries left after removing every listed one\n", left);
+        return EIO;
+    }
+    return relist(dir, entries);
+}
+
+// Walks a tree like find does, counting the files, and the entries that readdir gave no type for.
+static int walk(const char* dir, int* files, int* untyped) {
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        perror("opendir");
+        return errno;
+    }
+    char path[4096];
+    struct dirent* e;
+    while ((e = readdir(d)) != NULL) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+        int type = e->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                perror("stat");
+                closedir(d);
+                return errno;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            (*untyped)++;
+        }
+        if (type == DT_REG) (*files)++;
+        if (type == DT_DIR) {
+            snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+            int rc = walk(path, files, untyped);
+            if (rc) {
+                closedir(d);
+                return rc;
+            }
+        }
+    }
+    closedir(d);
+    return 0;
+}
+
+static int bench_find(const char* dir, int files) {
+    if (files < 1) return EINVAL;
+    char path[4096];
+    for (int i = 0; i < files; ++i) {
+        if (i % FIND_FANOUT == 0) {
+            snprintf(path, sizeof(path), "%s/d%d", dir, i / FIND_FANOUT);
+            if (mkdir(path, S_IRWXU) == -1 && errno != EEXIST) {
+                perror("mkdir");
+                return errno;
+            }
+        }
+        snprintf(path, sizeof(path), "%s/d%d/f%d", dir, i / FIND_FANOUT, i);
+        int fd = open(path, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+        if (fd == -1) {
+            perror("create");
+            return errno;
+        }
+        close(fd);
+    }
+
+    snprintf(path, sizeof(path), "%s/d0/f0", dir);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return errno;
+    }
+    struct myfs_lookup_stats before, after;
+    if (ioctl(fd, MYFS_IOC_LOOKUP_STATS, &before) == -1) {
+        perror("ioctl");
+        return errno;
+    }
+
+    int found = 0, untyped = 0;
+    double start = now();
+    int rc = walk(dir, &found, &untyped);
+    if (rc) return rc;
+    double seconds = now() - start;
+
+    if (ioctl(fd, MYFS_IOC_LOOKUP_STATS, &after) == -1) {
+        perror("ioctl");
+        return errno;
+    }
+    close(fd);
+    int entries = found + (files + FIND_FANOUT - 1) / FIND_FANOUT;
+    printf("%8d files  found in %9.2f ms  %8.2f us and %.2f lookups per entry  %d entries without a type\n",
+           found, seconds * 1e3, seconds * 1e6 / entries, (double) (after.lookups - before.lookups) / entries, untyped);
+    if (found != files) {
+        fprintf(stderr, "find: %d files found, %d expected\n", found, files);
+        return EIO;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    srand(1);
+    if (argc >= 4 && !strcmp(argv[1], "io"))
+        return bench_io(argv[2], atoll(argv[3]), argc > 4 ? atoi(argv[4]) : DEFAULT_OPERATIONS);
+    if (argc >= 5 && !strcmp(argv[1], "write"))
+        return bench_write(argv[2], atoll(argv[3]), (size_t) atoll(argv[4]));
+    if (argc >= 3 && !strcmp(argv[1], "dedup"))
+        return bench_dedup(argv[2]);
+    if (argc >= 3 && !strcmp(argv[1], "icache"))
+        return bench_icache(argv[2]);
+    if (argc >= 5 && !strcmp(argv[1], "small"))
+        return bench_small(argv[2], atoi(argv[3]), (size_t) atoll(argv[4]));
+    if (argc >= 4 && !strcmp(argv[1], "lookup"))
+        return bench_lookup(argv[2], atoi(argv[3]), argc > 4 ? atoi(argv[4]) : DEFAULT_OPERATIONS);
+    if (argc >= 4 && !strcmp(argv[1], "list"))
+        return bench_list(argv[2], atoi(argv[3]));
+    if (argc >= 4 && !strcmp(argv[1], "create"))
+        return bench_create(argv[2], atoi(argv[3]));
+    if (argc >= 4 && !strcmp(argv[1], "rmlist"))
+        return bench_rmlist(argv[2], atoi(argv[3]));
+    if (argc >= 4 && !strcmp(argv[1], "find"))
+        return bench_find(argv[2], atoi(argv[3]));
+
+    fprintf(stderr, "usage: %s io <file> <file size> [operations]\n", argv[0]);
+    fprintf(stderr, "       %s write <file> <file size> <chunk size>\n", argv[0]);
+    fprintf(stderr, "       %s dedup <file>\n", argv[0]);
+    fprintf(stderr, "       %s icache <file>\n", argv[0]);
+    fprintf(stderr, "       %s small <directory> <files> <file size>\n", argv[0]);
+    fprintf(stderr, "       %s lookup <directory> <entries> [operations]\n", argv[0]);
+    fprintf(stderr, "       %s list <directory> <entries>\n", argv[0]);
+    fprintf(stderr, "       %s create <directory> <entries>\n", argv[0]);
+    fprintf(stderr, "       %s rmlist <directory> <entries>\n", argv[0]);
+    fprintf(stderr, "       %s find <directory> <files>\n", argv[0]);
+    return EINVAL;
+}
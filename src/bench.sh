@@ -0,0 +1,184 @@
+#!/usr/bin/env bash
+_user="$USER"
+_mnt="/cs/scratch/$_user/mnt"
+
+# This function is used to facilitate reading the command line output.
+run_cmd() {
+    echo "$1"  # Show the command
+    $1  # Execute it
+    echo "____________________________________________"  # Separate output from other commands.
+}
+
+# Clear previous mounts
+run_cmd "fusermount -u $_mnt"
+run_cmd "make clean"
+run_cmd "rm -rf $_mnt"
+
+# Mount FS
+run_cmd "mkdir $_mnt"
+run_cmd "make"
+run_cmd "make bench"
+run_cmd "./myfs -s $_mnt"
+
+# Throughput should stay flat from 4KB to 4GB files.
+for size in 4096 65536 1048576 16777216 268435456 1073741824 4294967296
+do
+    run_cmd "./bench io $_mnt/bench_file $size"
+    run_cmd "rm $_mnt/bench_file"
+done
+
+run_cmd "fusermount -u $_mnt"
+
+# Sequential writes through .write_buf, then through .write for comparison.
+for opts in "-o big_writes" "-o big_writes,nowrite_buf"
+do
+    run_cmd "./myfs -s $opts $_mnt"
+    for chunk in 4096 65536 131072
+    do
+        run_cmd "./bench write $_mnt/bench_file 268435456 $chunk"
+        run_cmd "rm $_mnt/bench_file"
+    done
+    run_cmd "fusermount -u $_mnt"
+done
+
+# Deduplication: the write cost of hashing every block, and the space saved on duplicate trees.
+for opts in "-o big_writes" "-o big_writes,dedup"
+do
+    run_cmd "./myfs -s $opts $_mnt"
+    run_cmd "./bench write $_mnt/bench_file 268435456 131072"
+    run_cmd "cp -r /usr/include $_mnt/copy1"
+    run_cmd "cp -r /usr/include $_mnt/copy2"
+    run_cmd "./bench dedup $_mnt/bench_file"
+    run_cmd "du -k myfs.db"
+    run_cmd "rm -r $_mnt/bench_file $_mnt/copy1 $_mnt/copy2"
+    run_cmd "fusermount -u $_mnt"
+done
+
+# Small files: lookups per read with the contents inline in the meta record, and without.
+for opts in "" "-o inline_max=0"
+do
+    run_cmd "./myfs -s $opts $_mnt"
+    run_cmd "mkdir $_mnt/small"
+    for size in 100 1000
+    do
+        run_cmd "./bench small $_mnt/small 200 $size"
+    done
+    run_cmd "rm -r $_mnt/small"
+    run_cmd "fusermount -u $_mnt"
+done
+
+# Compression: throughput and space with compressible data, then with data that does not compress.
+for opts in "-o big_writes" "-o big_writes,compress=lz"
+do
+    run_cmd "rm -f myfs.db"
+    run_cmd "./myfs -s $opts $_mnt"
+    run_cmd "./bench write $_mnt/bench_file 268435456 131072"
+    run_cmd "du -k $_mnt/bench_file"
+    run_cmd "dd if=/dev/urandom of=$_mnt/random_file bs=1M count=64"
+    run_cmd "du -k $_mnt/random_file"
+    run_cmd "./bench io $_mnt/bench_file 16777216"
+    run_cmd "du -k myfs.db"
+    run_cmd "rm $_mnt/bench_file $_mnt/random_file"
+    run_cmd "fusermount -u $_mnt"
+done
+
+# Metadata: the time to look an entry up, from small directories to very large ones,
+# and the size of the directory's list of dentries.
+run_cmd "rm -f myfs.db"
+run_cmd "./myfs -s -o entry_timeout=0,attr_timeout=0 $_mnt"
+run_cmd "mkdir $_mnt/dir"
+for entries in 10 100 1000 10000 100000 1000000
+do
+    run_cmd "./bench lookup $_mnt/dir $entries"
+    run_cmd "stat -c %s $_mnt/dir"
+done
+run_cmd "fusermount -u $_mnt"
+run_cmd "rm -f myfs.db"
+
+# Dentry cache: lookups deep in the tree, with the cache and without it.
+for opts in "" ",dcache_max=0"
+do
+    run_cmd "rm -f myfs.db"
+    run_cmd "./myfs -s -o entry_timeout=0,attr_timeout=0,negative_timeout=0$opts $_mnt"
+    run_cmd "mkdir -p $_mnt/a/b/c/d"
+    run_cmd "./bench lookup $_mnt/a/b/c/d 1000 20000"
+    run_cmd "fusermount -u $_mnt"
+done
+run_cmd "rm -f myfs.db"
+
+# Inode cache: the same lookups with the cache, with a cache too small for the entries, and without it,
+# followed by the hit and miss counters.
+for opts in "" ",icache_max=65536" ",icache_max=0"
+do
+    run_cmd "rm -f myfs.db"
+    run_cmd "./myfs -s -o entry_timeout=0,attr_timeout=0$opts $_mnt"
+    run_cmd "mkdir -p $_mnt/a/b/c/d"
+    run_cmd "./bench lookup $_mnt/a/b/c/d 1000 20000"
+    run_cmd "./bench icache $_mnt/a/b/c/d/e0"
+    run_cmd "fusermount -u $_mnt"
+done
+run_cmd "rm -f myfs.db"
+
+# Listing with attributes: ls -l on a large directory, with readdir loading the inodes of the entries and without.
+for opts in "" ",noprefetch"
+do
+    run_cmd "rm -f myfs.db"
+    run_cmd "./myfs -s -o entry_timeout=0,attr_timeout=0$opts $_mnt"
+    run_cmd "mkdir $_mnt/dir"
+    run_cmd "./bench list $_mnt/dir 10000"
+    run_cmd "fusermount -u $_mnt"
+done
+run_cmd "rm -f myfs.db"
+
+# Walking a tree of 100000 files like find -type f: readdir gives the type of every entry from its dentry,
+# so no entry needs a stat, with the inodes loaded by readdir and without.
+for opts in "" ",noprefetch"
+do
+    run_cmd "rm -f myfs.db"
+    run_cmd "./myfs -s -o entry_timeout=0,attr_timeout=0$opts $_mnt"
+    run_cmd "mkdir $_mnt/tree"
+    run_cmd "./bench find $_mnt/tree 100000"
+    run_cmd "fusermount -u $_mnt"
+done
+run_cmd "rm -f myfs.db"
+
+# Growing a directory: the time per create and per remove should not depend on how many entries it has.
+run_cmd "rm -f myfs.db"
+run_cmd "./myfs -s $_mnt"
+run_cmd "mkdir $_mnt/dir"
+run_cmd "./bench create $_mnt/dir 100000"
+run_cmd "fusermount -u $_mnt"
+run_cmd "rm -f myfs.db"
+
+# A million entries: created, listed and removed, with no more memory than a small directory takes.
+# rmlist removes them as it lists them, which the listing has to see through to the end, like rm -r.
+# It then removes every entry and adds new ones under a listing stopped part way, which goes on with just the new ones.
+run_cmd "./myfs -s $_mnt"
+run_cmd "mkdir $_mnt/dir"
+run_cmd "./bench create $_mnt/dir 1000000"
+run_cmd "./bench rmlist $_mnt/dir 1000000"
+run_cmd "rmdir $_mnt/dir"
+run_cmd "fusermount -u $_mnt"
+run_cmd "rm -f myfs.db"
+
+# Access times: reads of small files just written, with each atime policy.
+# The first read stores the access time with strictatime and relatime, none does with noatime, and lazytime defers it.
+for opts in "strictatime" "relatime" "noatime" "strictatime,lazytime"
+do
+    run_cmd "rm -f myfs.db"
+    run_cmd "./myfs -s -o $opts $_mnt"
+    run_cmd "mkdir $_mnt/small"
+    run_cmd "./bench small $_mnt/small 1000 100"
+    run_cmd "fusermount -u $_mnt"
+done
+run_cmd "rm -f myfs.db"
+
+# Write-back of inodes: writes in small chunks, storing the inode after every one of them and in batches.
+for opts in "dirty_max=0" "dirty_max=1024"
+do
+    run_cmd "rm -f myfs.db"
+    run_cmd "./myfs -s -o $opts $_mnt"
+    run_cmd "./bench write $_mnt/f 67108864 4096"
+    run_cmd "fusermount -u $_mnt"
+done
+run_cmd "rm -f myfs.db"
@@ -0,0 +1,160 @@
+// The block codecs. The only one so far is an LZ77 coder in the style of LZ4.
+//
+// A compressed block is a series of sequences, each made of
+//   a token byte: the number of literals in the high 4 bits, the match length - LZ_MIN_MATCH in the low 4 bits,
+//   more bytes of the literal count if it was 15 (each adds up to 255, a byte below 255 ends it),
+//   the literals,
+//   the 2 byte little endian distance back to the match,
+//   more bytes of the match length if it was 15, in the same way as the literal count.
+// The last sequence has literals only, it ends at the end of the compressed bytes.
+#include <string.h>
+#include "compress.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_DISTANCE 65535
+#define LZ_HASH_BITS 12
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t* put_length(uint8_t* op, size_t n) {
+    for (; n >= 255; n -= 255) *op++ = 255;
+    *op++ = (uint8_t) n;
+    return op;
+}
+
+/**
+ * Appends a sequence to the compressed bytes.
+ * A match of length 0 makes it the last sequence.
+ *
+ * @return 0 if it does not fit in the output, 1 otherwise
+ */
+static int lz_emit(uint8_t** out, const uint8_t* out_end, const uint8_t* literals, size_t n_literals,
+                   size_t distance, size_t match) {
+    uint8_t* op = *out;
+    size_t code = match ? match - LZ_MIN_MATCH : 0;
+    size_t worst = 1 + n_literals / 255 + 1 + n_literals + 2 + code / 255 + 1;
+    if ((size_t) (out_end - op) < worst) return 0;
+
+    uint8_t* token = op++;
+    *token = (uint8_t) ((n_literals < 15 ? n_literals : 15) << 4 | (code < 15 ? code : 15));
+    if (n_literals >= 15) op = put_length(op, n_literals - 15);
+    memcpy(op, literals, n_literals);
+    op += n_literals;
+    if (match) {
+        *op++ = (uint8_t) (distance & 0xff);
+        *op++ = (uint8_t) (distance >> 8);
+        if (code >= 15) op = put_length(op, code - 15);
+    }
+    *out = op;
+
+    return 1;
+}
+
+static size_t lz_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS];  // Last position + 1 of each hashed 4 bytes, 0 for none.
+    memset(table, 0, sizeof(table));
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + len;
+    uint8_t* op = dst;
+    size_t misses = 0;  // Since the last match. The longer the run, the more bytes are skipped.
+
+    while (len >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+        uint32_t seq = read32(ip);
+        uint32_t h = hash4(seq);
+        uint32_t candidate = table[h];
+        table[h] = (uint32_t) (ip - src) + 1;
+        const uint8_t* ref = candidate ? src + candidate - 1 : ip;
+        if (ref == ip || ip - ref > LZ_MAX_DISTANCE || read32(ref) != seq) {
+            ip += 1 + (misses++ >> 5);
+            continue;
+        }
+        misses = 0;
+
+        size_t match = LZ_MIN_MATCH;
+        while (ip + match + sizeof(uint64_t) <= end) {  // 8 bytes at a time, then the rest one by one.
+            uint64_t a, b;
+            memcpy(&a, ip + match, sizeof(a));
+            memcpy(&b, ref + match, sizeof(b));
+            if (a != b) break;
+            match += sizeof(uint64_t);
+        }
+        while (ip + match < end && ref[match] == ip[match]) match++;
+        if (!lz_emit(&op, dst + cap, anchor, (size_t) (ip - anchor), (size_t) (ip - ref), match)) return 0;
+        ip += match;
+        anchor = ip;
+    }
+    if (!lz_emit(&op, dst + cap, anchor, (size_t) (end - anchor), 0, 0)) return 0;
+
+    return (size_t) (op - dst);
+}
+
+static int get_length(const uint8_t** in, const uint8_t* in_end, size_t* n) {
+    const uint8_t* ip = *in;
+    uint8_t b;
+    do {
+        if (ip == in_end) return 0;
+        b = *ip++;
+        *n += b;
+    } while (b == 255);
+    *in = ip;
+
+    return 1;
+}
+
+static long lz_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap) {
+    const uint8_t* ip = src;
+    const uint8_t* in_end = src + len;
+    uint8_t* op = dst;
+    uint8_t* out_end = dst + cap;
+
+    while (ip < in_end) {
+        uint8_t token = *ip++;
+        size_t n_literals = token >> 4;
+        if (n_literals == 15 && !get_length(&ip, in_end, &n_literals)) return -1;
+        if ((size_t) (in_end - ip) < n_literals || (size_t) (out_end - op) < n_literals) return -1;
+        memcpy(op, ip, n_literals);
+        ip += n_literals;
+        op += n_literals;
+        if (ip == in_end) break;  // The last sequence.
+
+        if (in_end - ip < 2) return -1;
+        size_t distance = ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15 && !get_length(&ip, in_end, &match)) return -1;
+        match += LZ_MIN_MATCH;
+        if (distance == 0 || distance > (size_t) (op - dst) || (size_t) (out_end - op) < match) return -1;
+        const uint8_t* ref = op - distance;
+        if (distance >= match) memcpy(op, ref, match);
+        else for (size_t i = 0; i < match; ++i) op[i] = ref[i];  // Byte by byte, the match overlaps its copy.
+        op += match;
+    }
+
+    return (long) (op - dst);
+}
+
+size_t compress_block(int codec, const uint8_t* src, size_t len, uint8_t* dst) {
+    if (codec != CODEC_LZ || len < COMPRESS_MIN_SIZE) return 0;
+
+    // Data that does not compress shows it in its first few KB, and only costs that much.
+    if (len >= 2 * COMPRESS_PROBE_SIZE &&
+        !lz_compress(src, COMPRESS_PROBE_SIZE, dst, COMPRESS_PROBE_SIZE - COMPRESS_PROBE_SIZE / 8))
+        return 0;
+
+    // Anything that saves less than 1/16 is not worth decompressing on every read.
+    return lz_compress(src, len, dst, len - len / 16);
+}
+
+long decompress_block(int codec, const uint8_t* src, size_t len, uint8_t* dst, size_t cap) {
+    if (codec != CODEC_LZ) return -1;
+    return lz_decompress(src, len, dst, cap);
+}
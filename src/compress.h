@@ -0,0 +1,39 @@
+#ifndef PROJECT_COMPRESS_H
+#define PROJECT_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The codecs that blocks can be compressed with, chosen with -o compress=<name>.
+#define CODEC_NONE 0
+#define CODEC_LZ 1  /* byte-oriented LZ77 in the style of LZ4, fast on both sides */
+
+// Blocks shorter than this are not worth compressing.
+#define COMPRESS_MIN_SIZE 256
+// The size of the sample that is compressed first, to give up early on data that does not compress.
+#define COMPRESS_PROBE_SIZE 4096
+
+/**
+ * Compresses a block, unless it does not compress well enough to be worth it.
+ *
+ * @param codec the codec to use
+ * @param src the bytes to compress
+ * @param len the number of bytes
+ * @param dst receives the compressed bytes, room for len bytes is needed
+ * @return the size of the compressed bytes, 0 if the block should be stored as it is
+ */
+size_t compress_block(int codec, const uint8_t* src, size_t len, uint8_t* dst);
+
+/**
+ * Restores a block compressed with compress_block.
+ *
+ * @param codec the codec the block was compressed with
+ * @param src the compressed bytes
+ * @param len the number of compressed bytes
+ * @param dst receives the original bytes
+ * @param cap the size of dst
+ * @return the number of original bytes, -1 if the compressed bytes are corrupt
+ */
+long decompress_block(int codec, const uint8_t* src, size_t len, uint8_t* dst, size_t cap);
+
+#endif //PROJECT_COMPRESS_H
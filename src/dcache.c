@@ -0,0 +1,159 @@
+// The dentry cache: a hash table of entries chained in their buckets,
+// and a list of all the entries from the most recently used to the least.
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dcache.h"
+
+// About the size of an entry with a short name, to size the table for the budget.
+#define DCACHE_TYPICAL_ENTRY 96
+#define DCACHE_MIN_BUCKETS 64
+
+typedef struct _dcache_entry {
+    struct _dcache_entry* next;   /* in the bucket */
+    struct _dcache_entry* newer;  /* towards the most recently used */
+    struct _dcache_entry* older;  /* towards the least recently used */
+    uint8_t dir[DCACHE_ID_SIZE];
+    uint8_t id[DCACHE_ID_SIZE];
+    uint64_t offset;
+    uint32_t hash;
+    uint8_t negative;
+    uint8_t name_len;
+    char name[];
+} dcache_entry;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static dcache_entry** buckets;
+static size_t n_buckets;      // A power of 2, 0 when the cache is off.
+static dcache_entry* newest;
+static dcache_entry* oldest;
+static size_t bytes;
+static size_t budget;
+
+static uint32_t hash_name(const uint8_t* dir, const char* name, size_t len) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (int i = 0; i < DCACHE_ID_SIZE; ++i) h = (h ^ dir[i]) * 16777619u;
+    for (size_t i = 0; i < len; ++i) h = (h ^ (uint8_t) name[i]) * 16777619u;
+    return h;
+}
+
+static size_t entry_size(const dcache_entry* e) {
+    return sizeof(dcache_entry) + e->name_len;
+}
+
+// Finds the entry and the link that points to it in its bucket.
+static dcache_entry** find(const uint8_t* dir, const char* name, size_t len, uint32_t h) {
+    dcache_entry** link = &buckets[h & (n_buckets - 1)];
+    for (; *link != NULL; link = &(*link)->next) {
+        dcache_entry* e = *link;
+        if (e->hash == h && e->name_len == len && !memcmp(e->dir, dir, DCACHE_ID_SIZE) && !memcmp(e->name, name, len))
+            break;
+    }
+    return link;
+}
+
+static void unlink_lru(dcache_entry* e) {
+    if (e->newer) e->newer->older = e->older;
+    else newest = e->older;
+    if (e->older) e->older->newer = e->newer;
+    else oldest = e->newer;
+}
+
+static void push_newest(dcache_entry* e) {
+    e->newer = NULL;
+    e->older = newest;
+    if (newest) newest->newer = e;
+    newest = e;
+    if (oldest == NULL) oldest = e;
+}
+
+static void drop(dcache_entry** link) {
+    dcache_entry* e = *link;
+    *link = e->next;
+    unlink_lru(e);
+    bytes -= entry_size(e);
+    free(e);
+}
+
+static void evict() {
+    while (bytes > budget && oldest != NULL) {
+        dcache_entry* e = oldest;
+        drop(find(e->dir, e->name, e->name_len, e->hash));
+    }
+}
+
+void dcache_init(size_t max_bytes) {
+    dcache_destroy();
+    pthread_mutex_lock(&lock);
+    budget = max_bytes;
+    if (max_bytes) {
+        n_buckets = DCACHE_MIN_BUCKETS;
+        while (n_buckets < max_bytes / DCACHE_TYPICAL_ENTRY) n_buckets *= 2;
+        buckets = calloc(n_buckets, sizeof(dcache_entry*));
+        if (buckets == NULL) n_buckets = 0;  // Run without the cache rather than fail.
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void dcache_destroy(void) {
+    pthread_mutex_lock(&lock);
+    while (oldest != NULL) {
+        dcache_entry* e = oldest;
+        oldest = e->newer;
+        free(e);
+    }
+    free(buckets);
+    buckets = NULL;
+    n_buckets = 0;
+    newest = NULL;
+    bytes = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+int dcache_lookup(const uint8_t* dir, const char* name, uint8_t* id, uint64_t* offset) {
+    int found = DCACHE_MISS;
+    size_t len = strlen(name);
+    pthread_mutex_lock(&lock);
+    if (n_buckets && len <= UINT8_MAX) {
+        dcache_entry* e = *find(dir, name, len, hash_name(dir, name, len));
+        if (e != NULL) {
+            unlink_lru(e);
+            push_newest(e);
+            found = e->negative ? DCACHE_NEGATIVE : DCACHE_HIT;
+            if (!e->negative) {
+                memcpy(id, e->id, DCACHE_ID_SIZE);
+                *offset = e->offset;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return found;
+}
+
+void dcache_insert(const uint8_t* dir, const char* name, const uint8_t* id, uint64_t offset) {
+    size_t len = strlen(name);
+    pthread_mutex_lock(&lock);
+    if (n_buckets && len <= UINT8_MAX) {
+        uint32_t h = hash_name(dir, name, len);
+        dcache_entry** link = find(dir, name, len, h);
+        if (*link != NULL) drop(link);
+
+        dcache_entry* e = malloc(sizeof(dcache_entry) + len);
+        if (e != NULL) {
+            memcpy(e->dir, dir, DCACHE_ID_SIZE);
+            e->negative = id == NULL;
+            if (id != NULL) memcpy(e->id, id, DCACHE_ID_SIZE);
+            e->offset = offset;
+            e->hash = h;
+            e->name_len = (uint8_t) len;
+            memcpy(e->name, name, len);
+            e->next = buckets[h & (n_buckets - 1)];
+            buckets[h & (n_buckets - 1)] = e;
+            push_newest(e);
+            bytes += entry_size(e);
+            evict();
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
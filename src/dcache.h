@@ -0,0 +1,52 @@
+#ifndef PROJECT_DCACHE_H
+#define PROJECT_DCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The dentry cache keeps the entries of directory indexes that were looked up recently,
+// keyed by the uuid of the directory and the name, and the names known not to be there.
+// It is kept up to date by every change to an index, see set_dent and remove_dent.
+// The least recently used entries go once it holds more than its budget, set with -o dcache_max=<bytes>.
+#define DCACHE_DEFAULT_MAX (16 * 1024 * 1024)
+#define DCACHE_ID_SIZE 16
+
+// What dcache_lookup found.
+#define DCACHE_MISS 0      /* nothing is known about the name */
+#define DCACHE_HIT 1       /* the name is in the directory */
+#define DCACHE_NEGATIVE 2  /* the name is not in the directory */
+
+/**
+ * Empties the cache and sets its budget.
+ *
+ * @param max_bytes the memory the entries may take, 0 turns the cache off
+ */
+void dcache_init(size_t max_bytes);
+
+/**
+ * Frees every entry.
+ */
+void dcache_destroy(void);
+
+/**
+ * Looks a name up.
+ *
+ * @param dir the uuid of the directory
+ * @param name the name of the entry
+ * @param id receives the uuid of the entry on a hit
+ * @param offset receives the offset of the entry's dentry on a hit
+ * @return DCACHE_MISS, DCACHE_HIT or DCACHE_NEGATIVE
+ */
+int dcache_lookup(const uint8_t* dir, const char* name, uint8_t* id, uint64_t* offset);
+
+/**
+ * Records what a directory index holds for a name, replacing what was known about it.
+ *
+ * @param dir the uuid of the directory
+ * @param name the name of the entry
+ * @param id the uuid of the entry, NULL to record that the name is not in the directory
+ * @param offset the offset of the entry's dentry, ignored when id is NULL
+ */
+void dcache_insert(const uint8_t* dir, const char* name, const uint8_t* id, uint64_t offset);
+
+#endif //PROJECT_DCACHE_H
@@ -0,0 +1,154 @@
+// The dirty table: a hash table of entries chained in their buckets, which grows as more records are changed.
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dirty.h"
+
+#define DIRTY_MIN_BUCKETS 64
+
+typedef struct _dirty_entry {
+    struct _dirty_entry* next;  /* in the bucket */
+    uint8_t id[DIRTY_ID_SIZE];
+    unsigned char record[];
+} dirty_entry;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static dirty_entry** buckets;
+static size_t n_buckets;  // A power of 2.
+static size_t count;
+static size_t taken_from;  // The bucket dirty_take goes on from, so that a flush does not scan the same empty ones again.
+static size_t record_size;
+
+static size_t bucket_of(const uint8_t* id) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (int i = 0; i < DIRTY_ID_SIZE; ++i) h = (h ^ id[i]) * 16777619u;
+    return h & (n_buckets - 1);
+}
+
+static dirty_entry** find(const uint8_t* id) {
+    dirty_entry** link = &buckets[bucket_of(id)];
+    while (*link != NULL && memcmp((*link)->id, id, DIRTY_ID_SIZE)) link = &(*link)->next;
+    return link;
+}
+
+// Doubles the table. If there is no memory for it, the chains just get longer.
+static void grow() {
+    size_t old_n = n_buckets;
+    dirty_entry** old = buckets;
+    dirty_entry** bigger = calloc(old_n * 2, sizeof(dirty_entry*));
+    if (bigger == NULL) return;
+
+    buckets = bigger;
+    n_buckets = old_n * 2;
+    taken_from = 0;
+    for (size_t i = 0; i < old_n; ++i) {
+        dirty_entry* e = old[i];
+        while (e != NULL) {
+            dirty_entry* next = e->next;
+            e->next = buckets[bucket_of(e->id)];
+            buckets[bucket_of(e->id)] = e;
+            e = next;
+        }
+    }
+    free(old);
+}
+
+void dirty_init(size_t size) {
+    dirty_destroy();
+    pthread_mutex_lock(&lock);
+    record_size = size;
+    n_buckets = DIRTY_MIN_BUCKETS;
+    buckets = calloc(n_buckets, sizeof(dirty_entry*));
+    if (buckets == NULL) n_buckets = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+void dirty_destroy(void) {
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; i < n_buckets; ++i) {
+        dirty_entry* e = buckets[i];
+        while (e != NULL) {
+            dirty_entry* next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    free(buckets);
+    buckets = NULL;
+    n_buckets = 0;
+    count = 0;
+    taken_from = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+int dirty_lookup(const uint8_t* id, void* record) {
+    int found = 0;
+    pthread_mutex_lock(&lock);
+    if (count) {
+        dirty_entry* e = *find(id);
+        if (e != NULL) {
+            memcpy(record, e->record, record_size);
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return found;
+}
+
+size_t dirty_put(const uint8_t* id, const void* record) {
+    size_t n = 0;
+    pthread_mutex_lock(&lock);
+    if (n_buckets) {
+        dirty_entry* e = *find(id);
+        if (e == NULL && (e = malloc(sizeof(dirty_entry) + record_size)) != NULL) {
+            memcpy(e->id, id, DIRTY_ID_SIZE);
+            e->next = buckets[bucket_of(id)];
+            buckets[bucket_of(id)] = e;
+            if (++count > n_buckets) grow();
+        }
+        if (e != NULL) {
+            memcpy(e->record, record, record_size);
+            n = count;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return n;
+}
+
+void dirty_remove(const uint8_t* id) {
+    pthread_mutex_lock(&lock);
+    if (count) {
+        dirty_entry** link = find(id);
+        dirty_entry* e = *link;
+        if (e != NULL) {
+            *link = e->next;
+            free(e);
+            count--;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+int dirty_take(uint8_t* id, void* record) {
+    int taken = 0;
+    pthread_mutex_lock(&lock);
+    for (size_t scanned = 0; count && scanned < n_buckets; ++scanned) {
+        dirty_entry* e = buckets[taken_from];
+        if (e == NULL) {
+            taken_from = (taken_from + 1) & (n_buckets - 1);
+            continue;
+        }
+        buckets[taken_from] = e->next;
+        memcpy(id, e->id, DIRTY_ID_SIZE);
+        memcpy(record, e->record, record_size);
+        free(e);
+        count--;
+        taken = 1;
+        break;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return taken;
+}
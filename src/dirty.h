@@ -0,0 +1,71 @@
+#ifndef PROJECT_DIRTY_H
+#define PROJECT_DIRTY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The dirty table holds meta data records that were changed in memory only, keyed by the uuid of the inode.
+// A record in the table is newer than the one in the database, so it is looked up first, see get_meta,
+// and storing the record in the database takes it out of the table.
+// The records are written to the database in batches, see flush_dirty: when the table holds
+// -o dirty_max=<records> of them, -o dirty_expire=<seconds> after the last batch, whether or not
+// more changes come (the request loop wakes up for it, see session_loop), when the file is synced,
+// and at unmount. A record is also written when its file is released, unless only the access time
+// changed, which lazytime leaves to the others.
+//
+// The database only makes its changes durable when it commits, at fsync and at unmount,
+// and rolls back to the last commit after a crash. The table is flushed before every commit,
+// so a crash never leaves an inode behind the blocks and the entries that were committed with it:
+// the file system comes back as it was at the last fsync or unmount.
+#define DIRTY_DEFAULT_MAX 1024
+#define DIRTY_DEFAULT_EXPIRE 5
+#define DIRTY_ID_SIZE 16
+
+/**
+ * Empties the table and sets the size of the records it holds.
+ * Records still in the table are dropped, flush them first.
+ *
+ * @param record_size the size of every record
+ */
+void dirty_init(size_t record_size);
+
+/**
+ * Frees every entry.
+ */
+void dirty_destroy(void);
+
+/**
+ * Looks a record up.
+ *
+ * @param id the uuid of the inode
+ * @param record receives the record if it is in the table
+ * @return 1 if the record is in the table, 0 otherwise
+ */
+int dirty_lookup(const uint8_t* id, void* record);
+
+/**
+ * Keeps a changed record, replacing what the table had for it.
+ *
+ * @param id the uuid of the inode
+ * @param record the record
+ * @return the number of records in the table, 0 if there was no memory for this one
+ */
+size_t dirty_put(const uint8_t* id, const void* record);
+
+/**
+ * Forgets a record, for when it is stored or removed.
+ *
+ * @param id the uuid of the inode
+ */
+void dirty_remove(const uint8_t* id);
+
+/**
+ * Takes any one record out of the table, to be stored.
+ *
+ * @param id receives the uuid of the inode
+ * @param record receives the record
+ * @return 1 if a record was taken, 0 if the table is empty
+ */
+int dirty_take(uint8_t* id, void* record);
+
+#endif //PROJECT_DIRTY_H
@@ -0,0 +1,208 @@
+// The inode cache: shards of a hash table of entries chained in their buckets,
+// with the entries of each shard also on a ring that the CLOCK hand goes round.
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "icache.h"
+
+#define ICACHE_MIN_BUCKETS 16
+
+typedef struct _icache_entry {
+    struct _icache_entry* next;  /* in the bucket */
+    struct _icache_entry* ahead;   /* on the ring, the next one the hand comes to */
+    struct _icache_entry* behind;  /* on the ring, the one the hand came from */
+    uint8_t id[ICACHE_ID_SIZE];
+    uint32_t hash;
+    uint8_t referenced;  /* used since the hand last passed */
+    unsigned char record[];
+} icache_entry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    icache_entry** buckets;
+    size_t n_buckets;  // A power of 2, 0 when the cache is off.
+    icache_entry* hand;
+    size_t bytes;
+    size_t budget;
+    uint64_t hits;
+    uint64_t misses;
+} icache_shard;
+
+static icache_shard shards[ICACHE_SHARDS];
+static int locks_ready;
+static size_t record_size;
+
+static uint32_t hash_id(const uint8_t* id) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (int i = 0; i < ICACHE_ID_SIZE; ++i) h = (h ^ id[i]) * 16777619u;
+    return h;
+}
+
+// The low bits of the hash pick the bucket, so the shard is picked with the high ones.
+static icache_shard* shard_of(uint32_t h) {
+    return &shards[(h >> 24) % ICACHE_SHARDS];
+}
+
+static size_t entry_size() {
+    return sizeof(icache_entry) + record_size;
+}
+
+// Finds the entry and the link that points to it in its bucket.
+static icache_entry** find(icache_shard* s, const uint8_t* id, uint32_t h) {
+    icache_entry** link = &s->buckets[h & (s->n_buckets - 1)];
+    for (; *link != NULL; link = &(*link)->next) {
+        icache_entry* e = *link;
+        if (e->hash == h && !memcmp(e->id, id, ICACHE_ID_SIZE))
+            break;
+    }
+    return link;
+}
+
+static void unlink_ring(icache_shard* s, icache_entry* e) {
+    if (e->ahead == e) {
+        s->hand = NULL;
+        return;
+    }
+    e->behind->ahead = e->ahead;
+    e->ahead->behind = e->behind;
+    if (s->hand == e) s->hand = e->ahead;
+}
+
+// Puts the entry just behind the hand, so it is the last one the hand comes to.
+static void push_ring(icache_shard* s, icache_entry* e) {
+    if (s->hand == NULL) {
+        e->ahead = e->behind = e;
+        s->hand = e;
+        return;
+    }
+    e->ahead = s->hand;
+    e->behind = s->hand->behind;
+    e->behind->ahead = e;
+    s->hand->behind = e;
+}
+
+static void drop(icache_shard* s, icache_entry** link) {
+    icache_entry* e = *link;
+    *link = e->next;
+    unlink_ring(s, e);
+    s->bytes -= entry_size();
+    free(e);
+}
+
+// Goes round the ring, giving the entries used since the last round another chance.
+static void evict(icache_shard* s) {
+    while (s->bytes > s->budget && s->hand != NULL) {
+        icache_entry* e = s->hand;
+        if (e->referenced) {
+            e->referenced = 0;
+            s->hand = e->ahead;
+        } else {
+            drop(s, find(s, e->id, e->hash));
+        }
+    }
+}
+
+void icache_init(size_t max_bytes, size_t size) {
+    if (!locks_ready) {
+        for (int i = 0; i < ICACHE_SHARDS; ++i) pthread_mutex_init(&shards[i].lock, NULL);
+        locks_ready = 1;
+    }
+    icache_destroy();
+    record_size = size;
+    for (int i = 0; i < ICACHE_SHARDS; ++i) {
+        icache_shard* s = &shards[i];
+        pthread_mutex_lock(&s->lock);
+        s->budget = max_bytes / ICACHE_SHARDS;
+        s->hits = s->misses = 0;
+        if (s->budget >= entry_size()) {
+            s->n_buckets = ICACHE_MIN_BUCKETS;
+            while (s->n_buckets < s->budget / entry_size()) s->n_buckets *= 2;
+            s->buckets = calloc(s->n_buckets, sizeof(icache_entry*));
+            if (s->buckets == NULL) s->n_buckets = 0;  // Run without the cache rather than fail.
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+void icache_destroy(void) {
+    if (!locks_ready) return;
+    for (int i = 0; i < ICACHE_SHARDS; ++i) {
+        icache_shard* s = &shards[i];
+        pthread_mutex_lock(&s->lock);
+        while (s->hand != NULL) {
+            icache_entry* e = s->hand;
+            unlink_ring(s, e);
+            free(e);
+        }
+        free(s->buckets);
+        s->buckets = NULL;
+        s->n_buckets = 0;
+        s->bytes = 0;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+int icache_lookup(const uint8_t* id, void* record) {
+    int found = 0;
+    uint32_t h = hash_id(id);
+    icache_shard* s = shard_of(h);
+    pthread_mutex_lock(&s->lock);
+    if (s->n_buckets) {
+        icache_entry* e = *find(s, id, h);
+        if (e != NULL) {
+            e->referenced = 1;
+            memcpy(record, e->record, record_size);
+            found = 1;
+        }
+    }
+    if (found) s->hits++;
+    else s->misses++;
+    pthread_mutex_unlock(&s->lock);
+
+    return found;
+}
+
+void icache_insert(const uint8_t* id, const void* record) {
+    uint32_t h = hash_id(id);
+    icache_shard* s = shard_of(h);
+    pthread_mutex_lock(&s->lock);
+    if (s->n_buckets) {
+        icache_entry* e = *find(s, id, h);
+        if (e == NULL && (e = malloc(entry_size())) != NULL) {
+            memcpy(e->id, id, ICACHE_ID_SIZE);
+            e->hash = h;
+            e->next = s->buckets[h & (s->n_buckets - 1)];
+            s->buckets[h & (s->n_buckets - 1)] = e;
+            push_ring(s, e);
+            s->bytes += entry_size();
+        }
+        if (e != NULL) {
+            memcpy(e->record, record, record_size);
+            e->referenced = 1;
+            evict(s);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void icache_remove(const uint8_t* id) {
+    uint32_t h = hash_id(id);
+    icache_shard* s = shard_of(h);
+    pthread_mutex_lock(&s->lock);
+    if (s->n_buckets) {
+        icache_entry** link = find(s, id, h);
+        if (*link != NULL) drop(s, link);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+void icache_stats(uint64_t* hits, uint64_t* misses) {
+    *hits = *misses = 0;
+    for (int i = 0; i < ICACHE_SHARDS; ++i) {
+        icache_shard* s = &shards[i];
+        pthread_mutex_lock(&s->lock);
+        *hits += s->hits;
+        *misses += s->misses;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef PROJECT_ICACHE_H
+#define PROJECT_ICACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The inode cache keeps the meta data records that were read or written recently, keyed by the uuid of the inode.
+// It is written through: every change to a record goes to the database and to the cache, see set_meta.
+// The records are spread over ICACHE_SHARDS shards by their uuid, each with its own lock,
+// so threads that work on different inodes rarely wait for each other.
+// Each shard evicts with the CLOCK algorithm once it holds more than its part of the budget,
+// set with -o icache_max=<bytes>.
+#define ICACHE_DEFAULT_MAX (4 * 1024 * 1024)
+#define ICACHE_SHARDS 16
+#define ICACHE_ID_SIZE 16
+
+/**
+ * Empties the cache, sets its budget and the size of the records it holds.
+ *
+ * @param max_bytes the memory the entries may take, 0 turns the cache off
+ * @param record_size the size of every record
+ */
+void icache_init(size_t max_bytes, size_t record_size);
+
+/**
+ * Frees every entry.
+ */
+void icache_destroy(void);
+
+/**
+ * Looks a record up, and counts a hit or a miss.
+ *
+ * @param id the uuid of the inode
+ * @param record receives the record on a hit
+ * @return 1 on a hit, 0 on a miss
+ */
+int icache_lookup(const uint8_t* id, void* record);
+
+/**
+ * Records the current contents of a record, replacing what was cached for it.
+ *
+ * @param id the uuid of the inode
+ * @param record the record
+ */
+void icache_insert(const uint8_t* id, const void* record);
+
+/**
+ * Forgets a record, for when it is removed from the database.
+ *
+ * @param id the uuid of the inode
+ */
+void icache_remove(const uint8_t* id);
+
+/**
+ * Reads the counters of all the shards.
+ *
+ * @param hits receives the number of lookups that found their record
+ * @param misses receives the number of lookups that did not
+ */
+void icache_stats(uint64_t* hits, uint64_t* misses);
+
+#endif //PROJECT_ICACHE_H
@@ -0,0 +1,249 @@
+// The inode table: the entries are chained in two hash tables, one by number and one by uuid,
+// which grow as the kernel keeps more inodes.
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "itable.h"
+
+#define ITABLE_MIN_BUCKETS 1024
+
+typedef struct _itable_entry {
+    struct _itable_entry* next_ino;  /* in the bucket of its number */
+    struct _itable_entry* next_id;   /* in the bucket of its uuid */
+    uint64_t ino;
+    uint64_t nlookup;
+    uint64_t listings;  /* of a directory: opendirs not released yet */
+    uint8_t id[ITABLE_ID_SIZE];
+} itable_entry;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static itable_entry** by_ino;
+static itable_entry** by_id;
+static size_t n_buckets;  // A power of 2, the same for both tables.
+static size_t count;
+static uint64_t next_ino;
+static uint8_t root_id[ITABLE_ID_SIZE];
+static uint64_t root_listings;
+
+static uint32_t hash_id(const uint8_t* id) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (int i = 0; i < ITABLE_ID_SIZE; ++i) h = (h ^ id[i]) * 16777619u;
+    return h;
+}
+
+static size_t ino_bucket(uint64_t ino) {
+    return (size_t) ((ino * 11400714819323198485ull) >> 32) & (n_buckets - 1);
+}
+
+static size_t id_bucket(const uint8_t* id) {
+    return hash_id(id) & (n_buckets - 1);
+}
+
+static itable_entry** find_ino(uint64_t ino) {
+    itable_entry** link = &by_ino[ino_bucket(ino)];
+    while (*link != NULL && (*link)->ino != ino) link = &(*link)->next_ino;
+    return link;
+}
+
+static itable_entry** find_id(const uint8_t* id) {
+    itable_entry** link = &by_id[id_bucket(id)];
+    while (*link != NULL && memcmp((*link)->id, id, ITABLE_ID_SIZE)) link = &(*link)->next_id;
+    return link;
+}
+
+// Doubles both tables. If there is no memory for them, the chains just get longer.
+static void grow() {
+    size_t n = n_buckets * 2;
+    itable_entry** new_ino = calloc(n, sizeof(itable_entry*));
+    itable_entry** new_id = calloc(n, sizeof(itable_entry*));
+    if (new_ino == NULL || new_id == NULL) {
+        free(new_ino);
+        free(new_id);
+        return;
+    }
+
+    itable_entry** old_ino = by_ino;
+    size_t old_n = n_buckets;
+    free(by_id);
+    by_ino = new_ino;
+    by_id = new_id;
+    n_buckets = n;
+    for (size_t i = 0; i < old_n; ++i) {
+        itable_entry* e = old_ino[i];
+        while (e != NULL) {
+            itable_entry* next = e->next_ino;
+            e->next_ino = by_ino[ino_bucket(e->ino)];
+            by_ino[ino_bucket(e->ino)] = e;
+            e->next_id = by_id[id_bucket(e->id)];
+            by_id[id_bucket(e->id)] = e;
+            e = next;
+        }
+    }
+    free(old_ino);
+}
+
+void itable_init(const uint8_t* root) {
+    itable_destroy();
+    pthread_mutex_lock(&lock);
+    memcpy(root_id, root, ITABLE_ID_SIZE);
+    next_ino = ITABLE_ROOT + 1;
+    root_listings = 0;
+    n_buckets = ITABLE_MIN_BUCKETS;
+    by_ino = calloc(n_buckets, sizeof(itable_entry*));
+    by_id = calloc(n_buckets, sizeof(itable_entry*));
+    pthread_mutex_unlock(&lock);
+}
+
+void itable_destroy(void) {
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; i < n_buckets && by_ino != NULL; ++i) {
+        itable_entry* e = by_ino[i];
+        while (e != NULL) {
+            itable_entry* next = e->next_ino;
+            free(e);
+            e = next;
+        }
+    }
+    free(by_ino);
+    free(by_id);
+    by_ino = by_id = NULL;
+    n_buckets = 0;
+    count = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+uint64_t itable_ref(const uint8_t* id) {
+    if (!memcmp(id, root_id, ITABLE_ID_SIZE)) return ITABLE_ROOT;
+
+    uint64_t ino = 0;
+    pthread_mutex_lock(&lock);
+    if (by_ino != NULL && by_id != NULL) {
+        itable_entry* e = *find_id(id);
+        if (e == NULL && (e = malloc(sizeof(itable_entry))) != NULL) {
+            memcpy(e->id, id, ITABLE_ID_SIZE);
+            e->ino = next_ino++;
+            e->nlookup = 0;
+            e->listings = 0;
+            e->next_ino = by_ino[ino_bucket(e->ino)];
+            by_ino[ino_bucket(e->ino)] = e;
+            e->next_id = by_id[id_bucket(id)];
+            by_id[id_bucket(id)] = e;
+            if (++count > n_buckets) grow();
+        }
+        if (e != NULL) {
+            e->nlookup++;
+            ino = e->ino;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return ino;
+}
+
+int itable_id(uint64_t ino, uint8_t* id) {
+    if (ino == ITABLE_ROOT) {
+        memcpy(id, root_id, ITABLE_ID_SIZE);
+        return 1;
+    }
+
+    int found = 0;
+    pthread_mutex_lock(&lock);
+    if (by_ino != NULL) {
+        itable_entry* e = *find_ino(ino);
+        if (e != NULL) {
+            memcpy(id, e->id, ITABLE_ID_SIZE);
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return found;
+}
+
+int itable_has(const uint8_t* id) {
+    if (!memcmp(id, root_id, ITABLE_ID_SIZE)) return 1;
+
+    pthread_mutex_lock(&lock);
+    int found = by_id != NULL && *find_id(id) != NULL;
+    pthread_mutex_unlock(&lock);
+
+    return found;
+}
+
+int itable_opendir(uint64_t ino) {
+    int found = 0;
+    pthread_mutex_lock(&lock);
+    if (ino == ITABLE_ROOT) {
+        root_listings++;
+        found = 1;
+    }
+    else if (by_ino != NULL) {
+        itable_entry* e = *find_ino(ino);
+        if (e != NULL) {
+            e->listings++;
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return found;
+}
+
+uint64_t itable_releasedir(uint64_t ino) {
+    uint64_t left = 0;
+    pthread_mutex_lock(&lock);
+    if (ino == ITABLE_ROOT) {
+        if (root_listings) root_listings--;
+        left = root_listings;
+    }
+    else if (by_ino != NULL) {
+        itable_entry* e = *find_ino(ino);
+        if (e != NULL) {
+            if (e->listings) e->listings--;
+            left = e->listings;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return left;
+}
+
+int itable_listed(const uint8_t* id) {
+    int listed = 0;
+    pthread_mutex_lock(&lock);
+    if (!memcmp(id, root_id, ITABLE_ID_SIZE)) {
+        listed = root_listings > 0;
+    }
+    else if (by_id != NULL) {
+        itable_entry* e = *find_id(id);
+        listed = e != NULL && e->listings > 0;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return listed;
+}
+
+int itable_forget(uint64_t ino, uint64_t nlookup, uint8_t* id) {
+    if (ino == ITABLE_ROOT) return 0;
+
+    int dropped = 0;
+    pthread_mutex_lock(&lock);
+    if (by_ino != NULL) {
+        itable_entry** link = find_ino(ino);
+        itable_entry* e = *link;
+        if (e != NULL) {
+            e->nlookup = nlookup < e->nlookup ? e->nlookup - nlookup : 0;
+            if (e->nlookup == 0) {
+                *link = e->next_ino;
+                *find_id(e->id) = e->next_id;
+                memcpy(id, e->id, ITABLE_ID_SIZE);
+                count--;
+                free(e);
+                dropped = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return dropped;
+}
@@ -0,0 +1,86 @@
+#ifndef PROJECT_ITABLE_H
+#define PROJECT_ITABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The inode table holds the inode numbers that were handed to the kernel, with the uuids of the inodes
+// they stand for, the number of lookups the kernel has not forgotten yet and the listings it has open.
+// Each operation names its file or its parent directory by number, which is turned back into the uuid here,
+// so no path has to be walked. Numbers are handed out as the kernel looks the inodes up and are never reused,
+// the root is always ITABLE_ROOT.
+#define ITABLE_ROOT 1
+#define ITABLE_ID_SIZE 16
+
+/**
+ * Empties the table, leaving only the root.
+ *
+ * @param root the uuid of the root inode
+ */
+void itable_init(const uint8_t* root);
+
+/**
+ * Frees every entry.
+ */
+void itable_destroy(void);
+
+/**
+ * Counts a lookup of an inode, giving it a number if it does not have one.
+ *
+ * @param id the uuid of the inode
+ * @return the number of the inode, 0 if there was no memory for it
+ */
+uint64_t itable_ref(const uint8_t* id);
+
+/**
+ * Finds the inode that a number stands for.
+ *
+ * @param ino the number
+ * @param id receives the uuid of the inode
+ * @return 1 if the number is known, 0 otherwise
+ */
+int itable_id(uint64_t ino, uint8_t* id);
+
+/**
+ * Tells whether the kernel may still use an inode.
+ *
+ * @param id the uuid of the inode
+ * @return 1 if the inode has a number, 0 otherwise
+ */
+int itable_has(const uint8_t* id);
+
+/**
+ * Counts a listing of a directory that the kernel opened, see itable_listed.
+ *
+ * @param ino the number of the directory
+ * @return 1 if the number is known, 0 otherwise
+ */
+int itable_opendir(uint64_t ino);
+
+/**
+ * Takes back a listing that itable_opendir counted.
+ *
+ * @param ino the number of the directory
+ * @return the number of listings of the directory still open
+ */
+uint64_t itable_releasedir(uint64_t ino);
+
+/**
+ * Tells whether a directory is being listed, in which case its entries should stay where they are.
+ *
+ * @param id the uuid of the directory
+ * @return 1 if a listing of the directory is open, 0 otherwise
+ */
+int itable_listed(const uint8_t* id);
+
+/**
+ * Takes back lookups of an inode, and its number once they are all taken back.
+ *
+ * @param ino the number of the inode
+ * @param nlookup the number of lookups to take back
+ * @param id receives the uuid of the inode if its number was dropped
+ * @return 1 if the number was dropped, 0 otherwise
+ */
+int itable_forget(uint64_t ino, uint64_t nlookup, uint8_t* id);
+
+#endif //PROJECT_ITABLE_H
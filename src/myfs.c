@@ -5,10 +5,12 @@
   And now further implemented by 150009974.
 */
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 29
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <errno.h>
+#include <poll.h>
+#include <stddef.h>
 
 #include "myfs.h"
 
@@ -18,6 +20,31 @@ myfcb the_root_fcb;
 // This is the pointer to the database we will use to store all our files
 unqlite* pDb;
 uuid_t zero_uuid;
+struct myfs_dedup_stats dedup_stats;
+struct myfs_lookup_stats lookup_stats;
+
+struct myfs_config config;
+#define MYFS_OPT(templ, field, value) { templ, offsetof(struct myfs_config, field), value }
+static struct fuse_opt myfs_opts[] = {
+        MYFS_OPT("nowrite_buf", no_write_buf, 1),
+        MYFS_OPT("noprefetch", no_prefetch, 1),
+        MYFS_OPT("dedup", dedup, 1),
+        MYFS_OPT("inline_max=%u", inline_max, 0),
+        MYFS_OPT("compress=none", codec, CODEC_NONE),
+        MYFS_OPT("compress=lz", codec, CODEC_LZ),
+        MYFS_OPT("dcache_max=%u", dcache_max, 0),
+        MYFS_OPT("icache_max=%u", icache_max, 0),
+        MYFS_OPT("entry_timeout=%lf", entry_timeout, 0),
+        MYFS_OPT("attr_timeout=%lf", attr_timeout, 0),
+        MYFS_OPT("negative_timeout=%lf", negative_timeout, 0),
+        MYFS_OPT("strictatime", atime, ATIME_STRICT),
+        MYFS_OPT("relatime", atime, ATIME_RELATIVE),
+        MYFS_OPT("noatime", atime, ATIME_NONE),
+        MYFS_OPT("lazytime", lazytime, 1),
+        MYFS_OPT("dirty_max=%u", dirty_max, 0),
+        MYFS_OPT("dirty_expire=%u", dirty_expire, 0),
+        FUSE_OPT_END
+};
 //</editor-fold>
 
 /** ============================= Helper functions ============================= */
@@ -45,6 +72,7 @@ static int fetch(void* key, int key_len, void* data, unqlite_int64* data_len) {
     }
     LOG_FUNC("\"\n");
 
+    lookup_stats.lookups++;
     int rc = unqlite_kv_fetch(pDb, key, key_len, data, data_len);
     TEST_CONDITION(rc == UNQLITE_NOTFOUND, "\tfetch - entry not found", -ENOENT);
     TEST_CONDITION(rc == UNQLITE_IOERR, "\tfetch - os error", -EIO);
@@ -53,6 +81,11 @@ static int fetch(void* key, int key_len, void* data, unqlite_int64* data_len) {
     return 0;
 }
 
+static void make_meta_key(uuid_t data, char* key) {
+    memcpy(key, META_PREFIX, META_PREFIX_SIZE);
+    memcpy(key + META_PREFIX_SIZE, data, KEY_SIZE);
+}
+
 static int get_meta(uuid_t data, meta_data* md) {
     int iLog = 0;
     LOG_FUNC("\tGET META data=\"");
@@ -61,11 +94,14 @@ static int get_meta(uuid_t data, meta_data* md) {
     }
     LOG_FUNC("\"\n");
 
+    if (dirty_lookup(data, md)) return 0;
+    if (icache_lookup(data, md)) return 0;
+
     char key[META_KEY_SIZE];
-    memcpy(key, META_PREFIX, META_PREFIX_SIZE);
-    memcpy(key + META_PREFIX_SIZE, data, KEY_SIZE);
+    make_meta_key(data, key);
     unqlite_int64 size = META_DATA_SIZE;
     int CHECKED_CALL(fetch, key, META_KEY_SIZE, md, &size);
+    icache_insert(data, md);
 
     return 0;
 }
@@ -79,481 +115,1848 @@ static int set_meta(uuid_t data, meta_data* md) {
     LOG_FUNC("\"\n");
 
     char key[META_KEY_SIZE];
-    memcpy(key, META_PREFIX, META_PREFIX_SIZE);
-    memcpy(key + META_PREFIX_SIZE, data, KEY_SIZE);
-    md->ctime = time(NULL);  // Update time of last change
+    make_meta_key(data, key);
+    dirty_remove(data);
+    if (md->inlined) {
+        // Keep the inline contents that follow the meta data.
+        int rc = unqlite_kv_store_range(pDb, key, META_KEY_SIZE, 0, md, META_DATA_SIZE);
+        TEST_CONDITION(rc, "\tset_meta - failed to update the meta data of an inline file", -EIO);
+        icache_insert(data, md);
+        return 0;
+    }
     int CHECKED_CALL(store, key, META_KEY_SIZE, md, META_DATA_SIZE);
+    icache_insert(data, md);
 
     return 0;
 }
 
-static int remove_meta(uuid_t data) {
+/**
+ * Fetches the meta data of a file together with its contents if they are inline,
+ * with a single lookup.
+ *
+ * @param data the uuid of the file's data
+ * @param rec receives the meta data, and md.size bytes of contents if md.inlined is set
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int get_meta_inline(uuid_t data, inline_record* rec) {
     int iLog = 0;
-    LOG_FUNC("\tREMOVE META data=\"");
-    for (int i = 0; i < KEY_SIZE; ++i) {
-        LOG_FUNC("%c", data[i]);
+    LOG_FUNC("\tGET META INLINE\n");
+
+    // The caches only have the meta data, the contents of an inline file are still fetched.
+    meta_data changed;
+    int dirty = dirty_lookup(data, &changed);
+    if (dirty && !changed.inlined) {
+        rec->md = changed;
+        return 0;
     }
-    LOG_FUNC("\"\n");
+    if (!dirty && icache_lookup(data, &rec->md) && !rec->md.inlined) return 0;
 
     char key[META_KEY_SIZE];
-    memcpy(key, META_PREFIX, META_PREFIX_SIZE);
-    memcpy(key + META_PREFIX_SIZE, data, KEY_SIZE);
-
-    int rc = unqlite_kv_delete(pDb, key, META_KEY_SIZE);
-    TEST_CONDITION(rc, "\tremove_meta - failed to remove entry", -EIO);
+    make_meta_key(data, key);
+    unqlite_int64 size = sizeof(inline_record);
+    int CHECKED_CALL(fetch, key, META_KEY_SIZE, rec, &size);
+    TEST_CONDITION(size < META_DATA_SIZE, "\tget_meta_inline - meta data is too short", -EIO);
+    TEST_CONDITION(rec->md.inlined && size != META_DATA_SIZE + rec->md.size,
+                   "\tget_meta_inline - inline contents do not match the size", -EIO);
+    if (dirty) rec->md = changed;
+    icache_insert(data, &rec->md);
 
     return 0;
 }
 
-static int set_nlinks(uuid_t data, __nlink_t n) {
+/**
+ * Stores the meta data of a file followed by its first md.size bytes of contents,
+ * which makes the file inline.
+ *
+ * @param data the uuid of the file's data
+ * @param rec the meta data and the contents
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int set_meta_inline(uuid_t data, inline_record* rec) {
     int iLog = 0;
-    LOG_FUNC("\tSET NUMBER OF LINKS data=\"");
-    for (int i = 0; i < KEY_SIZE; ++i) {
-        LOG_FUNC("%c", data[i]);
-    }
-    LOG_FUNC("\"  n=%lld\n", n);
+    LOG_FUNC("\tSET META INLINE size=%lld\n", rec->md.size);
+
+    char key[META_KEY_SIZE];
+    make_meta_key(data, key);
+    rec->md.inlined = 1;
+    dirty_remove(data);
+    int CHECKED_CALL(store, key, META_KEY_SIZE, rec, META_DATA_SIZE + rec->md.size);
+    icache_insert(data, &rec->md);
 
-    meta_data md;
-    int CHECKED_CALL(get_meta, data, &md);
-    md.nlinks = n;
-    LOG_GENERAL("\t\treceived\n");
-    CHECKED_CALL(set_meta, data, &md);
     return 0;
 }
 
-static int get_nlinks(uuid_t data, __nlink_t* n) {
+static int remove_meta(uuid_t data) {
     int iLog = 0;
-    LOG_FUNC("\tGET NUMBER OF LINKS data=\"");
+    LOG_FUNC("\tREMOVE META data=\"");
     for (int i = 0; i < KEY_SIZE; ++i) {
         LOG_FUNC("%c", data[i]);
     }
     LOG_FUNC("\"\n");
 
-    meta_data md;
-    int CHECKED_CALL(get_meta, data, &md);
-    *n = md.nlinks;
+    char key[META_KEY_SIZE];
+    make_meta_key(data, key);
+
+    dirty_remove(data);
+    icache_remove(data);
+    int rc = unqlite_kv_delete(pDb, key, META_KEY_SIZE);
+    TEST_CONDITION(rc, "\tremove_meta - failed to remove entry", -EIO);
+
     return 0;
 }
 
-static int index_of_last_dash(const char* path) {
+// When the records in the dirty table were last all stored, see set_meta_lazy.
+static time_t last_flush;
+
+/**
+ * Stores the meta data records that were only changed in memory, see set_meta_lazy.
+ * Only the meta data is written, the inline contents that follow it stay as they are.
+ * This has to be done before every commit, see dirty.h.
+ *
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int flush_dirty() {
     int iLog = 0;
-    LOG_FUNC("\tINDEX OF LAST DASH  path=\"%s\"\n", path);
-    int ind = -1, i;
-    for (i = 0; path[i] != '\0'; i++)
-        if (path[i] == '/' && path[i + 1] != '\0')
-            ind = i;
-    LOG_GENERAL("\t\tind=%d\n", ind);
-    return ind;
+    LOG_FUNC("\tFLUSH DIRTY\n");
+
+    uuid_t data;
+    meta_data md;
+    char key[META_KEY_SIZE];
+    last_flush = time(0);
+    while (dirty_take(data, &md)) {
+        make_meta_key(data, key);
+        int rc = unqlite_kv_store_range(pDb, key, META_KEY_SIZE, 0, &md, META_DATA_SIZE);
+        if (rc) dirty_put(data, &md);  // Keep it for the next batch.
+        TEST_CONDITION(rc, "\tflush_dirty - failed to store the meta data", -EIO);
+    }
+
+    return 0;
 }
 
-static void get_parent_path(const char* path, char* parent_path_buff, size_t n) {
+/**
+ * Changes the meta data of a file in memory only, to be stored with the next batch, see dirty.h.
+ * Stores it right away when the table is turned off or there is no memory to keep it.
+ *
+ * @param data the uuid of the file
+ * @param md the meta data
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int set_meta_lazy(uuid_t data, meta_data* md) {
     int iLog = 0;
-    LOG_FUNC("\t\tGET PARENT PATH  path=\"%s\"\n", path);
-    int ind = index_of_last_dash(path);
-    if (ind == -1) ind = 0;
-    memcpy(parent_path_buff, path, ind);
-    for (int i = ind; i < n; ++i)
-        parent_path_buff[i] = '\0';
+    LOG_FUNC("\tSET META LAZY\n");
+
+    size_t dirty = config.dirty_max ? dirty_put(data, md) : 0;
+    if (dirty == 0) return set_meta(data, md);
+    icache_insert(data, md);
+    if (dirty >= config.dirty_max || time(0) - last_flush >= (time_t) config.dirty_expire) return flush_dirty();
+
+    return 0;
+}
 
-    LOG_FUNC("\t\t\tparent path=\"%s\"\n", parent_path_buff);
+/**
+ * Tells whether two meta data records of a file differ in more than the access time.
+ * The fields are compared one by one, the padding between them may differ.
+ *
+ * @return 1 if they do, 0 otherwise
+ */
+static int changed_beyond_atime(const meta_data* md, const meta_data* other) {
+    return md->mode != other->mode || md->uid != other->uid || md->gid != other->gid ||
+           md->size != other->size || md->nlinks != other->nlinks || md->mtime != other->mtime ||
+           md->ctime != other->ctime || md->blocks != other->blocks || md->inlined != other->inlined ||
+           md->saved != other->saved;
 }
 
 /**
- * Fetches the data pointed to by the fcb's data
- * and stores it in the memory pointed to by data.
+ * Stores the meta data of a file if it was changed in memory only, and not just its access time:
+ * with lazytime an access time waits for the next batch, an fsync or the unmount, see dirty.h.
  *
- * @param fcb a pointer to the fcb with the data to fetch
- * @param data the location where to put the data
+ * @param data the uuid of the file
  * @return 0 on success, an appropriate error code otherwise
- *                       (this code is to be returned to the OS)
  */
-static int get_data(myfcb fcb, void* data) {
+static int flush_inode(uuid_t data) {
     int iLog = 0;
-    LOG_FUNC("\tGET DATA fcb.path=\"%s\"\n", fcb.path);
-    LOG_FCB(fcb);
-    LOG_GENERAL("\t\tfcb.data:\"");
-    for (int i = 0; i < KEY_SIZE; ++i) {
-        LOG_GENERAL("%c", fcb.data[i]);
-    }
-    LOG_GENERAL("\"\n");
+    LOG_FUNC("\tFLUSH INODE\n");
 
-    meta_data md;
-    int CHECKED_CALL(get_meta, fcb.data, &md);
-    unqlite_int64 size_of_data = md.size * MY_DENTRY_SIZE;
-    CHECKED_CALL(fetch, fcb.data, KEY_SIZE, data, &size_of_data);
+    meta_data md, stored;
+    if (!dirty_lookup(data, &md)) return 0;
+    char key[META_KEY_SIZE];
+    make_meta_key(data, key);
+    unqlite_int64 size = META_DATA_SIZE;
+    if (fetch(key, META_KEY_SIZE, &stored, &size) == 0 && !changed_beyond_atime(&md, &stored)) return 0;
+    int CHECKED_CALL(set_meta, data, &md);
 
     return 0;
 }
 
 /**
- * Given a path, finds the FCB for it and stores it in the given buffer.
+ * Records an access to a file, if the atime policy of the mount asks for it.
+ * The time has a resolution of a second, so a file read again within the same second is not written again.
  *
- * @param path the path to look for
- * @param fcb_buff the location to store the found fcb
+ * @param data the uuid of the file
+ * @param md the meta data of the file, which receives the new access time
  * @return 0 on success, an appropriate error code otherwise
- *                       (this code is to be returned to the OS)
  */
-static int get_fcb(const char* path, myfcb* fcb_buff) {
+static int touch_atime(uuid_t data, meta_data* md) {
     int iLog = 0;
-    LOG_FUNC("\tGET FCB path=\"%s\"\n", path);
-
-    if (strcmp(path, the_root_fcb.path) == 0 || strcmp(path, "/") == 0) {
-        LOG_CLARIFY("\t\treached root\n");
-        unqlite_int64 size_of_buff = MYFCB_SIZE;
+    LOG_FUNC("\tTOUCH ATIME atime=%ld\n", (long) md->atime);
 
-        int CHECKED_CALL(fetch, ROOT_OBJECT_KEY, ROOT_OBJECT_KEY_SIZE, fcb_buff, &size_of_buff);
+    time_t now = time(0);
+    if (config.atime == ATIME_NONE || md->atime == now) return 0;
+    if (config.atime == ATIME_RELATIVE && md->atime > md->mtime && md->atime > md->ctime &&
+        now - md->atime < 24 * 60 * 60)
         return 0;
-    }
 
-    myfcb parent;
-    size_t n = strlen(path);
-    char parent_path[n + 1];
-    get_parent_path(path, parent_path, n);
-    int CHECKED_CALL(get_fcb, parent_path, &parent);
-    TEST_CONDITION(!S_ISDIR(parent.mode), "\t---get_fcb part of path is not directory", -ENOTDIR);
+    md->atime = now;
+    return config.lazytime ? set_meta_lazy(data, md) : set_meta(data, md);
+}
 
-    LOG_CLARIFY("\t\tparent:\n");
-    LOG_FCB(parent);
+static int index_of_last_dash(const char* path) {
+    int iLog = 0;
+    LOG_FUNC("\tINDEX OF LAST DASH  path=\"%s\"\n", path);
+    int ind = -1, i;
+    for (i = 0; path[i] != '\0'; i++)
+        if (path[i] == '/' && path[i + 1] != '\0')
+            ind = i;
+    LOG_GENERAL("\t\tind=%d\n", ind);
+    return ind;
+}
 
-    meta_data md;
-    CHECKED_CALL(get_meta, parent.data, &md);
-    LOG_META(md);
+// The last component of a path, which is the name of its entry in the parent directory.
+static const char* base_name(const char* path) {
+    return path + index_of_last_dash(path) + 1;
+}
 
-    char data[md.size * MY_DENTRY_SIZE];
-    CHECKED_CALL(get_data, parent, data);
+static int make_dent_key(uuid_t dir, const char* name, char* key) {
+    size_t len = strlen(name);
+    memcpy(key, DENT_PREFIX, DENT_PREFIX_SIZE);
+    memcpy(key + DENT_PREFIX_SIZE, dir, KEY_SIZE);
+    memcpy(key + DENT_PREFIX_SIZE + KEY_SIZE, name, len);
+    return DENT_KEY_SIZE(len);
+}
 
-    LOG_CLARIFY("\t\tlooking for path = \"%s\"\n", path);
-    LOG_GENERAL("\t\tin this data:\n");
-    for (int i = 0; i < md.size; ++i) {
-        LOG_GENERAL("\t\t\t\"%s\"\n", data + i * MY_DENTRY_SIZE + KEY_SIZE);
-    }
-    char* child_path;
-    int i;
-    for (i = 0; i < md.size; ++i) {
-        child_path = data + i * MY_DENTRY_SIZE + KEY_SIZE;
+/**
+ * Looks a name up in the index of a directory, through the dentry cache.
+ *
+ * @param dir the data uuid of the directory
+ * @param name the name of the entry
+ * @param entry receives the fcb id and the offset of the entry's dentry
+ * @return 0 on success, -ENOENT if there is no such entry, another error code otherwise
+ */
+static int get_dent(uuid_t dir, const char* name, dent* entry) {
+    int iLog = 0;
+    LOG_FUNC("\tGET DENT name=\"%s\"\n", name);
 
-        LOG_CLARIFY("\t\tchild_path = \"%s\"\n", child_path);
+    int cached = dcache_lookup(dir, name, entry->id, &entry->offset);
+    TEST_CONDITION(cached == DCACHE_NEGATIVE, "\tget_dent - known to be missing", -ENOENT);
+    if (cached == DCACHE_HIT) return 0;
 
-        // If this is the child we are looking for, great.
-        if (!strcmp(child_path, path)) break;
-        if (!strcmp(child_path + 1, path)) break;  // ignoring leading /
-    }
+    char key[DENT_KEY_SIZE(strlen(name))];
+    int key_len = make_dent_key(dir, name, key);
+    unqlite_int64 len = sizeof(dent);
+    int rc = fetch(key, key_len, entry, &len);
+    if (rc == -ENOENT) dcache_insert(dir, name, NULL, 0);
+    if (rc) return rc;
+    TEST_CONDITION(len != sizeof(dent), "\tget_dent - bad index entry", -EIO);
+    dcache_insert(dir, name, entry->id, entry->offset);
 
-    TEST_CONDITION((i == md.size), "\t---get_fcb failed to find child", -ENOENT);
+    return 0;
+}
 
-    uuid_t id;
-    memcpy(id, data + i * MY_DENTRY_SIZE, KEY_SIZE);
-    LOG_CLARIFY("\t\tid=\"%s\"\n", id);
+static int set_dent(uuid_t dir, const char* name, const unsigned char* id, uint64_t offset) {
+    int iLog = 0;
+    LOG_FUNC("\tSET DENT name=\"%s\"  offset=%llu\n", name, (unsigned long long) offset);
 
-    unqlite_int64 buff_size = MYFCB_SIZE;
-    CHECKED_CALL(fetch, id, KEY_SIZE, fcb_buff, &buff_size);
+    char key[DENT_KEY_SIZE(strlen(name))];
+    int key_len = make_dent_key(dir, name, key);
+    dent entry = {.offset = offset};
+    memcpy(entry.id, id, KEY_SIZE);
+    int CHECKED_CALL(store, key, key_len, &entry, sizeof(entry));
+    dcache_insert(dir, name, id, offset);
 
     return 0;
 }
 
-static int get_parent_fcb(const char* path, myfcb* parent_fcb) {
+static int remove_dent(uuid_t dir, const char* name) {
     int iLog = 0;
-    LOG_FUNC("\tGET PARENT FCB  path=\"%s\"\n", path);
+    LOG_FUNC("\tREMOVE DENT name=\"%s\"\n", name);
 
-    size_t len = strlen(path);
-    char parent_path[len];
-    get_parent_path(path, parent_path, len);
-    LOG_GENERAL("\t\tparen path=\"%s\"\n", parent_path);
+    char key[DENT_KEY_SIZE(strlen(name))];
+    int key_len = make_dent_key(dir, name, key);
+    int rc = unqlite_kv_delete(pDb, key, key_len);
+    TEST_CONDITION(rc, "\tremove_dent - failed to remove entry", -EIO);
+    dcache_insert(dir, name, NULL, 0);
 
-    int CHECKED_CALL(get_fcb, parent_path, parent_fcb);
     return 0;
 }
 
-static int get_child_fcb(const char* child_path, char* data, off_t number_of_files, myfcb* child_fcb, int* index) {
+/**
+ * Reads the dentry at an offset in the list of a directory.
+ *
+ * @param dir the data uuid of the directory
+ * @param offset the offset of the dentry
+ * @param head receives the dentry without the name
+ * @param name receives the null terminated name, room for UINT8_MAX + 1 bytes is needed
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int read_dentry(uuid_t dir, uint64_t offset, dentry_head* head, char* name) {
     int iLog = 0;
-    LOG_FUNC("\tGET CHILD FCB  child=\"%s\"\n", child_path);
-
-    int i;
-    for (i = 0; i < number_of_files; ++i) {
-        char* current_child = data + i * MY_DENTRY_SIZE + KEY_SIZE;
-        LOG_CLARIFY("\t\tcurrent_child=\"%s\"\n", current_child);
-        if (!strcmp(child_path, current_child)) break;
-    }
-    TEST_CONDITION(i == number_of_files, "get_child_fcb - could not find path in data", -ENONET);
+    LOG_FUNC("\tREAD DENTRY offset=%llu\n", (unsigned long long) offset);
+
+    char buf[DENTRY_MAX_LEN];
+    unqlite_int64 len = DENTRY_MAX_LEN;
+    lookup_stats.lookups++;
+    int rc = unqlite_kv_fetch_range(pDb, dir, KEY_SIZE, (unqlite_int64) offset, &len, buf);
+    TEST_CONDITION(rc || len < (unqlite_int64) sizeof(dentry_head), "\tread_dentry - failed to read the dentry", -EIO);
+    memcpy(head, buf, sizeof(dentry_head));
+    TEST_CONDITION(len < (unqlite_int64) (sizeof(dentry_head) + head->name_len), "\tread_dentry - bad dentry", -EIO);
+    memcpy(name, buf + sizeof(dentry_head), head->name_len);
+    name[head->name_len] = '\0';
 
-    char child_uuid[KEY_SIZE];
-    memcpy(child_uuid, data + i * MY_DENTRY_SIZE, KEY_SIZE);
-    LOG_GENERAL("\t\tchild_uuid=\"%s\"\n", child_uuid);
+    return 0;
+}
 
-    unqlite_int64 buff_size = MYFCB_SIZE;
-    int CHECKED_CALL(fetch, child_uuid, KEY_SIZE, child_fcb, &buff_size);
-    *index = i;
+/**
+ * Writes a dentry and the copy of its rec_len at the end of the space it covers.
+ *
+ * @param dir the data uuid of the directory
+ * @param offset the offset of the dentry
+ * @param head the dentry without the name
+ * @param name the name of the entry, head->name_len bytes
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int write_dentry(uuid_t dir, uint64_t offset, const dentry_head* head, const char* name) {
+    int iLog = 0;
+    LOG_FUNC("\tWRITE DENTRY offset=%llu  rec_len=%u\n", (unsigned long long) offset, head->rec_len);
+
+    char buf[DENTRY_MAX_LEN];
+    size_t len = sizeof(dentry_head) + head->name_len;
+    memcpy(buf, head, sizeof(dentry_head));
+    memcpy(buf + sizeof(dentry_head), name, head->name_len);
+    // Usually the dentry has no free space after it, and the copy of rec_len goes in the same store.
+    if (head->rec_len == DENTRY_LEN(head->name_len)) {
+        memcpy(buf + len, &head->rec_len, sizeof(uint32_t));
+        len += sizeof(uint32_t);
+    }
+    int rc = unqlite_kv_store_range(pDb, dir, KEY_SIZE, (unqlite_int64) offset, buf, (unqlite_int64) len);
+    TEST_CONDITION(rc, "\twrite_dentry - failed to store the dentry", -EIO);
+    if (head->rec_len != DENTRY_LEN(head->name_len)) {
+        rc = unqlite_kv_store_range(pDb, dir, KEY_SIZE, (unqlite_int64) (offset + head->rec_len - sizeof(uint32_t)),
+                                    &head->rec_len, sizeof(uint32_t));
+        TEST_CONDITION(rc, "\twrite_dentry - failed to store the dentry length", -EIO);
+    }
 
     return 0;
 }
 
-static int get_fcb_and_meta(const char* path, myfcb* fcb, meta_data* md) {
+/**
+ * Starts going through the list of a directory, see next_dentry. The reader is freed with close_dentries.
+ *
+ * @param reader the reader
+ * @param dir the data uuid of the directory
+ * @param size the size of the list
+ * @param offset the offset of the first dentry to read
+ * @param chunk the most bytes to read at a time, at least DENTRY_MAX_LEN
+ * @return 0 on success, -ENOMEM
+ */
+static int open_dentries(dentry_reader* reader, const unsigned char* dir, off_t size, off_t offset, size_t chunk) {
     int iLog = 0;
-    LOG_FUNC("\tGET FCB & META path=\"%s\"\n", path);
-    int CHECKED_CALL(get_fcb, path, fcb);
-    CHECKED_CALL(get_meta, fcb->data, md);
+    reader->dir = dir;
+    reader->size = size;
+    reader->next = offset;
+    reader->start = offset;
+    reader->len = 0;
+    reader->chunk = chunk;
+    reader->buf = malloc(chunk);
+    TEST_CONDITION(reader->buf == NULL, "\topen_dentries - out of memory", -ENOMEM);
+
+    return 0;
 }
 
 /**
- * Creates and attaches a new FCB to the tree hierarchy of the file system.
+ * Reads the next dentry of a list, and the next part of the list when the dentry is not whole in the last one.
  *
- * @param path the path of the new FCB
- * @param mode the mode of the new FCB
- * @param fcb  a memory location to put the fcb data to avoid a call to 'get_fcb'
- *          ignored if NULL is passed
- * @return 0 on success, or an appropriate error code
- *                          (this code is to be returned to the OS)
+ * @param reader the reader
+ * @param offset receives the offset of the dentry
+ * @param head receives the dentry without the name
+ * @param name receives the null terminated name, room for UINT8_MAX + 1 bytes is needed
+ * @return 1 if a dentry was read, 0 at the end of the list, an appropriate error code otherwise
  */
-static int attach_fcb_to_tree(const char* path, mode_t mode, myfcb* fcb, meta_data* md) {
+static int next_dentry(dentry_reader* reader, off_t* offset, dentry_head* head, char* name) {
     int iLog = 0;
-    LOG_FUNC("\tATTACH TO TREE path=\"%s\"  mode=0%03o\n", path, mode);
+    if (reader->next >= reader->size) return 0;
+
+    off_t at = reader->next - reader->start;
+    if (at + (off_t) sizeof(dentry_head) > reader->len ||
+        at + (off_t) (sizeof(dentry_head) + (uint8_t) reader->buf[at + offsetof(dentry_head, name_len)]) > reader->len) {
+        unqlite_int64 len = reader->size - reader->next;
+        if (len > (unqlite_int64) reader->chunk) len = (unqlite_int64) reader->chunk;
+        lookup_stats.lookups++;
+        int rc = unqlite_kv_fetch_range(pDb, reader->dir, KEY_SIZE, (unqlite_int64) reader->next, &len, reader->buf);
+        TEST_CONDITION(rc, "\tnext_dentry - failed to read the dentries", -EIO);
+        reader->start = reader->next;
+        reader->len = len;
+        at = 0;
+    }
 
-    // Check if path length is of acceptable length
-    TEST_CONDITION(strlen(path) >= MY_MAX_PATH, "attach_fcb_to_tree - path too long", -ENAMETOOLONG);
+    TEST_CONDITION(at + (off_t) sizeof(dentry_head) > reader->len, "\tnext_dentry - bad offset", -EIO);
+    memcpy(head, reader->buf + at, sizeof(dentry_head));
+    TEST_CONDITION(at + (off_t) (sizeof(dentry_head) + head->name_len) > reader->len ||
+                   head->rec_len < DENTRY_LEN(head->name_len) || reader->next + head->rec_len > reader->size,
+                   "\tnext_dentry - bad dentry", -EIO);
+    memcpy(name, reader->buf + at + sizeof(dentry_head), head->name_len);
+    name[head->name_len] = '\0';
+    *offset = reader->next;
+    reader->next += head->rec_len;
+
+    return 1;
+}
 
-    // Get parent
-    myfcb parent_fcb;
-    meta_data parent_md;
-    int CHECKED_CALL(get_parent_fcb, path, &parent_fcb);
-    CHECKED_CALL(get_meta, parent_fcb.data, &parent_md);
-    int size_of_data = parent_md.size * MY_DENTRY_SIZE;
-    char data[size_of_data + MY_DENTRY_SIZE];
-    CHECKED_CALL(get_data, parent_fcb, data);
+// Frees the buffer of a reader that open_dentries set up.
+static void close_dentries(dentry_reader* reader) {
+    free(reader->buf);
+    reader->buf = NULL;
+}
 
-    // Create new FCB
-    struct fuse_context* context = fuse_get_context();
-    myfcb new_fcb = create_fcb(path, context->uid, context->gid, mode);
-    LOG_FCB(new_fcb);
-    meta_data new_md = create_meta_data();
-    LOG_GENERAL("\tcreated path:%s\n", new_fcb.path);
+static void make_block_key(uuid_t data, uint64_t index, char* key) {
+    memcpy(key, data, KEY_SIZE);
+    memcpy(key + KEY_SIZE, &index, sizeof(uint64_t));
+}
 
-    // Store the new_fcb in the database.
-    CHECKED_CALL(store, new_fcb.file_data_id, KEY_SIZE, &new_fcb, MYFCB_SIZE);
-    CHECKED_CALL(set_meta, new_fcb.data, &new_md);
+static void make_cas_key(const uint8_t* hash, char* key) {
+    memcpy(key, CAS_PREFIX, CAS_PREFIX_SIZE);
+    memcpy(key + CAS_PREFIX_SIZE, hash, SHA256_SIZE);
+}
 
-    // Add new FCB to parent's data & FCB
-    memcpy(data + size_of_data, new_fcb.file_data_id, KEY_SIZE);
-    memcpy(data + size_of_data + KEY_SIZE, new_fcb.path, MY_MAX_PATH);
+/**
+ * Finds the record that holds the contents of a stored block.
+ * The record of a shared block only holds the hash of its contents.
+ *
+ * @param data the uuid of the file's data
+ * @param index the index of the block
+ * @param state the state of the block in the block map
+ * @param key receives the key of the record, room for CAS_KEY_SIZE bytes is needed
+ * @param key_len receives the length of the key
+ * @param skip receives the number of bytes in the record before the contents
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int block_source(uuid_t data, uint64_t index, uint8_t state, char* key, int* key_len, size_t* skip) {
+    int iLog = 0;
+    make_block_key(data, index, key);
+    *key_len = BLOCK_KEY_SIZE;
+    *skip = 0;
+    if (state != BLOCK_SHARED) return 0;
+
+    uint8_t hash[SHA256_SIZE];
+    unqlite_int64 len = SHA256_SIZE;
+    int CHECKED_CALL(fetch, key, BLOCK_KEY_SIZE, hash, &len);
+    TEST_CONDITION(len != SHA256_SIZE, "\tblock_source - bad shared block reference", -EIO);
+    make_cas_key(hash, key);
+    *key_len = CAS_KEY_SIZE;
+    *skip = CAS_HEADER_SIZE;
 
-    // Update parent in DB
-    CHECKED_CALL(store, parent_fcb.data, KEY_SIZE, data, size_of_data + MY_DENTRY_SIZE);
-    parent_md.size++;
-    parent_md.mtime = time(0);
-    CHECKED_CALL(set_meta, parent_fcb.data, &parent_md);
+    return 0;
+}
 
-    LOG_FCB(new_fcb);
+/**
+ * Fetches a compressed block and decompresses it.
+ *
+ * @param data the uuid of the file's data
+ * @param index the index of the block
+ * @param state the state of the block in the block map, which tells the codec
+ * @param block a buffer of at least MY_BLOCK_SIZE bytes
+ * @param len receives the number of bytes of the block
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int get_compressed_block(uuid_t data, uint64_t index, uint8_t state, uint8_t* block, size_t* len) {
+    int iLog = 0;
+    LOG_FUNC("\tGET COMPRESSED BLOCK index=%llu\n", index);
 
-    if (fcb != NULL) memcpy(fcb, &new_fcb, MYFCB_SIZE);
-    if (md != NULL) memcpy(md, &new_md, META_DATA_SIZE);
+    char key[BLOCK_KEY_SIZE];
+    make_block_key(data, index, key);
+    uint8_t packed[MY_BLOCK_SIZE];
+    unqlite_int64 packed_len = MY_BLOCK_SIZE;
+    int CHECKED_CALL(fetch, key, BLOCK_KEY_SIZE, packed, &packed_len);
+    long n = decompress_block(BLOCK_CODEC(state), packed, (size_t) packed_len, block, MY_BLOCK_SIZE);
+    TEST_CONDITION(n < 0, "\tget_compressed_block - corrupt block", -EIO);
+    *len = (size_t) n;
 
     return 0;
 }
 
-static int detach_fcb_from_tree(myfcb child_fcb, myfcb parent_fcb, int index, void* data) {
+/**
+ * Fetches a single block of file data.
+ * Blocks that were never written and the tails of short blocks are filled with zeros.
+ *
+ * @param data the uuid of the file's data
+ * @param index the index of the block
+ * @param state the state of the block in the block map
+ * @param block a buffer of at least MY_BLOCK_SIZE bytes
+ * @param stored_len if not NULL, receives the number of bytes actually stored for the block
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int get_block(uuid_t data, uint64_t index, uint8_t state, uint8_t* block, size_t* stored_len) {
     int iLog = 0;
-    LOG_FUNC("\tDETACH FROM TREE  child.path=\"%s\"\n", child_fcb.path);
+    LOG_FUNC("\tGET BLOCK index=%llu\n", index);
 
-    // Remove child from DB
-    __nlink_t nlinks;
-    int CHECKED_CALL(get_nlinks, child_fcb.data, &nlinks);
-    nlinks--;
-    if (nlinks == 0) {
-        LOG_CLARIFY("\t\tRemoving data because no more links!\n");
-        // remove data
-        rc = unqlite_kv_delete(pDb, child_fcb.file_data_id, KEY_SIZE);
-        TEST_CONDITION(rc, "myfs_unlink failed to delete child data from DB", -EIO);
-        CHECKED_CALL(remove_meta, child_fcb.data);
-    }
-    else {  // save less link
-        LOG_CLARIFY("\t\tReducing number of links to data!\n");
-        CHECKED_CALL(set_nlinks, child_fcb.data, nlinks);
+    int rc;
+    unqlite_int64 len = MY_BLOCK_SIZE;
+    if (IS_COMPRESSED(state)) {
+        size_t n;
+        CHECKED_CALL(get_compressed_block, data, index, state, block, &n);
+        len = n;
     }
-
-    // Remove child from parent_fcb's data
-    meta_data parent_md;
-    CHECKED_CALL(get_meta, parent_fcb.data, &parent_md);
-    parent_md.size--;
-    for (int i = index; i < parent_md.size; ++i) {
-        memcpy(data + i * MY_DENTRY_SIZE, data + (i + 1) * MY_DENTRY_SIZE, MY_DENTRY_SIZE);
+    else {
+        char key[CAS_KEY_SIZE];
+        int key_len;
+        size_t skip;
+        CHECKED_CALL(block_source, data, index, state, key, &key_len, &skip);
+        lookup_stats.lookups++;
+        rc = unqlite_kv_fetch_range(pDb, key, key_len, skip, &len, block);
+        if (rc == UNQLITE_NOTFOUND) len = 0;
+        else {
+            TEST_CONDITION(rc, "\tget_block - fetch failed", -EIO);
+        }
     }
 
-    CHECKED_CALL(store, parent_fcb.data, KEY_SIZE, data, parent_md.size * MY_DENTRY_SIZE);
-    CHECKED_CALL(store, parent_fcb.file_data_id, KEY_SIZE, &parent_fcb, MYFCB_SIZE);
-    parent_md.mtime = time(0);
-    CHECKED_CALL(set_meta, parent_fcb.data, &parent_md);
+    memset(block + len, 0, (size_t) (MY_BLOCK_SIZE - len));
+    if (stored_len != NULL) *stored_len = (size_t) len;
 
     return 0;
 }
 
-static int set_permissions(struct fuse_file_info* fi, myfcb fcb) {
+static int set_block(uuid_t data, uint64_t index, const void* block, size_t len) {
     int iLog = 0;
-    int flags = fi->flags;
-    LOG_FUNC("\tACCESS ALLOWED ?  flags=0%03o  myfcb.mode=0%03o\n", flags, fcb.mode);
-    if (S_ISDIR(flags)) {
-        LOG_CLARIFY("\t\tflags is directory\n");
-        TEST_CONDITION(!S_ISDIR(fcb.mode), "attempted to access a non-directory as if its a directory", -ENOTDIR);
-        flags ^= S_IFDIR;
-    }
-    else if (S_ISREG(flags)) {
-        LOG_CLARIFY("\t\tflags is regular\n");
-        TEST_CONDITION(!S_ISREG(fcb.mode), "attempted to access a non-regular file as if its a regular file", -EISDIR);
-        flags ^= S_IFREG;
-    }
-    else if (S_ISLNK(flags)) {
-        LOG_CLARIFY("\t\tflags is symlink\n");
-        TEST_CONDITION(!S_ISLNK(fcb.mode), "attempted to access a non-symlink as if its a symlink", -ENOLINK);
-        flags ^= S_IFLNK;
-    }
+    LOG_FUNC("\tSET BLOCK index=%llu  len=%d\n", index, len);
 
-    LOG_CLARIFY("\t\tpassed initial checks  flags=0%03o\n", flags);
+    char key[BLOCK_KEY_SIZE];
+    make_block_key(data, index, key);
+    int CHECKED_CALL(store, key, BLOCK_KEY_SIZE, (void*) block, len);
 
+    return 0;
+}
 
-    uid_t uid = fuse_get_context()->uid;
-    gid_t gid = fuse_get_context()->gid;
-    LOG_GENERAL("\t\tuid=0%03o  gid=0%03o\n", uid, gid);
+static int save_dedup_stats() {
+    int CHECKED_CALL(store, DEDUP_STATS_KEY, DEDUP_STATS_KEY_SIZE, &dedup_stats, sizeof(dedup_stats));
+    return 0;
+}
 
-    // Take the appropriate permissions.
-    int permissions[3];
-    int R = 0, W = 1, X = 2;
-    if (uid == fcb.uid) {
-        LOG_CLARIFY("\t\towner accessing file\n");
-        permissions[R] = fcb.mode & S_IRUSR;
-        permissions[W] = fcb.mode & S_IWUSR;
-        permissions[X] = fcb.mode & S_IXUSR;
-    }
-    else if (gid == fcb.gid) {
-        LOG_CLARIFY("\t\tgroup accessing file\n");
-        permissions[R] = fcb.mode & S_IRGRP;
-        permissions[W] = fcb.mode & S_IWGRP;
-        permissions[X] = fcb.mode & S_IXGRP;
+/**
+ * Drops one reference to shared contents. The contents are removed with their last reference.
+ *
+ * @param hash the hash of the contents
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int release_shared(const uint8_t* hash) {
+    int iLog = 0;
+    LOG_FUNC("\tRELEASE SHARED\n");
+
+    char key[CAS_KEY_SIZE];
+    make_cas_key(hash, key);
+    unqlite_int64 total;
+    lookup_stats.lookups++;
+    int rc = unqlite_kv_fetch(pDb, key, CAS_KEY_SIZE, NULL, &total);
+    TEST_CONDITION(rc, "\trelease_shared - shared contents are missing", -EIO);
+    uint64_t refs;
+    unqlite_int64 len = CAS_HEADER_SIZE;
+    lookup_stats.lookups++;
+    rc = unqlite_kv_fetch_range(pDb, key, CAS_KEY_SIZE, 0, &len, &refs);
+    TEST_CONDITION(rc || len != CAS_HEADER_SIZE, "\trelease_shared - failed to read the reference count", -EIO);
+
+    uint64_t size = (uint64_t) total - CAS_HEADER_SIZE;
+    if (refs > 1) {
+        refs--;
+        rc = unqlite_kv_store_range(pDb, key, CAS_KEY_SIZE, 0, &refs, CAS_HEADER_SIZE);
+        TEST_CONDITION(rc, "\trelease_shared - failed to update the reference count", -EIO);
     }
     else {
-        LOG_CLARIFY("\t\tother accessing file\n");
-        permissions[R] = fcb.mode & S_IROTH;
-        permissions[W] = fcb.mode & S_IWOTH;
-        permissions[X] = fcb.mode & S_IXOTH;
+        rc = unqlite_kv_delete(pDb, key, CAS_KEY_SIZE);
+        TEST_CONDITION(rc, "\trelease_shared - failed to remove the contents", -EIO);
+        dedup_stats.shared--;
+        dedup_stats.stored_bytes -= size;
     }
+    dedup_stats.references--;
+    dedup_stats.referenced_bytes -= size;
 
-    fi->fh = (uint64_t) (O_ACCMODE & flags);  // rdwr==10,wronly=01, rdonly=00  (binary)
-    TEST_CONDITION(fi->fh % 2 == 0 && !permissions[R], "no read permissions", -EACCES);  // read is even
-    TEST_CONDITION(fi->fh > 0 && !permissions[W], "no write permissions", -EACCES);  // write is > 0
-
-    if (flags & O_APPEND && permissions[W]) fi->nonseekable = 1;
-    TEST_CONDITION((flags & O_APPEND && !permissions[W]), "no append permissions", -EACCES);
-
-    if (flags & O_CREAT && permissions[W]) fi->fh |= O_CREAT;
-    TEST_CONDITION((flags & O_CREAT && !permissions[W]), "no create permissions", -EACCES);
+    return save_dedup_stats();
+}
 
-    fi->fh_old = OPEN_CALLED;
+/**
+ * Drops the reference that a shared block holds on its contents.
+ * The record of the block itself is left for the caller to overwrite or remove.
+ */
+static int unshare_block(uuid_t data, uint64_t index) {
+    char key[BLOCK_KEY_SIZE];
+    make_block_key(data, index, key);
+    uint8_t hash[SHA256_SIZE];
+    unqlite_int64 len = SHA256_SIZE;
+    int CHECKED_CALL(fetch, key, BLOCK_KEY_SIZE, hash, &len);
+    CHECKED_CALL(release_shared, hash);
 
     return 0;
 }
 
+/**
+ * Stores a whole block as shared contents, see -o dedup.
+ * Identical contents are stored once under their hash, with a reference count,
+ * and the record of the block only keeps the hash. The previous contents of the block are released.
+ *
+ * @param data the uuid of the file's data
+ * @param index the index of the block
+ * @param block the contents of the block
+ * @param len the number of bytes to store
+ * @param state the state of the block in the block map, updated
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int share_block(uuid_t data, uint64_t index, const uint8_t* block, size_t len, uint8_t* state) {
+    int iLog = 0;
+    LOG_FUNC("\tSHARE BLOCK index=%llu  len=%d\n", index, len);
 
+    uint8_t hash[SHA256_SIZE];
+    sha256(block, len, hash);
+    char key[BLOCK_KEY_SIZE];
+    make_block_key(data, index, key);
+    int rc;
+    if (*state == BLOCK_SHARED) {
+        uint8_t old[SHA256_SIZE];
+        unqlite_int64 old_len = SHA256_SIZE;
+        CHECKED_CALL(fetch, key, BLOCK_KEY_SIZE, old, &old_len);
+        if (!memcmp(old, hash, SHA256_SIZE)) return 0;  // Same contents, nothing to do.
+        CHECKED_CALL(release_shared, old);
+    }
 
+    char cas_key[CAS_KEY_SIZE];
+    make_cas_key(hash, cas_key);
+    uint64_t refs;
+    unqlite_int64 refs_len = CAS_HEADER_SIZE;
+    lookup_stats.lookups++;
+    rc = unqlite_kv_fetch_range(pDb, cas_key, CAS_KEY_SIZE, 0, &refs_len, &refs);
+    if (rc == UNQLITE_NOTFOUND) {
+        uint8_t record[CAS_HEADER_SIZE + MY_BLOCK_SIZE];
+        refs = 1;
+        memcpy(record, &refs, CAS_HEADER_SIZE);
+        memcpy(record + CAS_HEADER_SIZE, block, len);
+        CHECKED_CALL(store, cas_key, CAS_KEY_SIZE, record, CAS_HEADER_SIZE + len);
+        dedup_stats.shared++;
+        dedup_stats.stored_bytes += len;
+    }
+    else {
+        TEST_CONDITION(rc || refs_len != CAS_HEADER_SIZE, "\tshare_block - failed to read the reference count", -EIO);
+        refs++;
+        rc = unqlite_kv_store_range(pDb, cas_key, CAS_KEY_SIZE, 0, &refs, CAS_HEADER_SIZE);
+        TEST_CONDITION(rc, "\tshare_block - failed to update the reference count", -EIO);
+    }
+    dedup_stats.references++;
+    dedup_stats.referenced_bytes += len;
 
+    CHECKED_CALL(store, key, BLOCK_KEY_SIZE, hash, SHA256_SIZE);
+    *state = BLOCK_SHARED;
 
-/** ============================ Required functions ============================ */
-/** ============================ Required functions ============================ */
-/** ============================ Required functions ============================ */
-
-/** ======================== Any type of File functions ======================== */
+    return save_dedup_stats();
+}
 
-// Get file and directory attributes (meta-data).
-// Read 'man 2 stat' and 'man 2 chmod'.
-static int myfs_getattr(const char* path, struct stat* stbuf) {
+/**
+ * Takes what a compressed block saved off the file's count, before the block is replaced or removed.
+ *
+ * @param data the uuid of the file's data
+ * @param index the index of the block
+ * @param md the file's meta data, its saving is updated
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int forget_saving(uuid_t data, uint64_t index, meta_data* md) {
     int iLog = 0;
-    LOG_FUNC("GET ATTRIBUTES path=\"%s\"\n", path);
+    char key[BLOCK_KEY_SIZE];
+    make_block_key(data, index, key);
+    unqlite_int64 len;
+    lookup_stats.lookups++;
+    int rc = unqlite_kv_fetch(pDb, key, BLOCK_KEY_SIZE, NULL, &len);
+    TEST_CONDITION(rc, "\tforget_saving - compressed block is missing", -EIO);
+    md->saved -= MY_BLOCK_SIZE - len;
 
-    memset(stbuf, 0, sizeof(struct stat));
-    myfcb fcb;
+    return 0;
+}
+
+/**
+ * Stores a whole block, shared with identical blocks when deduplication is on,
+ * otherwise compressed if a codec was chosen and the block compresses well.
+ * A shared block that is written without deduplication gets a private copy.
+ *
+ * @param data the uuid of the file's data
+ * @param index the index of the block
+ * @param block the contents of the block
+ * @param len the number of bytes to store
+ * @param state the state of the block in the block map, updated
+ * @param md the file's meta data, its saving is updated
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int put_block(uuid_t data, uint64_t index, const uint8_t* block, size_t len, uint8_t* state,
+                     meta_data* md) {
+    int rc;
+    if (IS_COMPRESSED(*state)) {
+        CHECKED_CALL(forget_saving, data, index, md);
+        *state = BLOCK_STORED;
+    }
+    if (config.dedup) {
+        CHECKED_CALL(share_block, data, index, block, len, state);
+        return 0;
+    }
+
+    if (*state == BLOCK_SHARED) {
+        CHECKED_CALL(unshare_block, data, index);
+    }
+    uint8_t packed[MY_BLOCK_SIZE];
+    size_t packed_len = compress_block(config.codec, block, len, packed);
+    if (packed_len) {
+        CHECKED_CALL(set_block, data, index, packed, packed_len);
+        *state = (uint8_t) (BLOCK_COMPRESSED + config.codec - 1);
+        md->saved += MY_BLOCK_SIZE - packed_len;
+        return 0;
+    }
+    CHECKED_CALL(set_block, data, index, block, len);
+    *state = BLOCK_STORED;
+
+    return 0;
+}
+
+/**
+ * Removes a stored block, releasing its shared contents if it has any.
+ *
+ * @param data the uuid of the file's data
+ * @param index the index of the block
+ * @param state the state of the block in the block map, set to BLOCK_HOLE
+ * @param md the file's meta data, its saving is updated
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int drop_block(uuid_t data, uint64_t index, uint8_t* state, meta_data* md) {
+    int iLog = 0;
+    LOG_FUNC("\tDROP BLOCK index=%llu\n", index);
+
+    int rc;
+    if (IS_COMPRESSED(*state)) {
+        CHECKED_CALL(forget_saving, data, index, md);
+    }
+    if (*state == BLOCK_SHARED) {
+        CHECKED_CALL(unshare_block, data, index);
+    }
+    char key[BLOCK_KEY_SIZE];
+    make_block_key(data, index, key);
+    rc = unqlite_kv_delete(pDb, key, BLOCK_KEY_SIZE);
+    TEST_CONDITION(rc && rc != UNQLITE_NOTFOUND, "\tdrop_block - failed to remove block", -EIO);
+    *state = BLOCK_HOLE;
+
+    return 0;
+}
+
+/**
+ * Fetches the bytes [from, to) of a block straight into 'dest'. Only the pages of the block
+ * that cover the range are read.
+ * Bytes past the stored length of the block are filled with zeros.
+ *
+ * @param data the uuid of the file's data
+ * @param index the index of the block
+ * @param state the state of the block in the block map
+ * @param from the first byte of the block to fetch
+ * @param to one past the last byte of the block to fetch
+ * @param dest where to put the bytes
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int get_block_range(uuid_t data, uint64_t index, uint8_t state, size_t from, size_t to, uint8_t* dest) {
+    int iLog = 0;
+    LOG_FUNC("\tGET BLOCK RANGE index=%llu  from=%d  to=%d\n", index, from, to);
+
+    if (IS_COMPRESSED(state)) {
+        // Compressed blocks can only be decompressed whole.
+        uint8_t block[MY_BLOCK_SIZE];
+        int CHECKED_CALL(get_block, data, index, state, block, NULL);
+        memcpy(dest, block + from, to - from);
+        return 0;
+    }
+
+    char key[CAS_KEY_SIZE];
+    int key_len;
+    size_t skip;
+    int CHECKED_CALL(block_source, data, index, state, key, &key_len, &skip);
+    unqlite_int64 len = to - from;
+    lookup_stats.lookups++;
+    rc = unqlite_kv_fetch_range(pDb, key, key_len, skip + from, &len, dest);
+    if (rc == UNQLITE_NOTFOUND) len = 0;
+    else {
+        TEST_CONDITION(rc, "\tget_block_range - fetch failed", -EIO);
+    }
+    memset(dest + len, 0, to - from - len);
+
+    return 0;
+}
+
+static void make_bmap_key(uuid_t data, uint64_t page, char* key) {
+    memcpy(key, BMAP_PREFIX, BMAP_PREFIX_SIZE);
+    memcpy(key + BMAP_PREFIX_SIZE, data, KEY_SIZE);
+    memcpy(key + BMAP_PREFIX_SIZE + KEY_SIZE, &page, sizeof(uint64_t));
+}
+
+/**
+ * Writes the loaded block map page back to the store, if it was changed.
+ * A page that no longer maps any stored block is removed instead.
+ */
+static int save_bmap(uuid_t data, bmap_page* map) {
+    int iLog = 0;
+    LOG_FUNC("	SAVE BMAP page=%llu  dirty=%d\n", map->index, map->dirty);
+    if (map->index == BMAP_NONE || !map->dirty) return 0;
+
+    char key[BMAP_KEY_SIZE];
+    make_bmap_key(data, map->index, key);
+    int i;
+    for (i = 0; i < MY_BMAP_SPAN; ++i)
+        if (map->entries[i] != BLOCK_HOLE) break;
+
+    int rc;
+    if (i == MY_BMAP_SPAN) {
+        rc = unqlite_kv_delete(pDb, key, BMAP_KEY_SIZE);
+        TEST_CONDITION(rc && rc != UNQLITE_NOTFOUND, "\tsave_bmap - failed to remove empty page", -EIO);
+    }
+    else {
+        CHECKED_CALL(store, key, BMAP_KEY_SIZE, map->entries, MY_BMAP_SPAN);
+    }
+    map->dirty = 0;
+
+    return 0;
+}
+
+/**
+ * Makes sure that the block map page holding the entry of 'block' is loaded in 'map'.
+ * A previously loaded page is saved first if it was changed.
+ *
+ * @param data the uuid of the file's data
+ * @param block the index of the block whose entry is needed
+ * @param map the in-memory page, initialised with BMAP_PAGE_INIT before first use
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int bmap_seek(uuid_t data, uint64_t block, bmap_page* map) {
+    int iLog = 0;
+    uint64_t page = BMAP_PAGE(block);
+    if (map->index == page) return 0;
+    LOG_FUNC("\tBMAP SEEK page=%llu\n", page);
+
+    int CHECKED_CALL(save_bmap, data, map);
+
+    char key[BMAP_KEY_SIZE];
+    make_bmap_key(data, page, key);
+    unqlite_int64 len = MY_BMAP_SPAN;
+    rc = fetch(key, BMAP_KEY_SIZE, map->entries, &len);
+    if (rc == -ENOENT) len = 0;
+    else if (rc) return rc;
+    memset(map->entries + len, BLOCK_HOLE, (size_t) (MY_BMAP_SPAN - len));
+    map->index = page;
+
+    return 0;
+}
+
+/**
+ * Removes the blocks of a file from the block containing 'newsize' onwards.
+ * The block that 'newsize' falls into is cut short rather than removed.
+ * Only the blocks recorded in the block map are touched.
+ *
+ * @param data the uuid of the file's data
+ * @param md the file's meta data, its size is the size before the removal,
+ *          its block count and saving are updated
+ * @param newsize the size of the file after the removal
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int remove_blocks(uuid_t data, meta_data* md, off_t newsize) {
+    int iLog = 0;
+    LOG_FUNC("\tREMOVE BLOCKS newsize=%lld  oldsize=%lld\n", newsize, md->size);
+
+    uint64_t first = NUMBER_OF_BLOCKS(newsize);
+    uint64_t last = NUMBER_OF_BLOCKS(md->size);
+    bmap_page map = BMAP_PAGE_INIT;
+    int rc;
+    for (uint64_t i = first; i < last; ++i) {
+        CHECKED_CALL(bmap_seek, data, i, &map);
+        if (map.entries[BMAP_ENTRY(i)] == BLOCK_HOLE) continue;
+
+        CHECKED_CALL(drop_block, data, i, &map.entries[BMAP_ENTRY(i)], md);
+        map.dirty = 1;
+        md->blocks--;
+    }
+
+    size_t tail = (size_t) (newsize % MY_BLOCK_SIZE);
+    if (tail && newsize < md->size) {
+        uint64_t i = BLOCK_INDEX(newsize);
+        CHECKED_CALL(bmap_seek, data, i, &map);
+        uint8_t* state = &map.entries[BMAP_ENTRY(i)];
+        if (*state != BLOCK_HOLE) {
+            uint8_t block[MY_BLOCK_SIZE];
+            uint8_t before = *state;
+            size_t len;
+            CHECKED_CALL(get_block, data, i, *state, block, &len);
+            if (len > tail) {
+                CHECKED_CALL(put_block, data, i, block, tail, state, md);
+            }
+            if (*state != before) map.dirty = 1;
+        }
+    }
+    CHECKED_CALL(save_bmap, data, &map);
+
+    return 0;
+}
+
+/**
+ * Reads a range of a file that lies within its size.
+ * Only the overlapped blocks are fetched, and only the bytes of them that are needed.
+ * Holes are zeros, they need no fetch.
+ *
+ * @param data the uuid of the file's data
+ * @param buf where to put the bytes
+ * @param size the number of bytes to read
+ * @param offset the offset in the file to read from
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int read_blocks(uuid_t data, char* buf, size_t size, off_t offset) {
+    int iLog = 0;
+    LOG_FUNC("\tREAD BLOCKS size=%d  offset=%lld\n", size, offset);
+
+    bmap_page map = BMAP_PAGE_INIT;
+    off_t end = offset + size;
+    int rc;
+    for (uint64_t i = BLOCK_INDEX(offset); (off_t) i * MY_BLOCK_SIZE < end; ++i) {
+        off_t block_start = (off_t) i * MY_BLOCK_SIZE;
+        size_t from = (size_t) (offset > block_start ? offset - block_start : 0);
+        size_t to = (size_t) (end < block_start + MY_BLOCK_SIZE ? end - block_start : MY_BLOCK_SIZE);
+        uint8_t* dest = (uint8_t*) buf + (block_start + from - offset);
+        LOG_CLARIFY("\t\tblock=%llu  from=%d  to=%d\n", i, from, to);
+
+        CHECKED_CALL(bmap_seek, data, i, &map);
+        if (map.entries[BMAP_ENTRY(i)] == BLOCK_HOLE) {
+            memset(dest, 0, to - from);
+        }
+        else {
+            CHECKED_CALL(get_block_range, data, i, map.entries[BMAP_ENTRY(i)], from, to, dest);
+        }
+    }
+
+    return 0;
+}
+
+static int is_zero(const uint8_t* buf, size_t size) {
+    for (size_t i = 0; i < size; ++i)
+        if (buf[i]) return 0;
+    return 1;
+}
+
+/**
+ * Takes the next 'n' bytes of a write's payload.
+ * When they sit in one memory buffer, 'out' points at them and nothing is copied.
+ * Otherwise, e.g. when the payload was spliced into a pipe, they are copied into 'staging'.
+ *
+ * @param src the payload, advanced past the bytes taken
+ * @param n the number of bytes to take
+ * @param staging a buffer of at least n bytes
+ * @param out receives the location of the bytes
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int take_payload(struct fuse_bufvec* src, size_t n, uint8_t* staging, const uint8_t** out) {
+    int iLog = 0;
+    LOG_FUNC("\tTAKE PAYLOAD n=%d\n", n);
+
+    struct fuse_buf* buf = &src->buf[src->idx];
+    if (src->idx < src->count && !(buf->flags & FUSE_BUF_IS_FD) && buf->size - src->off >= n) {
+        *out = (const uint8_t*) buf->mem + src->off;
+        src->off += n;
+        if (src->off == buf->size) {
+            src->idx++;
+            src->off = 0;
+        }
+        return 0;
+    }
+
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(n);
+    dst.buf[0].mem = staging;
+    ssize_t copied = fuse_buf_copy(&dst, src, 0);
+    TEST_CONDITION(copied < 0, "\ttake_payload - copy failed", (int) copied);
+    TEST_CONDITION(copied != n, "\ttake_payload - payload ended early", -EIO);
+    *out = staging;
+
+    return 0;
+}
+
+/**
+ * Overwrites the bytes [from, to) of a stored block with the next bytes of 'src'.
+ * The block is not read back: only the database pages holding the range are rewritten.
+ * If the block is stored shorter than 'from', the gap is filled with zeros.
+ *
+ * @param data the uuid of the file's data
+ * @param index the index of the block
+ * @param src the payload
+ * @param from the first byte of the block to write
+ * @param to one past the last byte of the block to write
+ * @param staging a block-sized buffer the payload can be gathered in
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int update_block(uuid_t data, uint64_t index, struct fuse_bufvec* src, size_t from, size_t to,
+                        uint8_t* staging) {
+    int iLog = 0;
+    LOG_FUNC("	UPDATE BLOCK index=%llu  from=%d  to=%d\n", index, from, to);
+
+    char key[BLOCK_KEY_SIZE];
+    make_block_key(data, index, key);
+    unqlite_int64 len;
+    lookup_stats.lookups++;
+    int rc = unqlite_kv_fetch(pDb, key, BLOCK_KEY_SIZE, NULL, &len);
+    TEST_CONDITION(rc, "\tupdate_block - stored block is missing", -EIO);
+
+    const uint8_t* payload;
+    CHECKED_CALL(take_payload, src, to - from, staging + from, &payload);
+    size_t start = from;
+    if ((size_t) len < from) {
+        // Store the zeros of the gap together with the payload.
+        start = (size_t) len;
+        memset(staging + start, 0, from - start);
+        if (payload != staging + from) memcpy(staging + from, payload, to - from);
+        payload = staging + start;
+    }
+    rc = unqlite_kv_store_range(pDb, key, BLOCK_KEY_SIZE, start, payload, to - start);
+    TEST_CONDITION(rc, "\tupdate_block - store failed", -EIO);
+
+    return 0;
+}
+
+/**
+ * Writes a range of a file. Blocks that are overwritten completely are stored whole,
+ * and partially written blocks are updated in place without being read.
+ *
+ * @param data the uuid of the file's data
+ * @param md the file's meta data, its block count is kept up to date
+ * @param src the payload
+ * @param size the number of bytes to write
+ * @param offset the offset in the file to write to
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int write_blocks(uuid_t data, meta_data* md, struct fuse_bufvec* src, size_t size, off_t offset) {
+    int iLog = 0;
+    LOG_FUNC("\tWRITE BLOCKS size=%d  offset=%lld\n", size, offset);
+
+    uint8_t block[MY_BLOCK_SIZE];
+    bmap_page map = BMAP_PAGE_INIT;
+    off_t end = offset + size;
+    int rc;
+    for (uint64_t i = BLOCK_INDEX(offset); (off_t) i * MY_BLOCK_SIZE < end; ++i) {
+        off_t block_start = (off_t) i * MY_BLOCK_SIZE;
+        size_t from = (size_t) (offset > block_start ? offset - block_start : 0);
+        size_t to = (size_t) (end < block_start + MY_BLOCK_SIZE ? end - block_start : MY_BLOCK_SIZE);
+        const uint8_t* payload;
+        LOG_CLARIFY("\t\tblock=%llu  from=%d  to=%d\n", i, from, to);
+
+        CHECKED_CALL(bmap_seek, data, i, &map);
+        uint8_t* state = &map.entries[BMAP_ENTRY(i)];
+        uint8_t before = *state;
+
+        if (from == 0 && to == MY_BLOCK_SIZE) {  // Whole block, no need to read what was there.
+            CHECKED_CALL(take_payload, src, MY_BLOCK_SIZE, block, &payload);
+            if (is_zero(payload, MY_BLOCK_SIZE)) {
+                // A whole block of zeros is kept as a hole.
+                if (*state != BLOCK_HOLE) {
+                    CHECKED_CALL(drop_block, data, i, state, md);
+                    map.dirty = 1;
+                    md->blocks--;
+                }
+                continue;
+            }
+            CHECKED_CALL(put_block, data, i, payload, MY_BLOCK_SIZE, state, md);
+        }
+        else if (*state == BLOCK_STORED && !config.dedup) {
+            CHECKED_CALL(update_block, data, i, src, from, to, block);
+        }
+        else {
+            // Holes, shared and compressed blocks are rebuilt whole, shared contents are never changed in place.
+            size_t len = 0;
+            if (*state != BLOCK_HOLE) {
+                CHECKED_CALL(get_block, data, i, *state, block, &len);
+            }
+            else memset(block, 0, from);
+            CHECKED_CALL(take_payload, src, to - from, block + from, &payload);
+            if (payload != block + from) memcpy(block + from, payload, to - from);
+            CHECKED_CALL(put_block, data, i, block, (len > to ? len : to), state, md);
+        }
+
+        if (*state != before) map.dirty = 1;
+        if (before == BLOCK_HOLE) md->blocks++;
+    }
+    CHECKED_CALL(save_bmap, data, &map);
+
+    return 0;
+}
+
+/**
+ * Moves the contents of an inline file out to blocks, for when it grows past the inline limit.
+ * The inline copy goes away when the caller next stores the meta data.
+ *
+ * @param data the uuid of the file's data
+ * @param rec the meta data and the contents of the file, its meta data is updated
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int spill_inline(uuid_t data, inline_record* rec) {
+    int iLog = 0;
+    LOG_FUNC("\tSPILL INLINE size=%lld\n", rec->md.size);
+
+    rec->md.inlined = 0;
+    if (rec->md.size == 0) return 0;
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(rec->md.size);
+    src.buf[0].mem = rec->contents;
+    int CHECKED_CALL(write_blocks, data, &rec->md, &src, (size_t) rec->md.size, 0);
+
+    return 0;
+}
+
+/**
+ * Finds the start of the next data range or hole of a file, the way lseek does for SEEK_DATA and SEEK_HOLE.
+ * Holes are found with block granularity, from the block map alone.
+ *
+ * @param data the uuid of the file's data
+ * @param size the size of the file
+ * @param offset the offset to search from, replaced with the result
+ * @param want_data non-zero to look for data, zero to look for a hole
+ * @return 0 on success, -ENXIO if there is nothing to find, another error code otherwise
+ */
+static int seek_block(uuid_t data, off_t size, off_t* offset, int want_data) {
+    int iLog = 0;
+    LOG_FUNC("\tSEEK BLOCK offset=%lld  want_data=%d\n", *offset, want_data);
+    TEST_CONDITION(*offset < 0 || *offset >= size, "\tseek_block - offset outside of the file", -ENXIO);
+
+    bmap_page map = BMAP_PAGE_INIT;
+    uint64_t last = NUMBER_OF_BLOCKS(size);
+    int rc;
+    for (uint64_t i = BLOCK_INDEX(*offset); i < last; ++i) {
+        CHECKED_CALL(bmap_seek, data, i, &map);
+        if ((map.entries[BMAP_ENTRY(i)] != BLOCK_HOLE) == (want_data != 0)) {
+            off_t found = (off_t) i * MY_BLOCK_SIZE;
+            if (found > *offset) *offset = found;
+            return 0;
+        }
+    }
+
+    // The end of the file counts as a hole.
+    TEST_CONDITION(want_data, "\tseek_block - no more data", -ENXIO);
+    *offset = size;
+
+    return 0;
+}
+
+
+/**
+ * Finds the uuid of the inode that the kernel knows by a number.
+ *
+ * @param ino the number of the inode, see itable.h
+ * @param id receives the uuid of the inode
+ * @return 0 on success, -ESTALE if the number is not known
+ */
+static int get_id(fuse_ino_t ino, uuid_t id) {
+    int iLog = 0;
+    LOG_FUNC("\tGET ID ino=%llu\n", (unsigned long long) ino);
+    TEST_CONDITION(!itable_id(ino, id), "\tget_id - unknown inode number", -ESTALE);
+
+    return 0;
+}
+
+/**
+ * Finds the inode that the kernel knows by a number, with a single lookup.
+ *
+ * @param ino the number of the inode, see itable.h
+ * @param fcb receives the fcb of the file
+ * @param md receives the inode of the file
+ * @return 0 on success, an appropriate error code otherwise
+ *                       (this code is to be returned to the OS)
+ */
+static int get_inode(fuse_ino_t ino, myfcb* fcb, meta_data* md) {
+    int iLog = 0;
+    LOG_FUNC("\tGET INODE ino=%llu\n", (unsigned long long) ino);
+
+    uuid_t id;
+    int CHECKED_CALL(get_id, ino, id);
+    CHECKED_CALL(get_meta, id, md);
+    *fcb = fcb_of(id, *md);
+
+    return 0;
+}
+
+/**
+ * Finds an entry of a directory and its inode, with a lookup in the directory's index.
+ *
+ * @param parent the fcb of the directory
+ * @param name the name of the entry
+ * @param child receives the fcb of the entry
+ * @param md receives the inode of the entry
+ * @param offset receives the offset of the entry's dentry in the directory's list, ignored if NULL is passed
+ * @return 0 on success, an appropriate error code otherwise
+ *                       (this code is to be returned to the OS)
+ */
+static int get_child(myfcb parent, const char* name, myfcb* child, meta_data* md, uint64_t* offset) {
+    int iLog = 0;
+    LOG_FUNC("\tGET CHILD  name=\"%s\"\n", name);
+    TEST_CONDITION(!S_ISDIR(parent.mode), "\tget_child - parent is not a directory", -ENOTDIR);
+    TEST_CONDITION(strlen(name) > UINT8_MAX, "\tget_child - name too long", -ENAMETOOLONG);
+
+    dent entry;
+    int CHECKED_CALL(get_dent, parent.data, name, &entry);
+    CHECKED_CALL(get_meta, entry.id, md);
+    *child = fcb_of(entry.id, *md);
+    if (offset != NULL) *offset = entry.offset;
+
+    return 0;
+}
+
+// Fills in the attributes of a file from its inode.
+static void fill_stat(fuse_ino_t ino, meta_data md, struct stat* stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = ino;
+    stbuf->st_mode = md.mode;
+    stbuf->st_uid = md.uid;
+    stbuf->st_gid = md.gid;
+
+    stbuf->st_size = md.size;
+    stbuf->st_blksize = MY_BLOCK_SIZE;
+    // Holes take no space, and compressed blocks only what they were compressed to.
+    if (S_ISREG(md.mode)) stbuf->st_blocks = (blkcnt_t) ((md.blocks * MY_BLOCK_SIZE - md.saved + 511) / 512);
+    if (md.inlined) stbuf->st_blocks = (blkcnt_t) ((md.size + 511) / 512);
+    stbuf->st_nlink = md.nlinks;
+    stbuf->st_atime = md.atime;
+    stbuf->st_mtime = md.mtime;
+    stbuf->st_ctime = md.ctime;
+}
+
+/**
+ * Fills in the answer to a request that finds or creates an entry.
+ * The kernel counts the answer as a lookup of the entry's inode, which is counted here too until it is forgotten.
+ *
+ * @param fcb the fcb of the entry
+ * @param md the inode of the entry
+ * @param e receives the number and the attributes of the inode
+ * @return 0 on success, -ENOMEM if the inode could not be given a number
+ */
+static int make_entry(myfcb fcb, meta_data md, struct fuse_entry_param* e) {
+    int iLog = 0;
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    e->ino = itable_ref(fcb.data);
+    TEST_CONDITION(e->ino == 0, "\tmake_entry - out of memory", -ENOMEM);
+    fill_stat(e->ino, md, &e->attr);
+    e->attr_timeout = config.attr_timeout;
+    e->entry_timeout = config.entry_timeout;
+
+    return 0;
+}
+
+/**
+ * Adds an entry for an existing inode to a directory.
+ *
+ * @param parent the fcb of the directory
+ * @param name the name of the new entry
+ * @param fcb the fcb of the inode
+ * @return 0 on success, or an appropriate error code
+ *                          (this code is to be returned to the OS)
+ */
+static int link_to_tree(myfcb parent, const char* name, myfcb fcb) {
+    int iLog = 0;
+    LOG_FUNC("\tLINK TO TREE name=\"%s\"\n", name);
+
+    TEST_CONDITION(!S_ISDIR(parent.mode), "link_to_tree - parent is not a directory", -ENOTDIR);
+    TEST_CONDITION(strlen(name) > UINT8_MAX, "link_to_tree - name too long", -ENAMETOOLONG);
+    meta_data parent_md;
+    int CHECKED_CALL(get_meta, parent.data, &parent_md);
+    dent existing;
+    rc = get_dent(parent.data, name, &existing);
+    TEST_CONDITION(rc == 0, "link_to_tree - entry exists", -EEXIST);
+    if (rc != -ENOENT) return rc;
+
+    // Add the entry to the end of the parent's dentries and to its index, which writes just the new dentry.
+    // The stored list may be longer than parent_md.size, see remove_dentry.
+    dentry_head head = {.rec_len = DENTRY_LEN(strlen(name)), .type = DENTRY_TYPE(fcb.mode),
+                        .name_len = (uint8_t) strlen(name)};
+    memcpy(head.id, fcb.data, KEY_SIZE);
+    uint64_t offset = (uint64_t) parent_md.size;
+    CHECKED_CALL(write_dentry, parent.data, offset, &head, name);
+    CHECKED_CALL(set_dent, parent.data, name, fcb.data, offset);
+
+    // Update parent in DB
+    parent_md.size += head.rec_len;
+    parent_md.mtime = parent_md.ctime = time(0);
+    CHECKED_CALL(set_meta_lazy, parent.data, &parent_md);
+
+    return 0;
+}
+
+/**
+ * Creates a new inode and adds an entry for it to a directory.
+ *
+ * @param parent the fcb of the directory
+ * @param name the name of the new entry
+ * @param mode the mode of the new inode
+ * @param ctx the caller, who owns the new inode
+ * @param fcb  a memory location to put the fcb data, ignored if NULL is passed
+ * @param md  a memory location to put the inode, ignored if NULL is passed
+ * @return 0 on success, or an appropriate error code
+ *                          (this code is to be returned to the OS)
+ */
+static int attach_fcb_to_tree(myfcb parent, const char* name, mode_t mode, const struct fuse_ctx* ctx,
+                              myfcb* fcb, meta_data* md) {
+    int iLog = 0;
+    LOG_FUNC("\tATTACH TO TREE name=\"%s\"  mode=0%03o\n", name, mode);
+
+    // Create new FCB
+    myfcb new_fcb = create_fcb(ctx->uid, ctx->gid, mode);
+    LOG_FCB(new_fcb);
+    meta_data new_md = create_meta_data(ctx->uid, ctx->gid, mode);
+    LOG_GENERAL("\tcreated name:%s\n", name);
+
+    // The entry goes in first: if it cannot, nothing is left behind.
+    int CHECKED_CALL(link_to_tree, parent, name, new_fcb);
+    CHECKED_CALL(set_meta, new_fcb.data, &new_md);
+
+    LOG_FCB(new_fcb);
+
+    if (fcb != NULL) memcpy(fcb, &new_fcb, MYFCB_SIZE);
+    if (md != NULL) memcpy(md, &new_md, META_DATA_SIZE);
+
+    return 0;
+}
+
+/**
+ * Tells whether enough of the list of a directory is free for compacting it to pay off, see compact_dentries.
+ *
+ * @param md the meta data of the directory
+ * @return 1 if the list should be compacted, 0 otherwise
+ */
+static int compaction_due(const meta_data* md) {
+    return md->dead >= DENTRY_COMPACT_MIN && 2 * md->dead > (uint64_t) md->size;
+}
+
+/**
+ * Rewrites the list of a directory without its free dentries, and moves the index entries of the others.
+ * This costs as much as the list is long, which the removals that freed at least half of it pay for.
+ * The list is rewritten in place a part at a time: dentries only move towards its start,
+ * so a part is written over dentries that were read already. The stored list is not shortened.
+ *
+ * @param dir the data uuid of the directory
+ * @param md the meta data of the directory, its size and dead bytes are updated
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int compact_dentries(uuid_t dir, meta_data* md) {
+    int iLog = 0;
+    LOG_FUNC("\tCOMPACT DENTRIES size=%lld  dead=%llu\n", md->size, (unsigned long long) md->dead);
+
+    dentry_reader reader;
+    int CHECKED_CALL(open_dentries, &reader, dir, md->size, 0, DENTRY_CHUNK);
+    char* compact = malloc(DENTRY_CHUNK);
+    if (compact == NULL) {
+        close_dentries(&reader);
+        LOG_ERR("\tcompact_dentries - out of memory\n");
+        return -ENOMEM;
+    }
+
+    dentry_head head;
+    char name[UINT8_MAX + 1];
+    off_t offset;
+    off_t written = 0;  // The bytes of the compacted list that are stored.
+    size_t part = 0;    // The bytes of it in compact, which go after them.
+    while ((rc = next_dentry(&reader, &offset, &head, name)) > 0) {
+        if (head.type == DENTRY_FREE) continue;
+        head.rec_len = DENTRY_LEN(head.name_len);
+        if (part + head.rec_len > DENTRY_CHUNK) {
+            if (unqlite_kv_store_range(pDb, dir, KEY_SIZE, (unqlite_int64) written, compact, (unqlite_int64) part)) {
+                rc = -EIO;
+                break;
+            }
+            written += (off_t) part;
+            part = 0;
+        }
+        memcpy(compact + part, &head, sizeof(dentry_head));
+        memcpy(compact + part + sizeof(dentry_head), name, head.name_len);
+        memcpy(compact + part + head.rec_len - sizeof(uint32_t), &head.rec_len, sizeof(uint32_t));
+        if (written + (off_t) part != offset) {
+            rc = set_dent(dir, name, head.id, (uint64_t) (written + part));
+            if (rc) break;
+        }
+        part += head.rec_len;
+    }
+    if (rc == 0 && part && unqlite_kv_store_range(pDb, dir, KEY_SIZE, (unqlite_int64) written, compact,
+                                                  (unqlite_int64) part)) {
+        rc = -EIO;
+    }
+    close_dentries(&reader);
+    free(compact);
+    if (rc) {
+        LOG_ERR("\tcompact_dentries - failed to rewrite the list\n");
+        return rc;
+    }
+    md->size = written + (off_t) part;
+    md->dead = 0;
+
+    return 0;
+}
+
+/**
+ * Drops the free dentries of the list of a directory: the list starts over if only free dentries are left,
+ * and is compacted if enough of it is free.
+ *
+ * @param dir the data uuid of the directory
+ * @param md the meta data of the directory, its size and dead bytes are updated
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int tidy_dentries(uuid_t dir, meta_data* md) {
+    if (md->dead >= (uint64_t) md->size) {
+        md->size = 0;
+        md->dead = 0;
+    }
+    else if (compaction_due(md)) {
+        int CHECKED_CALL(compact_dentries, dir, md);
+    }
+
+    return 0;
+}
+
+/**
+ * Removes a dentry from the list of a directory without moving any other,
+ * so that a listing in progress still finds each of the entries that stay where it left them.
+ * The last dentry is cut off the list, any other is marked free and left in place, see DENTRY_FREE.
+ * The stored list is not shortened: what lies past the directory's size is left to be overwritten.
+ *
+ * @param dir the data uuid of the directory
+ * @param md the meta data of the directory, its size and dead bytes are updated
+ * @param offset the offset of the dentry to remove
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int remove_dentry(uuid_t dir, meta_data* md, uint64_t offset) {
+    int iLog = 0;
+    LOG_FUNC("\tREMOVE DENTRY offset=%llu  size=%lld\n", (unsigned long long) offset, md->size);
+
+    dentry_head removed;
+    char name[UINT8_MAX + 1];
+    int CHECKED_CALL(read_dentry, dir, offset, &removed, name);
+    // Shortening the list or compacting it moves where dentries are, or will be added,
+    // which an open listing would then miss or see twice, so while the directory is listed
+    // a dentry is only freed and the rest waits until the last listing is released, see myfs_releasedir.
+    int listed = itable_listed(dir);
+    if (offset + removed.rec_len == (uint64_t) md->size && !listed) {
+        md->size = (off_t) offset;
+    }
+    else {
+        uint8_t type = DENTRY_FREE;
+        rc = unqlite_kv_store_range(pDb, dir, KEY_SIZE, (unqlite_int64) (offset + offsetof(dentry_head, type)),
+                                    &type, sizeof(type));
+        TEST_CONDITION(rc, "\tremove_dentry - failed to free the dentry", -EIO);
+        md->dead += removed.rec_len;
+    }
+    if (!listed) {
+        CHECKED_CALL(tidy_dentries, dir, md);
+    }
+
+    return 0;
+}
+
+/**
+ * Removes an inode that has no links left, with its data.
+ *
+ * @param fcb the fcb of the inode
+ * @param md the inode
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int remove_inode(myfcb fcb, meta_data* md) {
+    int iLog = 0;
+    LOG_FUNC("\tREMOVE INODE\n");
+
+    // remove data: the list of a directory or the target of a symlink, or the blocks of a file
+    int rc = unqlite_kv_delete(pDb, fcb.data, KEY_SIZE);
+    TEST_CONDITION(rc && rc != UNQLITE_NOTFOUND, "remove_inode failed to delete data from DB", -EIO);
+    if (S_ISREG(fcb.mode) && !md->inlined) {
+        CHECKED_CALL(remove_blocks, fcb.data, md, 0);
+    }
+    CHECKED_CALL(remove_meta, fcb.data);
+
+    return 0;
+}
+
+// The number of inodes recorded as orphans, see ORPHAN_PREFIX.
+static uint64_t orphans;
+
+static void make_orphan_key(const unsigned char* data, char* key) {
+    memcpy(key, ORPHAN_PREFIX, ORPHAN_PREFIX_SIZE);
+    memcpy(key + ORPHAN_PREFIX_SIZE, data, KEY_SIZE);
+}
+
+/**
+ * Records an inode that lost its last link while the kernel still has a number for it.
+ *
+ * @param data the uuid of the inode
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int add_orphan(uuid_t data) {
+    int iLog = 0;
+    LOG_FUNC("\tADD ORPHAN\n");
+
+    char key[ORPHAN_KEY_SIZE];
+    make_orphan_key(data, key);
+    int CHECKED_CALL(store, key, ORPHAN_KEY_SIZE, data, KEY_SIZE);
+    orphans++;
+    CHECKED_CALL(store, ORPHANS_KEY, ORPHANS_KEY_SIZE, &orphans, sizeof(orphans));
+
+    return 0;
+}
+
+/**
+ * Takes the record of an orphan away, once its inode is removed.
+ *
+ * @param data the uuid of the inode
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int remove_orphan(uuid_t data) {
+    int iLog = 0;
+    LOG_FUNC("\tREMOVE ORPHAN\n");
+
+    char key[ORPHAN_KEY_SIZE];
+    make_orphan_key(data, key);
+    int rc = unqlite_kv_delete(pDb, key, ORPHAN_KEY_SIZE);
+    if (rc == UNQLITE_NOTFOUND) return 0;
+    TEST_CONDITION(rc, "\tremove_orphan - failed to remove the record", -EIO);
+    if (orphans) orphans--;
+    CHECKED_CALL(store, ORPHANS_KEY, ORPHANS_KEY_SIZE, &orphans, sizeof(orphans));
+
+    return 0;
+}
+
+/**
+ * Removes the inodes that were still recorded as orphans when the file system went down,
+ * which the kernel cannot forget any more.
+ *
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int remove_orphans() {
+    int iLog = 0;
+    LOG_FUNC("\tREMOVE ORPHANS orphans=%llu\n", (unsigned long long) orphans);
+
+    // Take the uuids first, the cursor would not survive the records being removed under it.
+    size_t count = 0, room = 0;
+    unsigned char* ids = NULL;
+    unqlite_kv_cursor* cursor;
+    int rc = unqlite_kv_cursor_init(pDb, &cursor);
+    TEST_CONDITION(rc, "\tremove_orphans - failed to walk the database", -EIO);
+    for (unqlite_kv_cursor_first_entry(cursor); rc == 0 && unqlite_kv_cursor_valid_entry(cursor);
+         unqlite_kv_cursor_next_entry(cursor)) {
+        char key[ORPHAN_KEY_SIZE];
+        int len;
+        if (unqlite_kv_cursor_key(cursor, NULL, &len) || len != ORPHAN_KEY_SIZE) continue;
+        if (unqlite_kv_cursor_key(cursor, key, &len) || memcmp(key, ORPHAN_PREFIX, ORPHAN_PREFIX_SIZE)) continue;
+        if (count == room) {
+            room = room ? 2 * room : 16;
+            unsigned char* more = realloc(ids, room * KEY_SIZE);
+            if (more == NULL) {
+                rc = -ENOMEM;
+                break;
+            }
+            ids = more;
+        }
+        memcpy(ids + count++ * KEY_SIZE, key + ORPHAN_PREFIX_SIZE, KEY_SIZE);
+    }
+    unqlite_kv_cursor_release(pDb, cursor);
+
+    for (size_t i = 0; rc == 0 && i < count; ++i) {
+        unsigned char* id = ids + i * KEY_SIZE;
+        meta_data md;
+        // A link that was made again meanwhile keeps the inode.
+        if (get_meta(id, &md) == 0 && md.nlinks == 0) rc = remove_inode(fcb_of(id, md), &md);
+        if (rc == 0) rc = remove_orphan(id);
+    }
+    free(ids);
+    if (rc) return rc;
+    orphans = 0;
+    rc = unqlite_kv_delete(pDb, ORPHANS_KEY, ORPHANS_KEY_SIZE);
+    TEST_CONDITION(rc && rc != UNQLITE_NOTFOUND, "\tremove_orphans - failed to remove the count", -EIO);
+
+    return 0;
+}
+
+/**
+ * Takes away a link to a file, and removes the file if that was its last link.
+ * A file that the kernel still has a number for may still be open, and is only removed once
+ * the kernel forgets it, see myfs_ll_forget. It is recorded as an orphan until then, see ORPHAN_PREFIX.
+ *
+ * @param fcb the fcb of the file
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int drop_link(myfcb fcb) {
+    int iLog = 0;
+    LOG_FUNC("\tDROP LINK\n");
+
+    // The link count goes down first, so that a forget that comes in meanwhile finds the inode unlinked.
     meta_data md;
-    int CHECKED_CALL(get_fcb_and_meta, path, &fcb, &md);
-    LOG_FCB(fcb);
-    if (!strcmp(path, "/")) {
-        LOG_CLARIFY("\tmatches /\n");  // Update root fcb?
-        CHECKED_CALL(get_fcb, the_root_fcb.path, &the_root_fcb);
+    int CHECKED_CALL(get_meta, fcb.data, &md);
+    md.nlinks--;
+    md.ctime = time(0);
+    CHECKED_CALL(set_meta, fcb.data, &md);
+    if (md.nlinks == 0 && itable_has(fcb.data)) {
+        CHECKED_CALL(add_orphan, fcb.data);
+    }
+    else if (md.nlinks == 0) {
+        LOG_CLARIFY("\t\tRemoving data because no more links!\n");
+        CHECKED_CALL(remove_inode, fcb, &md);
+    }
+
+    return 0;
+}
+
+/**
+ * Removes an entry from the list and the index of its directory, leaving the file it names alone.
+ *
+ * @param parent_fcb the fcb of the directory
+ * @param name the name of the entry
+ * @param offset the offset of the entry's dentry in the directory's list
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int remove_entry(myfcb parent_fcb, const char* name, uint64_t offset) {
+    int iLog = 0;
+    LOG_FUNC("\tREMOVE ENTRY  name=\"%s\"\n", name);
+
+    meta_data parent_md;
+    int CHECKED_CALL(get_meta, parent_fcb.data, &parent_md);
+    CHECKED_CALL(remove_dentry, parent_fcb.data, &parent_md, offset);
+    CHECKED_CALL(remove_dent, parent_fcb.data, name);
+
+    parent_md.mtime = parent_md.ctime = time(0);
+    CHECKED_CALL(set_meta_lazy, parent_fcb.data, &parent_md);
+
+    return 0;
+}
+
+/**
+ * Removes an entry from its parent directory, and the file it names if that was its last link.
+ *
+ * @param child_fcb the fcb of the entry
+ * @param parent_fcb the fcb of the directory
+ * @param name the name of the entry
+ * @param offset the offset of the entry's dentry in the directory's list
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int detach_fcb_from_tree(myfcb child_fcb, myfcb parent_fcb, const char* name, uint64_t offset) {
+    int iLog = 0;
+    LOG_FUNC("\tDETACH FROM TREE  name=\"%s\"\n", name);
+
+    int CHECKED_CALL(drop_link, child_fcb);
+    CHECKED_CALL(remove_entry, parent_fcb, name, offset);
+
+    return 0;
+}
+
+/**
+ * Points an existing entry of a directory at another file, in place.
+ * The name stays the same, so the dentry keeps its length and nothing else in the list moves.
+ *
+ * @param parent_fcb the fcb of the directory
+ * @param name the name of the entry
+ * @param offset the offset of the entry's dentry in the directory's list
+ * @param fcb the fcb of the file the entry is to name
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int replace_entry(myfcb parent_fcb, const char* name, uint64_t offset, myfcb fcb) {
+    int iLog = 0;
+    LOG_FUNC("\tREPLACE ENTRY  name=\"%s\"  offset=%llu\n", name, (unsigned long long) offset);
+
+    dentry_head head;
+    char stored_name[UINT8_MAX + 1];
+    int CHECKED_CALL(read_dentry, parent_fcb.data, offset, &head, stored_name);
+    memcpy(head.id, fcb.data, KEY_SIZE);
+    head.type = DENTRY_TYPE(fcb.mode);
+    CHECKED_CALL(write_dentry, parent_fcb.data, offset, &head, stored_name);
+    CHECKED_CALL(set_dent, parent_fcb.data, name, fcb.data, offset);
+
+    return 0;
+}
+
+static int set_permissions(struct fuse_file_info* fi, myfcb fcb, const struct fuse_ctx* ctx) {
+    int iLog = 0;
+    int flags = fi->flags;
+    LOG_FUNC("\tACCESS ALLOWED ?  flags=0%03o  myfcb.mode=0%03o\n", flags, fcb.mode);
+    if (S_ISDIR(flags)) {
+        LOG_CLARIFY("\t\tflags is directory\n");
+        TEST_CONDITION(!S_ISDIR(fcb.mode), "attempted to access a non-directory as if its a directory", -ENOTDIR);
+        flags ^= S_IFDIR;
+    }
+    else if (S_ISREG(flags)) {
+        LOG_CLARIFY("\t\tflags is regular\n");
+        TEST_CONDITION(!S_ISREG(fcb.mode), "attempted to access a non-regular file as if its a regular file", -EISDIR);
+        flags ^= S_IFREG;
+    }
+    else if (S_ISLNK(flags)) {
+        LOG_CLARIFY("\t\tflags is symlink\n");
+        TEST_CONDITION(!S_ISLNK(fcb.mode), "attempted to access a non-symlink as if its a symlink", -ENOLINK);
+        flags ^= S_IFLNK;
+    }
+
+    LOG_CLARIFY("\t\tpassed initial checks  flags=0%03o\n", flags);
+
+
+    uid_t uid = ctx->uid;
+    gid_t gid = ctx->gid;
+    LOG_GENERAL("\t\tuid=0%03o  gid=0%03o\n", uid, gid);
+
+    // Take the appropriate permissions.
+    int permissions[3];
+    int R = 0, W = 1, X = 2;
+    if (uid == fcb.uid) {
+        LOG_CLARIFY("\t\towner accessing file\n");
+        permissions[R] = fcb.mode & S_IRUSR;
+        permissions[W] = fcb.mode & S_IWUSR;
+        permissions[X] = fcb.mode & S_IXUSR;
+    }
+    else if (gid == fcb.gid) {
+        LOG_CLARIFY("\t\tgroup accessing file\n");
+        permissions[R] = fcb.mode & S_IRGRP;
+        permissions[W] = fcb.mode & S_IWGRP;
+        permissions[X] = fcb.mode & S_IXGRP;
+    }
+    else {
+        LOG_CLARIFY("\t\tother accessing file\n");
+        permissions[R] = fcb.mode & S_IROTH;
+        permissions[W] = fcb.mode & S_IWOTH;
+        permissions[X] = fcb.mode & S_IXOTH;
     }
-    LOG_META(md);
 
-    stbuf->st_mode = fcb.mode;
-    stbuf->st_uid = fcb.uid;
-    stbuf->st_gid = fcb.gid;
+    fi->fh = (uint64_t) (O_ACCMODE & flags);  // rdwr==10,wronly=01, rdonly=00  (binary)
+    TEST_CONDITION(fi->fh % 2 == 0 && !permissions[R], "no read permissions", -EACCES);  // read is even
+    TEST_CONDITION(fi->fh > 0 && !permissions[W], "no write permissions", -EACCES);  // write is > 0
 
-    stbuf->st_size = md.size;
-    stbuf->st_nlink = md.nlinks;
-    stbuf->st_atime = md.atime;
-    stbuf->st_mtime = md.mtime;
-    stbuf->st_ctime = md.ctime;
+    if (flags & O_APPEND && permissions[W]) fi->nonseekable = 1;
+    TEST_CONDITION((flags & O_APPEND && !permissions[W]), "no append permissions", -EACCES);
+
+    if (flags & O_CREAT && permissions[W]) fi->fh |= O_CREAT;
+    TEST_CONDITION((flags & O_CREAT && !permissions[W]), "no create permissions", -EACCES);
+
+    fi->fh_old = OPEN_CALLED;
 
     return 0;
 }
 
-// Set update the times (actime, modtime) for a file. This FS only supports modtime.
-// Read 'man 2 utime'.
-static int myfs_utime(const char* path, struct utimbuf* ubuf) {
+
+
+
+
+/** ============================ Required functions ============================ */
+/** ============================ Required functions ============================ */
+/** ============================ Required functions ============================ */
+// Each operation is done by a function that returns 0 or an error code, like the rest of the file system,
+// and answered by a myfs_ll_ function of the same name that FUSE calls, see myfs_oper.
+
+/** ======================== Any type of File functions ======================== */
+
+// Look a name up in a directory.
+// The kernel does this once for each component of a path, and then uses the number of the inode.
+static int myfs_lookup(fuse_ino_t parent, const char* name, struct fuse_entry_param* e) {
     int iLog = 0;
-    LOG_FUNC("UTIME path=\"%s\"\n", path);
+    LOG_FUNC("LOOKUP parent=%llu  name=\"%s\"\n", (unsigned long long) parent, name);
 
+    myfcb parent_fcb, fcb;
     meta_data md;
-    myfcb fcb;
-    int CHECKED_CALL(get_fcb_and_meta, path, &fcb, &md);
-    if (ubuf == NULL) {
-        md.atime = time(0);
-        md.mtime = time(0);
-    }
-    else {
-        md.atime = ubuf->actime;
-        md.mtime = ubuf->modtime;
+    int CHECKED_CALL(get_inode, parent, &parent_fcb, &md);
+    rc = get_child(parent_fcb, name, &fcb, &md, NULL);
+    if (rc == -ENOENT && config.negative_timeout > 0) {
+        // Number 0 tells the kernel to remember that the name is missing.
+        memset(e, 0, sizeof(struct fuse_entry_param));
+        e->entry_timeout = config.negative_timeout;
+        return 0;
     }
-    CHECKED_CALL(set_meta, fcb.data, &md);
+    if (rc) return rc;
+    CHECKED_CALL(make_entry, fcb, md, e);
 
     return 0;
 }
 
-// Set permissions.
-// Read 'man 2 chmod'.
-static int myfs_chmod(const char* path, mode_t mode) {
+// Get file and directory attributes (meta-data).
+// Read 'man 2 stat' and 'man 2 chmod'.
+static int myfs_getattr(fuse_ino_t ino, struct stat* stbuf) {
     int iLog = 0;
-    LOG_FUNC("CHMOD path=\"%s\"  mode=0%03o \n", path, mode);
+    LOG_FUNC("GET ATTRIBUTES ino=%llu\n", (unsigned long long) ino);
+
     myfcb fcb;
     meta_data md;
-    int CHECKED_CALL(get_fcb_and_meta, path, &fcb, &md);
-    fcb.mode = mode;
-
+    int CHECKED_CALL(get_inode, ino, &fcb, &md);
     LOG_FCB(fcb);
-    CHECKED_CALL(store, fcb.file_data_id, KEY_SIZE, &fcb, MYFCB_SIZE);
+    LOG_META(md);
+    fill_stat(ino, md, stbuf);
+
+    return 0;
+}
+
+// Set the size of a file.
+// Read 'man 2 truncate'.
+static int myfs_truncate(myfcb fcb, off_t newsize) {
+    int iLog = 0;
+    LOG_FUNC("TRUNCATE newsize=%lld\n", newsize);
+    TEST_CONDITION(newsize >= MY_MAX_FILE_SIZE, "myfs_truncate - new file size too big", -EFBIG);
+
+    inline_record rec;
+    int CHECKED_CALL(get_meta_inline, fcb.data, &rec);
+    meta_data md = rec.md;
+    if (newsize == md.size) return 0;
+
+    if (md.inlined) {
+        if (newsize <= config.inline_max) {
+            if (newsize > md.size) memset(rec.contents + md.size, 0, (size_t) (newsize - md.size));
+            rec.md.size = newsize;
+            rec.md.mtime = rec.md.ctime = time(0);
+            CHECKED_CALL(set_meta_inline, fcb.data, &rec);
+            return 0;
+        }
+        CHECKED_CALL(spill_inline, fcb.data, &rec);
+        md = rec.md;
+    }
+
+    // The OS checks if this is a regular file.
+    // Drop the blocks past the new end, so that growing the file again reads zeros.
+    // Growing the file only leaves a hole, nothing is stored for it.
+    if (newsize < md.size) {
+        CHECKED_CALL(remove_blocks, fcb.data, &md, newsize);
+    }
+    md.size = newsize;
+    md.mtime = md.ctime = time(0);
     CHECKED_CALL(set_meta, fcb.data, &md);
 
     return 0;
 }
 
-// Set ownership.
-// Read 'man 2 chown'.
-static int myfs_chown(const char* path, uid_t uid, gid_t gid) {
+// Set the attributes that to_set names: the size, permissions, ownership and times.
+// Read 'man 2 truncate', 'man 2 chmod', 'man 2 chown' and 'man 2 utime'.
+static int myfs_setattr(fuse_ino_t ino, struct stat* attr, int to_set, struct stat* stbuf) {
     int iLog = 0;
-    LOG_FUNC("CHOWN path=\"%s\"  uid=%d  gid=%d\n", path, uid, gid);
+    LOG_FUNC("SET ATTRIBUTES ino=%llu  to_set=0x%x\n", (unsigned long long) ino, to_set);
+
     myfcb fcb;
     meta_data md;
-    int CHECKED_CALL(get_fcb_and_meta, path, &fcb, &md);
-    fcb.uid = uid;
-    fcb.gid = gid;
-
-    LOG_FCB(fcb);
-    CHECKED_CALL(store, fcb.file_data_id, KEY_SIZE, &fcb, MYFCB_SIZE);
-    CHECKED_CALL(set_meta, fcb.data, &md);
+    int CHECKED_CALL(get_inode, ino, &fcb, &md);
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        CHECKED_CALL(myfs_truncate, fcb, attr->st_size);
+        CHECKED_CALL(get_meta, fcb.data, &md);
+    }
+    if (to_set & ~FUSE_SET_ATTR_SIZE) {
+        if (to_set & FUSE_SET_ATTR_MODE) md.mode = attr->st_mode;
+        if (to_set & FUSE_SET_ATTR_UID) md.uid = attr->st_uid;
+        if (to_set & FUSE_SET_ATTR_GID) md.gid = attr->st_gid;
+        if (to_set & FUSE_SET_ATTR_ATIME)
+            md.atime = (to_set & FUSE_SET_ATTR_ATIME_NOW) ? time(0) : attr->st_atime;
+        if (to_set & FUSE_SET_ATTR_MTIME)
+            md.mtime = (to_set & FUSE_SET_ATTR_MTIME_NOW) ? time(0) : attr->st_mtime;
+        md.ctime = time(0);
+        LOG_META(md);
+        CHECKED_CALL(set_meta, fcb.data, &md);
+    }
+    fill_stat(ino, md, stbuf);
 
     return 0;
 }
 
 // Open a file. Open should check if the operation is permitted for the given flags (fi->flags).
 // Read 'man 2 open'.
-static int myfs_open(const char* path, struct fuse_file_info* fi) {
+static int myfs_open(fuse_ino_t ino, struct fuse_file_info* fi, const struct fuse_ctx* ctx) {
     int iLog = 1;
-    LOG_FUNC("OPEN  path=\"%s\"  fi->flags=0%03o\n", path, fi->flags);
+    LOG_FUNC("OPEN  ino=%llu  fi->flags=0%03o\n", (unsigned long long) ino, fi->flags);
     myfcb fcb;
-    int CHECKED_CALL(get_fcb, path, &fcb);
-    CHECKED_CALL(set_permissions, fi, fcb);
+    meta_data md;
+    int CHECKED_CALL(get_inode, ino, &fcb, &md);
+    CHECKED_CALL(set_permissions, fi, fcb, ctx);
 
     return 0;
 }
@@ -561,63 +1964,56 @@ static int myfs_open(const char* path, struct fuse_file_info* fi) {
 /** ======================== Regular File functions ======================== */
 // Read a file.
 // Read 'man 2 read'.
-static int myfs_read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+static int myfs_read(fuse_ino_t ino, char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
     int iLog = 1;
-    LOG_FUNC("READ path=\"%s\"  size=%d  offset=%lld  fi->flags=0%03o\n", path, size, offset, fi->flags);
+    LOG_FUNC("READ ino=%llu  size=%d  offset=%lld  fi->flags=0%03o\n", (unsigned long long) ino, size, offset,
+             fi->flags);
 
     TEST_CONDITION((fi->fh_old & OPEN_CALLED) && (fi->fh % 2), "myfs_read no read permissions", -EACCES);
 
-    size_t len;
-    (void) fi;
+    inline_record rec;
+    uuid_t data;
+    int CHECKED_CALL(get_id, ino, data);
+    CHECKED_CALL(get_meta_inline, data, &rec);
+    lookup_stats.reads++;
 
-    uint8_t data_block[MY_MAX_FILE_SIZE];
-    memset(&data_block, 0, MY_MAX_FILE_SIZE);
-    meta_data md;
-    myfcb fcb;
-    int CHECKED_CALL(get_fcb_and_meta, path, &fcb, &md);
-
-    len = (size_t) md.size;
-    // Is there a data block?
-    if (len) {
-        LOG_CLARIFY("\tthere is data\n");
-        unqlite_int64 nBytes;  //Data length.
-        CHECKED_CALL(fetch, fcb.data, KEY_SIZE, NULL, &nBytes);
-        LOG_GENERAL("\tsize = %d\n", nBytes);
-        error_handler(rc);
-        TEST_CONDITION(nBytes != MY_MAX_FILE_SIZE, "myfs_read - EIO", -EIO);
-
-        // Fetch the fcb the root data block from the store.
-        CHECKED_CALL(fetch, fcb.data, KEY_SIZE, &data_block, &nBytes);
-    }
-
-    if (offset < len) {
-        if (offset + size > len)  // Can't read beyond the end of the file.
-            size = len - offset;
-        memcpy(buf, &data_block + offset, size);
-        md.atime = time(0);
-        CHECKED_CALL(set_meta, fcb.data, &md);
+    if (offset >= rec.md.size) return 0;  // Can't read beyond the end of the file.
+    if (offset + size > rec.md.size)
+        size = (size_t) (rec.md.size - offset);
+
+    if (rec.md.inlined) memcpy(buf, rec.contents + offset, size);
+    else {
+        CHECKED_CALL(read_blocks, data, buf, size, offset);
     }
-    else size = 0;  // Can't read beyond the end of the file.
 
-    return size;
+    CHECKED_CALL(touch_atime, data, &rec.md);
+
+    return (int) size;
 }
 
 // Read 'man 2 creat'.
-static int myfs_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
+static int myfs_create(fuse_ino_t parent, const char* name, mode_t mode, struct fuse_file_info* fi,
+                       const struct fuse_ctx* ctx, struct fuse_entry_param* e) {
     int iLog = 1;
-    LOG_FUNC("CREATE path=\"%s\"\n", path);
+    LOG_FUNC("CREATE parent=%llu  name=\"%s\"\n", (unsigned long long) parent, name);
     TEST_CONDITION(fi->fh_old & OPEN_CALLED && (fi->fh & O_CREAT),
                    "myfs_create - no create permissions", -EACCES);
 
-    return attach_fcb_to_tree(path, mode | S_IFREG, NULL, NULL);
+    myfcb parent_fcb, fcb;
+    meta_data md;
+    int CHECKED_CALL(get_inode, parent, &parent_fcb, &md);
+    CHECKED_CALL(attach_fcb_to_tree, parent_fcb, name, mode | S_IFREG, ctx, &fcb, &md);
+    CHECKED_CALL(make_entry, fcb, md, e);
+
+    return 0;
 }
 
-// Write to a file.
-// Read 'man 2 write'
-static int myfs_write(const char* path, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+// Writes the payload in 'src' to a file, for both myfs_ll_write and myfs_ll_write_buf.
+static int write_file(fuse_ino_t ino, struct fuse_bufvec* src, off_t offset, struct fuse_file_info* fi) {
     int iLog = 1;
-    LOG_FUNC("WRITE path=\"%s\"  data=\"%d\"  size=%d  offset=%lld  fi->flags=0%03o\n", path, buf, size, offset,
-             fi->flags);
+    size_t size = fuse_buf_size(src);
+    LOG_FUNC("\tWRITE FILE ino=%llu  size=%d  offset=%lld  fi->flags=0%03o\n", (unsigned long long) ino, size,
+             offset, fi->flags);
 
     int permission = (int) (fi->fh % 4);
     TEST_CONDITION(fi->fh_old & OPEN_CALLED && (permission == 0 || permission == 3),
@@ -625,170 +2021,477 @@ static int myfs_write(const char* path, const char* buf, size_t size, off_t offs
     TEST_CONDITION(size >= MY_MAX_FILE_SIZE, "myfs_write - input size exceeds max", -EFBIG);
     TEST_CONDITION(offset >= MY_MAX_FILE_SIZE, "myfs_write - input offset exceeds max", -EFBIG);
 
-    uint8_t data_block[MY_MAX_FILE_SIZE];
-    memset(&data_block, 0, MY_MAX_FILE_SIZE);
-    meta_data md;
-    myfcb fcb;
-    int CHECKED_CALL(get_fcb_and_meta, path, &fcb, &md);
+    inline_record rec;
+    meta_data* md = &rec.md;
+    uuid_t data;
+    int CHECKED_CALL(get_id, ino, data);
+    CHECKED_CALL(get_meta_inline, data, &rec);
 
-    TEST_CONDITION(fi->nonseekable && offset < md.size,
+    TEST_CONDITION(fi->nonseekable && offset < md->size,
                    "myfs_write - no permission to write before the end of the file", -EACCES);
-    //<editor-fold desc="Read previously stored data">
-    if (md.size) {
-        LOG_CLARIFY("\tdata size = %d\n", md.size);
-        // Check object size, to prevent overflow
-        unqlite_int64 nBytes;  // Data length.
-        CHECKED_CALL(fetch, fcb.data, KEY_SIZE, NULL, &nBytes);
-        TEST_CONDITION(nBytes != MY_MAX_FILE_SIZE, "myfs_write - bad file size", -EIO);
-
-        // Fetch the data block from the store.
-        CHECKED_CALL(fetch, fcb.data, KEY_SIZE, &data_block, &nBytes);
-    }
-    //</editor-fold>
 
     // Can't write beyond the end of the file.
     if (offset + size > MY_MAX_FILE_SIZE)
         size = (size_t) (MY_MAX_FILE_SIZE - offset);
+    off_t newsize = (md->size > offset + size ? md->size : offset + size);
+
+    if (md->blocks == 0 && newsize <= config.inline_max) {
+        // Small enough to keep inline. A file with no blocks that is not inline yet is all holes.
+        if (!md->inlined) memset(rec.contents, 0, (size_t) md->size);
+        if (offset > md->size) memset(rec.contents + md->size, 0, (size_t) (offset - md->size));
+        const uint8_t* payload;
+        CHECKED_CALL(take_payload, src, size, rec.contents + offset, &payload);
+        if (payload != rec.contents + offset) memcpy(rec.contents + offset, payload, size);
+        md->size = newsize;
+        md->mtime = md->ctime = time(0);
+        CHECKED_CALL(set_meta_inline, data, &rec);
+        LOG_META(*md);
+
+        return (int) size;
+    }
 
-    // Get the data from memory.
-    // Copy all the bytes (including \0's)
-    for (int i = 0; i < size; ++i)
-        *(data_block + offset + i) = (uint8_t) buf[i];
-
-    // Write the data to the store.
-    CHECKED_CALL(store, fcb.data, KEY_SIZE, &data_block, MY_MAX_FILE_SIZE);
-
-    // Update the meta data in storage.
-    md.size = (md.size > offset + size ? md.size : offset + size);
-    md.mtime = time(0);
-    md.atime = time(0);
-    CHECKED_CALL(set_meta, fcb.data, &md);
-    LOG_META(md);
+    // Spilling leaves the contents in the stored record, which has to be replaced as a whole.
+    int spilled = md->inlined;
+    if (spilled) {
+        CHECKED_CALL(spill_inline, data, &rec);
+    }
+    CHECKED_CALL(write_blocks, data, md, src, size, offset);
+
+    // The meta data is stored with the next batch, so a copy in many chunks stores it once.
+    md->size = newsize;
+    md->mtime = md->ctime = time(0);
+    if (spilled) {
+        CHECKED_CALL(set_meta, data, md);
+    } else {
+        CHECKED_CALL(set_meta_lazy, data, md);
+    }
+    LOG_META(*md);
 
-    return size;
+    return (int) size;
 }
 
 // Delete a file.
 // Read 'man 2 unlink'.
-static int myfs_unlink(const char* path) {
+static int myfs_unlink(fuse_ino_t parent, const char* name) {
     int iLog = 0;
-    LOG_FUNC("UNLINK path=\"%s\"\n", path);
+    LOG_FUNC("UNLINK parent=%llu  name=\"%s\"\n", (unsigned long long) parent, name);
 
-    myfcb parent_fcb;
-    meta_data parent_md;
-    int CHECKED_CALL(get_parent_fcb, path, &parent_fcb);
-    CHECKED_CALL(get_meta, parent_fcb.data, &parent_md);
-    char data[parent_md.size * MY_DENTRY_SIZE];
-    CHECKED_CALL(get_data, parent_fcb, data);
-    myfcb child_fcb;
-    int index;
-    CHECKED_CALL(get_child_fcb, path, data, parent_md.size, &child_fcb, &index);
-    CHECKED_CALL(detach_fcb_from_tree, child_fcb, parent_fcb, index, data);
+    myfcb parent_fcb, child_fcb;
+    meta_data md;
+    uint64_t offset;
+    int CHECKED_CALL(get_inode, parent, &parent_fcb, &md);
+    CHECKED_CALL(get_child, parent_fcb, name, &child_fcb, &md, &offset);
+    CHECKED_CALL(detach_fcb_from_tree, child_fcb, parent_fcb, name, offset);
 
     return 0;
 }
 
-// Set the size of a file.
-// Read 'man 2 truncate'.
-static int myfs_truncate(const char* path, off_t newsize) {
+
+/** ======================== Directory functions ======================== */
+// The offset that readdir hands the kernel with each entry is where the next one starts:
+// 1 and 2 are past . and .., and READDIR_DOTS + n is the offset n in the directory's list.
+#define READDIR_DOTS 2
+
+/**
+ * Loads the inode of an entry that readdir is listing and puts its index entry in the dentry cache,
+ * so the lookup and the stat that usually follow for each entry (ls -l, find) are answered from memory.
+ *
+ * @param dir the uuid of the directory
+ * @param name the name of the entry
+ * @param id the uuid of the entry's inode
+ * @param offset the offset of the entry in the directory's list
+ * @param md receives the inode of the entry
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int prefetch_child(uuid_t dir, const char* name, uuid_t id, uint64_t offset, meta_data* md) {
     int iLog = 0;
-    LOG_FUNC("TRUNCATE path=\"%s\"  newsize=%lld\n", path, newsize);
-    TEST_CONDITION(newsize >= MY_MAX_FILE_SIZE, "myfs_truncate - new file size too big", -EFBIG);
+    LOG_FUNC("\tPREFETCH CHILD name=\"%s\"\n", name);
+
+    int CHECKED_CALL(get_meta, id, md);
+    dcache_insert(dir, name, id, offset);
+
+    return 0;
+}
+
+static int myfs_readdir(fuse_req_t req, fuse_ino_t ino, char* buf, size_t size, off_t offset,
+                        struct fuse_file_info* fi, size_t* filled) {
+    int iLog = 1;
+    LOG_FUNC("READ DIR ino=%llu  offset=%lld  fi->flags=0%03o\n", (unsigned long long) ino, offset, fi->flags);
+    TEST_CONDITION((fi->fh_old & OPEN_CALLED) && (fi->fh % 2), "myfs_readdir - no read permissions", -EACCES);
 
     myfcb fcb;
     meta_data md;
-    int CHECKED_CALL(get_fcb_and_meta, path, &fcb, &md);
-    if (newsize == md.size) return 0;
+    int CHECKED_CALL(get_inode, ino, &fcb, &md);
+    TEST_CONDITION(!S_ISDIR(fcb.mode), "myfs_readdir - not a directory", -ENOTDIR);
+    int first = offset == 0;
+
+    // The entries have no numbers until the kernel looks them up.
+    struct stat st;
+    memset(&st, 0, sizeof(struct stat));
+    st.st_ino = MYFS_UNKNOWN_INO;
+    *filled = 0;
+
+    // We always output . and .. first, by convention.
+    static const char* dots[READDIR_DOTS] = {".", ".."};
+    for (; offset < READDIR_DOTS; ++offset) {
+        size_t len = fuse_add_direntry(req, buf + *filled, size - *filled, dots[offset], &st, offset + 1);
+        if (len > size - *filled) return 0;
+        *filled += len;
+    }
 
-    // The OS checks if this is a regular file.
-    md.size = newsize;
-    md.mtime = time(0);
-    CHECKED_CALL(set_meta, fcb.data, &md);
+    // A dentry takes at most a few bytes more than the kernel's record of it,
+    // so twice the buffer of the list has more entries than fit in the buffer.
+    // Free dentries add nothing, and the list is read on past them,
+    // because the kernel takes an empty answer for the end of the directory.
+    // Only whole dentries are taken, the next call starts with the first one that was left.
+    dentry_reader reader;
+    CHECKED_CALL(open_dentries, &reader, fcb.data, md.size, offset - READDIR_DOTS, 2 * size + DENTRY_MAX_LEN);
+    dentry_head head;
+    char child[UINT8_MAX + 1];
+    off_t at;
+    while ((rc = next_dentry(&reader, &at, &head, child)) > 0) {
+        if (head.type == DENTRY_FREE) continue;
+        LOG_CLARIFY("\tchild=\"%s\"\n", child);
+        // The kernel takes the type of the entry (d_type) from its attributes. The dentry holds the type,
+        // so tree walkers like find learn which entries are directories without a getattr for each.
+        meta_data child_md;
+        if (!config.no_prefetch && prefetch_child(fcb.data, child, head.id, (uint64_t) at, &child_md) == 0) {
+            fill_stat(MYFS_UNKNOWN_INO, child_md, &st);
+        } else {
+            memset(&st, 0, sizeof(struct stat));
+            st.st_ino = MYFS_UNKNOWN_INO;
+            st.st_mode = DENTRY_MODE(head.type);
+        }
+        size_t n = fuse_add_direntry(req, buf + *filled, size - *filled, child, &st, READDIR_DOTS + at + head.rec_len);
+        if (n > size - *filled) break;
+        *filled += n;
+    }
+    close_dentries(&reader);
+    if (rc < 0) {
+        LOG_ERR("myfs_readdir - failed to read the dentries\n");
+        return rc;
+    }
+
+    // A listing takes several calls, the access is counted once.
+    if (first) {
+        CHECKED_CALL(touch_atime, fcb.data, &md);
+    }
 
     return 0;
 }
 
+// Create a directory.
+// Read 'man 2 mkdir'.
+static int myfs_mkdir(fuse_ino_t parent, const char* name, mode_t mode, const struct fuse_ctx* ctx,
+                      struct fuse_entry_param* e) {
+    int iLog = 0;
+    LOG_FUNC("MK DIR parent=%llu  name=\"%s\"\n", (unsigned long long) parent, name);
+
+    myfcb parent_fcb, fcb;
+    meta_data md;
+    int CHECKED_CALL(get_inode, parent, &parent_fcb, &md);
+    CHECKED_CALL(attach_fcb_to_tree, parent_fcb, name, mode | S_IFDIR, ctx, &fcb, &md);
+    LOG_FCB(fcb);
+    void* empty = 0;
+    CHECKED_CALL(store, fcb.data, KEY_SIZE, empty, 0);
+    CHECKED_CALL(make_entry, fcb, md, e);
 
-/** ======================== Directory functions ======================== */
-// Read a directory.
-// Read 'man 2 readdir'.
-static int myfs_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi) {
-    int iLog = 1;
-    LOG_FUNC("READ DIR path=\"%s\"  offset=%lld  fi->flags=0%03o\n", path, offset, fi->flags);
-    TEST_CONDITION((fi->fh_old & OPEN_CALLED) && (fi->fh % 2), "myfs_readdir - no read permissions", -EACCES);
-    (void) offset;  // This prevents compiler warnings
-    (void) fi;
+    return 0;
+}
 
-    myfcb fcb;
+// Delete a directory.
+// Read 'man 2 rmdir'.
+static int myfs_rmdir(fuse_ino_t parent, const char* name) {
+    int iLog = 0;
+    LOG_FUNC("RM DIR parent=%llu  name=\"%s\"\n", (unsigned long long) parent, name);
+
+    myfcb fcb, parent_fcb;
     meta_data md;
-    const char* p = (strcmp(path, "/") ? path : "");
-    int CHECKED_CALL(get_fcb_and_meta, p, &fcb, &md);
-
-    // We always output . and .. first, by convention. See documentation for more info on filler()
-    int frc;
-    frc = filler(buf, ".", NULL, 0);
-    TEST_CONDITION(frc, "myfs_readdir - buffer full after adding .", -EIO);
-    frc = filler(buf, "..", NULL, 0);
-    TEST_CONDITION(frc, "myfs_readdir - buffer full after adding ..", -EIO);
-
-    // if there is no data, return
-    if (md.size == 0) return 0;
+    uint64_t offset;
+    int CHECKED_CALL(get_inode, parent, &parent_fcb, &md);
+    CHECKED_CALL(get_child, parent_fcb, name, &fcb, &md, &offset);
     LOG_FCB(fcb);
+    LOG_META(md);
+    // While the directory is listed its list may hold only free dentries, see remove_dentry.
+    if ((uint64_t) md.size > md.dead) return -ENOTEMPTY;
+    LOG_CLARIFY("\tDetaching this directory.\n");
+    CHECKED_CALL(detach_fcb_from_tree, fcb, parent_fcb, name, offset);
 
-    LOG_CLARIFY("\tdata found, size=%d\n", md.size);
-    char data[md.size * MY_DENTRY_SIZE];
-    CHECKED_CALL(get_data, fcb, data);
-    char* child;
-    for (int i = 0; i < md.size; ++i) {
-        child = data + i * MY_DENTRY_SIZE + KEY_SIZE;
-        int ind = index_of_last_dash(child);
-        child += ind + 1;
-        LOG_CLARIFY("\tchild=\"%s\"\n", child);
-        frc = filler(buf, child, NULL, 0);
-        TEST_CONDITION(frc, "myfs_readdir - buffer full after adding a child", -EIO);
+    return 0;
+}
+
+
+
+
+
+
+
+/** =========================== Extension functions =========================== */
+/** =========================== Extension functions =========================== */
+/** =========================== Extension functions =========================== */
+/**
+ * Creates a hard link from a new entry to an existing file's inode.
+ *
+ * @param ino the number of the existing file
+ * @param newparent the number of the directory where the hard link will be placed
+ * @param newname the name of the hard link
+ * @param e receives the number and the attributes of the file
+ * @return 0 on success, error code otherwise
+ */
+static int myfs_link(fuse_ino_t ino, fuse_ino_t newparent, const char* newname, struct fuse_entry_param* e) {
+    int iLog = 0;
+    LOG_FUNC("LINK ino=%llu, newparent=%llu  newname=\"%s\"\n", (unsigned long long) ino,
+             (unsigned long long) newparent, newname);
+
+    // Get 'existing' FCB
+    myfcb existing_fcb, parent_fcb;
+    meta_data existing_md, parent_md;
+    int CHECKED_CALL(get_inode, ino, &existing_fcb, &existing_md);
+    CHECKED_CALL(get_inode, newparent, &parent_fcb, &parent_md);
+
+    // The new entry holds the same uuid, so both lead to the same inode.
+    CHECKED_CALL(link_to_tree, parent_fcb, newname, existing_fcb);
+    LOG_GENERAL("----returned from LINK TO TREE\n");
+    LOG_FCB(existing_fcb);
+
+    // Increment hard links count to that entry by one
+    existing_md.nlinks++;
+    existing_md.ctime = time(0);
+    LOG_GENERAL("\tnlinks=%lld\n", existing_md.nlinks);
+    CHECKED_CALL(set_meta, existing_fcb.data, &existing_md);
+    CHECKED_CALL(make_entry, existing_fcb, existing_md, e);
+
+    return 0;
+
+}
+
+/**
+ * Reads a symbolic (soft) link.
+ *
+ * @param ino the number of the link
+ * @param buf the buffer for the result of following the link
+ * @param size the size of the buffer, which leaves room for a null at the end
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int myfs_readlink(fuse_ino_t ino, char* buf, size_t size) {
+    int iLog = 0;
+    LOG_FUNC("READ LINK ino=%llu  size=%lld\n", (unsigned long long) ino, size);
+
+    uuid_t link;
+    int CHECKED_CALL(get_id, ino, link);
+
+    unqlite_int64 expected_size = (unqlite_int64) size - 1;
+    CHECKED_CALL(fetch, link, KEY_SIZE, buf, &expected_size);
+    buf[expected_size] = '\0';
+
+    LOG_GENERAL("\tbuf=\"%s\"\n", buf);
+
+    return 0;
+}
+
+/**
+ * Creates a new symbolic link to the existing path.
+ *
+ * @param existing the path of the existing file (target)
+ * @param parent the number of the directory of the symbolic link to be created
+ * @param name the name of the symbolic link
+ * @param ctx the caller, who owns the link
+ * @param e receives the number and the attributes of the link
+ * @return 0 on success, an appropriate error code otehrwise
+ */
+static int myfs_symlink(const char* existing, fuse_ino_t parent, const char* name, const struct fuse_ctx* ctx,
+                        struct fuse_entry_param* e) {
+    int iLog = 0;
+    LOG_FUNC("SYMLINK  existing=\"%s\"  parent=%llu  name=\"%s\"\n", existing, (unsigned long long) parent, name);
+
+    myfcb parent_fcb, new_fcb;
+    meta_data md;
+    int mode = S_IRUSR | S_IWUSR | S_IFLNK;
+    int CHECKED_CALL(get_inode, parent, &parent_fcb, &md);
+    CHECKED_CALL(attach_fcb_to_tree, parent_fcb, name, mode, ctx, &new_fcb, &md);
+    LOG_FCB(new_fcb);
+
+    // Copy the id of the existing FCB to the data of the new one.
+    md.size = strlen(existing);
+    CHECKED_CALL(store, new_fcb.data, KEY_SIZE, (void*) existing, md.size);
+    CHECKED_CALL(set_meta, new_fcb.data, &md);
+    LOG_GENERAL("----returned from store\n");
+    LOG_FCB(new_fcb);
+    CHECKED_CALL(make_entry, new_fcb, md, e);
+
+    return 0;
+}
+
+static int myfs_rename(fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname) {
+    int iLog = 0;
+    LOG_FUNC("RENAME parent=%llu  name=\"%s\"  newparent=%llu  newname=\"%s\"\n", (unsigned long long) parent,
+             name, (unsigned long long) newparent, newname);
+
+    myfcb from_parent, to_parent, fcb, to_fcb;
+    meta_data md, to_md;
+    uint64_t offset, to_offset;
+    int CHECKED_CALL(get_inode, parent, &from_parent, &md);
+    CHECKED_CALL(get_inode, newparent, &to_parent, &md);
+    CHECKED_CALL(get_child, from_parent, name, &fcb, &md, &offset);
+
+    // The dentry moves, the inode stays as it is: a directory takes its whole subtree along.
+    // Nothing else in either list moves until the source is removed, so the offsets stay valid.
+    rc = get_child(to_parent, newname, &to_fcb, &to_md, &to_offset);
+    int replaced = rc == 0;
+    if (replaced) {
+        LOG_CLARIFY("\texists:\n");
+        LOG_FCB(to_fcb);
+        // Two links to the same file: there is nothing to do.
+        if (uuid_compare(fcb.data, to_fcb.data) == 0) return 0;
+        TEST_CONDITION(S_ISDIR(to_md.mode) && (uint64_t) to_md.size > to_md.dead, "myfs_rename - destination not empty", -ENOTEMPTY);
+        CHECKED_CALL(replace_entry, to_parent, newname, to_offset, fcb);
+        CHECKED_CALL(drop_link, to_fcb);
+    }
+    else if (rc == -ENOENT) {
+        CHECKED_CALL(link_to_tree, to_parent, newname, fcb);
+    }
+    else return rc;
+
+    CHECKED_CALL(remove_entry, from_parent, name, offset);
+    // Replacing an entry does not change the size of its directory, which still has to show the change.
+    if (replaced && uuid_compare(from_parent.data, to_parent.data) != 0) {
+        CHECKED_CALL(get_meta, to_parent.data, &to_md);
+        to_md.mtime = to_md.ctime = time(0);
+        CHECKED_CALL(set_meta_lazy, to_parent.data, &to_md);
+    }
+
+    return 0;
+}
+
+/**
+ * Answers the MyFS ioctls (see myfs_ioctl.h), which stand in for lseek with SEEK_DATA and SEEK_HOLE
+ * and report the counters of the file system.
+ *
+ * @param ino the number of the file
+ * @param cmd the ioctl command
+ * @param data the off_t to search from, replaced with the result, or the counters to fill in
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int myfs_ioctl(fuse_ino_t ino, int cmd, unsigned int flags, void* data) {
+    int iLog = 0;
+    LOG_FUNC("IOCTL ino=%llu  cmd=0x%x\n", (unsigned long long) ino, cmd);
+
+    // cmd is passed as an int, but the ioctl numbers are unsigned.
+    unsigned int command = (unsigned int) cmd;
+    TEST_CONDITION(flags & FUSE_IOCTL_COMPAT, "myfs_ioctl - 32-bit ioctls are not supported", -ENOSYS);
+    if (command == MYFS_IOC_DEDUP_STATS) {
+        memcpy(data, &dedup_stats, sizeof(dedup_stats));
+        return 0;
+    }
+    if (command == MYFS_IOC_LOOKUP_STATS) {
+        memcpy(data, &lookup_stats, sizeof(lookup_stats));
+        return 0;
+    }
+    if (command == MYFS_IOC_ICACHE_STATS) {
+        struct myfs_icache_stats* stats = data;
+        icache_stats(&stats->hits, &stats->misses);
+        return 0;
+    }
+    TEST_CONDITION(command != MYFS_IOC_SEEK_DATA && command != MYFS_IOC_SEEK_HOLE,
+                   "myfs_ioctl - unknown command", -ENOTTY);
+
+    myfcb fcb;
+    meta_data md;
+    int CHECKED_CALL(get_inode, ino, &fcb, &md);
+    TEST_CONDITION(!S_ISREG(fcb.mode), "myfs_ioctl - not a regular file", -ENOTTY);
+    if (md.inlined) {
+        // An inline file is data throughout.
+        off_t* offset = data;
+        TEST_CONDITION(*offset < 0 || *offset >= md.size, "myfs_ioctl - offset outside of the file", -ENXIO);
+        if (command == MYFS_IOC_SEEK_HOLE) *offset = md.size;
+        return 0;
     }
+    CHECKED_CALL(seek_block, fcb.data, md.size, (off_t*) data, command == MYFS_IOC_SEEK_DATA);
+
+    return 0;
+}
+
+/**
+ * Stores the meta data of a file that was only changed in memory, once the file is closed.
+ *
+ * @param ino the number of the file
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int myfs_release(fuse_ino_t ino) {
+    int iLog = 0;
+    LOG_FUNC("RELEASE ino=%llu\n", (unsigned long long) ino);
+
+    uuid_t id;
+    int CHECKED_CALL(get_id, ino, id);
+    CHECKED_CALL(flush_inode, id);
+
+    return 0;
+}
+
+/**
+ * Opens a directory for listing it. Until the listing is released the dentries of the directory
+ * stay where they are, so the offsets that readdir hands out still lead to the next entry
+ * however many calls the listing takes and whatever is removed meanwhile.
+ *
+ * @param ino the number of the directory
+ * @param fi the flags of the open
+ * @param ctx the context of the caller
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int myfs_opendir(fuse_ino_t ino, struct fuse_file_info* fi, const struct fuse_ctx* ctx) {
+    int iLog = 0;
+    LOG_FUNC("OPEN DIR ino=%llu  fi->flags=0%03o\n", (unsigned long long) ino, fi->flags);
 
-    md.atime = time(0);
-    CHECKED_CALL(set_meta, fcb.data, &md);
+    myfcb fcb;
+    meta_data md;
+    int CHECKED_CALL(get_inode, ino, &fcb, &md);
+    TEST_CONDITION(!S_ISDIR(fcb.mode), "myfs_opendir - not a directory", -ENOTDIR);
+    // Listing only needs read permission, the other flags are those of any open.
+    fi->flags &= O_ACCMODE;
+    CHECKED_CALL(set_permissions, fi, fcb, ctx);
+    TEST_CONDITION(!itable_opendir(ino), "myfs_opendir - unknown inode", -ESTALE);
 
     return 0;
 }
 
-// Create a directory.
-// Read 'man 2 mkdir'.
-static int myfs_mkdir(const char* path, mode_t mode) {
+/**
+ * Releases a listing of a directory, and drops the free dentries of its list if it was
+ * the last listing, see remove_dentry.
+ *
+ * @param ino the number of the directory
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int myfs_releasedir(fuse_ino_t ino) {
     int iLog = 0;
-    LOG_FUNC("MK DIR path=\"%s\"\n", path);
+    LOG_FUNC("RELEASE DIR ino=%llu\n", (unsigned long long) ino);
 
-    myfcb fcb;
-    int CHECKED_CALL(attach_fcb_to_tree, path, mode | S_IFDIR, &fcb, NULL);
-    LOG_FCB(fcb);
-    void* empty = 0;
-    CHECKED_CALL(store, fcb.data, KEY_SIZE, empty, 0);
+    uuid_t id;
+    meta_data md;
+    int CHECKED_CALL(get_id, ino, id);
+    if (itable_releasedir(ino) > 0) return 0;
+    CHECKED_CALL(get_meta, id, &md);
+    if (S_ISDIR(md.mode) && md.dead) {
+        CHECKED_CALL(tidy_dentries, id, &md);
+        CHECKED_CALL(set_meta_lazy, id, &md);
+    }
 
     return 0;
 }
 
-// Delete a directory.
-// Read 'man 2 rmdir'.
-static int myfs_rmdir(const char* path) {
+/**
+ * Makes every change so far durable: stores the meta data that was only changed in memory
+ * and commits the database. The changes of every file are committed together, not just those of this one.
+ *
+ * @param ino the number of the file
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int myfs_fsync(fuse_ino_t ino) {
     int iLog = 0;
-    LOG_FUNC("RM DIR path=\"%s\"\n", path);
+    LOG_FUNC("FSYNC ino=%llu\n", (unsigned long long) ino);
 
-    myfcb fcb, parent_fcb;
-    meta_data md, parent_md;
-    int index_in_parent;
-    int CHECKED_CALL(get_parent_fcb, path, &parent_fcb);
-    CHECKED_CALL(get_meta, parent_fcb.data, &parent_md);
-    char parent_data[parent_md.size * MY_DENTRY_SIZE];
-    CHECKED_CALL(get_data, parent_fcb, parent_data);
-    CHECKED_CALL(get_child_fcb, path, parent_data, parent_md.size, &fcb, &index_in_parent);
-    CHECKED_CALL(get_meta, fcb.data, &md);
-    LOG_FCB(fcb);
-    LOG_META(md);
-    if (md.size) return -ENOTEMPTY;
-    LOG_CLARIFY("\tDetaching this directory.\n");
-    CHECKED_CALL(detach_fcb_from_tree, fcb, parent_fcb, index_in_parent, parent_data);
+    int CHECKED_CALL(flush_dirty);
+    rc = unqlite_commit(pDb);
+    TEST_CONDITION(rc, "myfs_fsync - failed to commit", -EIO);
 
     return 0;
 }
@@ -799,145 +2502,197 @@ static int myfs_rmdir(const char* path) {
 
 
 
-/** =========================== Extension functions =========================== */
-/** =========================== Extension functions =========================== */
-/** =========================== Extension functions =========================== */
-/**
- * Creates a hard link from a new file to an old file's data.
- *
- * @param from the path where the hard link will be placed
- * @param to the path of the currently existing data
- * @return 0 on success, error code otherwise
- */
-static int myfs_link(const char* existing, const char* new) {
-    int iLog = 0;
-    LOG_FUNC("LINK existing=\"%s\", new=\"%s\"\n", existing, new);
 
-    // Get 'existing' FCB
-    myfcb existing_fcb;
-    meta_data existing_md;
-    int CHECKED_CALL(get_fcb_and_meta, existing, &existing_fcb, &existing_md);
 
-    myfcb new_fcb;
-    CHECKED_CALL(attach_fcb_to_tree, new, existing_fcb.mode, &new_fcb, NULL);
-    LOG_GENERAL("----returned from ATTACH\n");
 
-    // Set new_fcb.data to be the same as existing_fcb.data (now they both point to the same DB entry)
-    memcpy(new_fcb.data, existing_fcb.data, KEY_SIZE);
-    LOG_FCB(existing_fcb);
-    LOG_FCB(new_fcb);
-    CHECKED_CALL(store, new_fcb.file_data_id, KEY_SIZE, &new_fcb, MYFCB_SIZE);
-    LOG_GENERAL("----returned from STORE\n");
 
-    // Increment hard links count to that entry by one
-    __nlink_t nlinks;
-    CHECKED_CALL(get_nlinks, new_fcb.data, &nlinks);
-    LOG_GENERAL("\tnlinks=%lld\n", nlinks);
-    CHECKED_CALL(set_nlinks, new_fcb.data, nlinks + 1);
+/** ======================== FUSE low-level callbacks ======================== */
+/** ======================== FUSE low-level callbacks ======================== */
+/** ======================== FUSE low-level callbacks ======================== */
+// Each of these answers its request with the result of the function above of the same name.
 
-    return 0;
+static void reply_entry(fuse_req_t req, int rc, struct fuse_entry_param* e) {
+    if (rc) fuse_reply_err(req, -rc);
+    else fuse_reply_entry(req, e);
+}
 
+static void myfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    struct fuse_entry_param e;
+    reply_entry(req, myfs_lookup(parent, name, &e), &e);
 }
 
-/**
- * Reads a symbolic (soft) link.
- *
- * @param path the path of the link
- * @param buf the buffer for the result of following the link
- * @param size the size of the buffer
- * @return 0 on success, an appropriate error code otherwise
- */
-static int myfs_readlink(const char* path, char* buf, size_t size) {
+// The kernel has dropped nlookup of the lookups of an inode.
+// Once it has dropped them all, an inode that was unlinked meanwhile is removed, see detach_fcb_from_tree.
+static void myfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
     int iLog = 0;
-    LOG_FUNC("READ LINK path=\"%s\"  buf=\"%s\"  size=%lld\n", path, buf, size);
+    LOG_FUNC("FORGET ino=%llu  nlookup=%lu\n", (unsigned long long) ino, nlookup);
 
-    myfcb link;
-    int CHECKED_CALL(get_fcb, path, &link);
-    LOG_GENERAL("\t\tlink:\n");
-    LOG_FCB(link);
+    uuid_t id;
+    meta_data md;
+    if (itable_forget(ino, nlookup, id) && get_meta(id, &md) == 0 && md.nlinks == 0) {
+        LOG_CLARIFY("\t\tRemoving data because no more links!\n");
+        if (remove_inode(fcb_of(id, md), &md) == 0) remove_orphan(id);
+    }
+    fuse_reply_none(req);
+}
 
-    unqlite_int64 expected_size = (unqlite_int64) size;
-    CHECKED_CALL(fetch, link.data, KEY_SIZE, buf, &expected_size);
+static void myfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    struct stat st;
+    int rc = myfs_getattr(ino, &st);
+    if (rc) fuse_reply_err(req, -rc);
+    else fuse_reply_attr(req, &st, config.attr_timeout);
+}
 
-    LOG_GENERAL("\tbuf=\"%s\"\n", buf);
+static void myfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set,
+                            struct fuse_file_info* fi) {
+    struct stat st;
+    int rc = myfs_setattr(ino, attr, to_set, &st);
+    if (rc) fuse_reply_err(req, -rc);
+    else fuse_reply_attr(req, &st, config.attr_timeout);
+}
 
-    return 0;
+static void myfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    int rc = myfs_open(ino, fi, fuse_req_ctx(req));
+    if (rc) fuse_reply_err(req, -rc);
+    else fuse_reply_open(req, fi);
 }
 
-/**
- * Creates a new symbolic link to the existing path.
- *
- * @param existing the path of the existing file (target)
- * @param new the path of the symbolic link to be created
- * @return 0 on success, an appropriate error code otehrwise
- */
-static int myfs_symlink(const char* existing, const char* new) {
-    int iLog = 0;
-    LOG_FUNC("SYMLINK  existing=\"%s\"  new=\"%s\"\n", existing, new);
+// The data is copied once, from the database pages into the reply buffer,
+// which FUSE can then splice to the kernel (see myfs_init).
+static void myfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi) {
+    char* buf = malloc(size ? size : 1);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    int rc = myfs_read(ino, buf, size, offset, fi);
+    if (rc < 0) fuse_reply_err(req, -rc);
+    else {
+        struct fuse_bufvec bufv = FUSE_BUFVEC_INIT((size_t) rc);
+        bufv.buf[0].mem = buf;
+        fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+    }
+    free(buf);
+}
 
-    myfcb new_fcb;
-    meta_data md;
-    int mode = S_IRUSR | S_IWUSR | S_IFLNK;
-    int CHECKED_CALL(attach_fcb_to_tree, new, mode, &new_fcb, &md);
-    LOG_FCB(new_fcb);
+static void myfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode,
+                           struct fuse_file_info* fi) {
+    struct fuse_entry_param e;
+    int rc = myfs_create(parent, name, mode, fi, fuse_req_ctx(req), &e);
+    if (rc) fuse_reply_err(req, -rc);
+    else fuse_reply_create(req, &e, fi);
+}
 
-    // Copy the id of the existing FCB to the data of the new one.
-    md.size = strlen(existing);
-    CHECKED_CALL(store, new_fcb.data, KEY_SIZE, (void*) existing, md.size);
-    CHECKED_CALL(store, new_fcb.file_data_id, KEY_SIZE, &new_fcb, MYFCB_SIZE);
-    CHECKED_CALL(set_meta, new_fcb.data, &md);
-    LOG_GENERAL("----returned from store\n");
-    LOG_FCB(new_fcb);
+// Write to a file.
+// Read 'man 2 write'
+static void myfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size, off_t offset,
+                          struct fuse_file_info* fi) {
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+    src.buf[0].mem = (void*) buf;
+    int rc = write_file(ino, &src, offset, fi);
+    if (rc < 0) fuse_reply_err(req, -rc);
+    else fuse_reply_write(req, (size_t) rc);
+}
 
-    return 0;
+// Write to a file from the buffers FUSE received the request in.
+// The payload may still be in a pipe that the kernel spliced it into (see myfs_init),
+// in which case it is read straight into the blocks being stored.
+static void myfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* buf, off_t offset,
+                              struct fuse_file_info* fi) {
+    int rc = write_file(ino, buf, offset, fi);
+    if (rc < 0) fuse_reply_err(req, -rc);
+    else fuse_reply_write(req, (size_t) rc);
 }
 
-static int myfs_rename(const char* from, const char* to) {
-    int iLog = 0;
-    LOG_FUNC("RENAME from=\"%s\"  to=\"%s\"\n", from, to);
+static void myfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    fuse_reply_err(req, -myfs_unlink(parent, name));
+}
 
-    myfcb to_fcb;
-    int rc = get_fcb(to, &to_fcb);
-    if (!rc) {  // If destination does exist, unlink it?
-        LOG_CLARIFY("\texists:\n");
-        LOG_FCB(to_fcb);
-        CHECKED_CALL(myfs_unlink, to);
+static void myfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi) {
+    char* buf = malloc(size ? size : 1);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
     }
-    CHECKED_CALL(myfs_link, from, to);
-    LOG_GENERAL("---returned from LINK\n");
+    size_t filled;
+    int rc = myfs_readdir(req, ino, buf, size, offset, fi, &filled);
+    if (rc) fuse_reply_err(req, -rc);
+    else fuse_reply_buf(req, buf, filled);
+    free(buf);
+}
 
-    myfcb from_fcb;
-    CHECKED_CALL(get_fcb, from, &from_fcb);
-    LOG_FCB(from_fcb);
-    __nlink_t n;
-    // Update from_fcb
-    unqlite_int64 fcb_size = MYFCB_SIZE;
-    CHECKED_CALL(fetch, from_fcb.file_data_id, KEY_SIZE, &from_fcb, &fcb_size);
-    CHECKED_CALL(get_nlinks, from_fcb.data, &n);
-    LOG_GENERAL("\tnlinks=%lld\n", n);
-    CHECKED_CALL(myfs_unlink, from);
-    LOG_GENERAL("---returned from UNLINK\n");
-    CHECKED_CALL(get_fcb, to, &to_fcb);
-    LOG_FCB(to_fcb);
-    CHECKED_CALL(get_nlinks, to_fcb.data, &n);
-    LOG_GENERAL("\tnlinks=%lld\n", n);
+static void myfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    int rc = myfs_opendir(ino, fi, fuse_req_ctx(req));
+    if (rc) fuse_reply_err(req, -rc);
+    else fuse_reply_open(req, fi);
+}
 
+static void myfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    fuse_reply_err(req, -myfs_releasedir(ino));
+}
 
-    // this should fail
-    rc = get_fcb(from, &from_fcb);
-    LOG_GENERAL("\trc=%lld\n", rc);
+static void myfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode) {
+    struct fuse_entry_param e;
+    reply_entry(req, myfs_mkdir(parent, name, mode, fuse_req_ctx(req), &e), &e);
+}
 
+static void myfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    fuse_reply_err(req, -myfs_rmdir(parent, name));
+}
 
-    return 0;
+static void myfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char* newname) {
+    struct fuse_entry_param e;
+    reply_entry(req, myfs_link(ino, newparent, newname, &e), &e);
 }
 
+static void myfs_ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+    char buf[MY_MAX_PATH + 1];
+    int rc = myfs_readlink(ino, buf, sizeof(buf));
+    if (rc) fuse_reply_err(req, -rc);
+    else fuse_reply_readlink(req, buf);
+}
 
+static void myfs_ll_symlink(fuse_req_t req, const char* existing, fuse_ino_t parent, const char* name) {
+    struct fuse_entry_param e;
+    reply_entry(req, myfs_symlink(existing, parent, name, fuse_req_ctx(req), &e), &e);
+}
 
+static void myfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t newparent,
+                           const char* newname) {
+    fuse_reply_err(req, -myfs_rename(parent, name, newparent, newname));
+}
 
+// The kernel has already copied in what the command takes, and copies out what it gives back,
+// by the size encoded in the command.
+static void myfs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void* arg, struct fuse_file_info* fi,
+                          unsigned flags, const void* in_buf, size_t in_bufsz, size_t out_bufsz) {
+    size_t size = out_bufsz > in_bufsz ? out_bufsz : in_bufsz;
+    char data[size ? size : 1];
+    memcpy(data, in_buf, in_bufsz);
+    int rc = myfs_ioctl(ino, cmd, flags, data);
+    if (rc) fuse_reply_err(req, -rc);
+    else fuse_reply_ioctl(req, 0, data, out_bufsz);
+}
 
+/** ======================== OPTIONAL, not implemented ======================== */
+// OPTIONAL - included as an example
+// Flush any cached data.
+static void myfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    int iLog = 0;
+    LOG_FUNC("FLUSH ino=%llu\n", (unsigned long long) ino);
 
+    fuse_reply_err(req, 0);
+}
 
+// Release the file. There will be one call to release for each call to open.
+static void myfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    fuse_reply_err(req, -myfs_release(ino));
+}
 
+// Serves fsyncdir as well, a commit covers every file.
+static void myfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi) {
+    fuse_reply_err(req, -myfs_fsync(ino));
+}
 
 
 
@@ -949,76 +2704,366 @@ static int myfs_rename(const char* from, const char* to) {
 
 
 
+/** ======================== FUSE setup ======================== */
+/** ======================== FUSE setup ======================== */
+/** ======================== FUSE setup ======================== */
 
+// Called by FUSE once the file system is mounted.
+// Asks for replies to be spliced to the kernel, which saves copying the data of reads again,
+// and for the payload of writes to be spliced into a pipe that myfs_ll_write_buf reads from.
+static void myfs_init(void* userdata, struct fuse_conn_info* conn) {
+    int iLog = 0;
+    LOG_FUNC("INIT  capable=0x%x\n", conn->capable);
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) conn->want |= FUSE_CAP_SPLICE_WRITE;
+    if (conn->capable & FUSE_CAP_SPLICE_MOVE) conn->want |= FUSE_CAP_SPLICE_MOVE;
+    if (conn->capable & FUSE_CAP_SPLICE_READ) conn->want |= FUSE_CAP_SPLICE_READ;
+}
 
+// This struct contains pointers to all the functions defined above
+// It is used to pass the function pointers to fuse
+// fuse will then execute the methods as required
+static struct fuse_lowlevel_ops myfs_oper = {
+        .init       = myfs_init,
+        .lookup     = myfs_ll_lookup,
+        .forget     = myfs_ll_forget,
+        .getattr    = myfs_ll_getattr,
+        .setattr    = myfs_ll_setattr,
+
+        .mkdir      = myfs_ll_mkdir,
+        .opendir    = myfs_ll_opendir,
+        .readdir    = myfs_ll_readdir,
+        .releasedir = myfs_ll_releasedir,
+        .rmdir      = myfs_ll_rmdir,
+        .fsyncdir   = myfs_ll_fsync,
+
+        .create     = myfs_ll_create,
+        .open       = myfs_ll_open,
+        .read       = myfs_ll_read,
+        .write      = myfs_ll_write,
+        .write_buf  = myfs_ll_write_buf,
+        .flush      = myfs_ll_flush,
+        .release    = myfs_ll_release,
+        .fsync      = myfs_ll_fsync,
+
+        .unlink     = myfs_ll_unlink,
+        .link       = myfs_ll_link,
+        .readlink   = myfs_ll_readlink,
+        .symlink    = myfs_ll_symlink,
+
+        .rename     = myfs_ll_rename,
+        .ioctl      = myfs_ll_ioctl,
 
+};
 
 
-/** ======================== OPTIONAL, not implemented ======================== */
-// OPTIONAL - included as an example
-// Flush any cached data.
-static int myfs_flush(const char* path, struct fuse_file_info* fi) {
+/**
+ * Reads an fcb record of a database before version 4, in the layout of any version, see path_fcb.
+ *
+ * @param id the key of the fcb
+ * @param id_len the length of the key
+ * @param fcb receives the fcb
+ * @return 0 on success, -ENOENT if there is no such record, another error code otherwise
+ */
+static int read_fcb_record(const void* id, int id_len, fcb_v3* fcb) {
     int iLog = 0;
-    LOG_FUNC("FLUSH path=\"%s\"\n", path);
+    path_fcb rec;
+    unqlite_int64 len = sizeof(path_fcb);
+    int CHECKED_CALL(fetch, (void*) id, id_len, &rec, &len);
+    if (len == sizeof(path_fcb)) memcpy(fcb, &rec.fcb, sizeof(fcb_v3));
+    else if (len == sizeof(fcb_v3)) memcpy(fcb, &rec, sizeof(fcb_v3));
+    else TEST_CONDITION(1, "\tread_fcb_record - unexpected size", -EIO);
 
     return 0;
 }
 
-// OPTIONAL - included as an example
-// Release the file. There will be one call to release for each call to open.
-static int myfs_release(const char* path, struct fuse_file_info* fi) {
-    int iLog = 0;
+static void make_old_meta_key(const unsigned char* data, char* key) {
+    memcpy(key, OLD_META_PREFIX, OLD_META_PREFIX_SIZE);
+    memcpy(key + OLD_META_PREFIX_SIZE, data, KEY_SIZE);
+}
 
-    int retstat = 0;
-    LOG_FUNC("RELEASE path=\"%s\"\n", path);
+// The size of a file in a database before version 4.
+static int get_old_size(const unsigned char* data, off_t* size) {
+    char key[OLD_META_KEY_SIZE];
+    make_old_meta_key(data, key);
+    meta_data_v3 md;
+    unqlite_int64 len = sizeof(meta_data_v3);
+    int CHECKED_CALL(fetch, key, OLD_META_KEY_SIZE, &md, &len);
+    *size = md.size;
 
-    return retstat;
+    return 0;
 }
 
+static int set_old_size(const unsigned char* data, off_t size) {
+    int iLog = 0;
+    char key[OLD_META_KEY_SIZE];
+    make_old_meta_key(data, key);
+    int rc = unqlite_kv_store_range(pDb, key, OLD_META_KEY_SIZE, offsetof(meta_data_v3, size), &size, sizeof(size));
+    TEST_CONDITION(rc, "\tset_old_size - failed to store the size", -EIO);
+
+    return 0;
+}
 
+/**
+ * Rewrites the fcb records of the entries of a directory, and of every directory below it,
+ * without the paths that databases before version 3 kept in them.
+ *
+ * @param dir the fcb of the directory
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int strip_paths(fcb_v3 dir) {
+    off_t size;
+    int CHECKED_CALL(get_old_size, dir.data, &size);
+    dentry_reader reader;
+    CHECKED_CALL(open_dentries, &reader, dir.data, size, 0, DENTRY_CHUNK);
+
+    dentry_head head;
+    char name[UINT8_MAX + 1];
+    off_t offset;
+    while ((rc = next_dentry(&reader, &offset, &head, name)) > 0) {
+        fcb_v3 child;
+        rc = read_fcb_record(head.id, KEY_SIZE, &child);
+        if (!rc) rc = store(head.id, KEY_SIZE, &child, sizeof(fcb_v3));
+        if (!rc && S_ISDIR(child.mode)) rc = strip_paths(child);
+        if (rc) break;
+    }
+    close_dentries(&reader);
 
+    return rc;
+}
 
+/**
+ * Rewrites the list of a directory, and of every directory below it, from the fixed size dentries
+ * of databases before version 2 to variable length ones, and builds the index of each directory.
+ *
+ * @param dir the fcb of the directory
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int convert_directory(fcb_v3 dir) {
+    off_t entries;
+    int CHECKED_CALL(get_old_size, dir.data, &entries);
+    if (entries == 0) return 0;
+    // The old dentries are read a few at a time, and the new list is written over them:
+    // a new dentry is shorter than an old one, so it never reaches an old dentry that was not read yet.
+    off_t batch = DENTRY_CHUNK / MY_DENTRY_SIZE;
+    char* old = malloc(batch * MY_DENTRY_SIZE);
+    if (old == NULL) return -ENOMEM;
+
+    uint64_t offset = 0;
+    for (off_t i = 0; !rc && i < entries; ++i) {
+        if (i % batch == 0) {
+            unqlite_int64 len = (entries - i < batch ? entries - i : batch) * MY_DENTRY_SIZE;
+            unqlite_int64 want = len;
+            rc = unqlite_kv_fetch_range(pDb, dir.data, KEY_SIZE, (unqlite_int64) (i * MY_DENTRY_SIZE), &len, old);
+            if (rc || len != want) {
+                rc = -EIO;
+                break;
+            }
+        }
+        char* dentry = old + (i % batch) * MY_DENTRY_SIZE;
+        const char* name = base_name(dentry + KEY_SIZE);
+        fcb_v3 child;
+        rc = read_fcb_record(dentry, KEY_SIZE, &child);
+        if (!rc && strlen(name) > UINT8_MAX) rc = -ENAMETOOLONG;
+        if (rc) break;
+
+        dentry_head head = {.rec_len = DENTRY_LEN(strlen(name)), .type = DENTRY_TYPE(child.mode),
+                            .name_len = (uint8_t) strlen(name)};
+        memcpy(head.id, dentry, KEY_SIZE);
+        rc = write_dentry(dir.data, offset, &head, name);
+        if (!rc) rc = set_dent(dir.data, name, head.id, offset);
+        offset += head.rec_len;
+
+        if (!rc && S_ISDIR(child.mode)) rc = convert_directory(child);
+    }
+    if (!rc) rc = set_old_size(dir.data, (off_t) offset);
+    free(old);
 
+    return rc;
+}
 
+/**
+ * Moves the meta record of a file from before version 4, and any inline contents,
+ * to an inode with the mode and owner of the fcb.
+ * Hard links had an fcb each, the first one to be merged wins.
+ *
+ * @param fcb the fcb of the file
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int merge_inode(fcb_v3 fcb) {
+    meta_data md;
+    int rc = get_meta(fcb.data, &md);
+    if (rc != -ENOENT) return rc;  // Merged already through another link, or an error.
+
+    char key[OLD_META_KEY_SIZE];
+    make_old_meta_key(fcb.data, key);
+    struct {
+        meta_data_v3 md;
+        uint8_t contents[MY_INLINE_MAX];
+    } old;
+    // The first databases kept only the fields up to ctime, the others read as 0.
+    memset(&old, 0, sizeof(old));
+    unqlite_int64 len = sizeof(old);
+    CHECKED_CALL(fetch, key, OLD_META_KEY_SIZE, &old, &len);
+    if (len < (unqlite_int64) offsetof(meta_data_v3, blocks)) return -EIO;
+
+    inline_record rec = {.md = {
+            .mode = fcb.mode,
+            .uid = fcb.uid,
+            .gid = fcb.gid,
+            .size = old.md.size,
+            .nlinks = old.md.nlinks,
+            .atime = old.md.atime,
+            .mtime = old.md.mtime,
+            .ctime = old.md.ctime,
+            .blocks = old.md.blocks,
+            .inlined = old.md.inlined,
+            .saved = old.md.saved,
+    }};
+    size_t contents = len > (unqlite_int64) sizeof(meta_data_v3) ? (size_t) len - sizeof(meta_data_v3) : 0;
+    memcpy(rec.contents, old.contents, contents);
+    char new_key[META_KEY_SIZE];
+    make_meta_key(fcb.data, new_key);
+    CHECKED_CALL(store, new_key, META_KEY_SIZE, &rec, META_DATA_SIZE + contents);
+    rc = unqlite_kv_delete(pDb, key, OLD_META_KEY_SIZE);
+
+    return rc ? -EIO : 0;
+}
 
+/**
+ * Merges the fcbs of the entries of a directory, and of every directory below it, into their inodes,
+ * and makes the dentries and the index hold the uuids of the inodes instead of the fcbs.
+ *
+ * @param dir the fcb of the directory
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int merge_inodes(fcb_v3 dir) {
+    off_t size;
+    int CHECKED_CALL(get_old_size, dir.data, &size);
+    dentry_reader reader;
+    CHECKED_CALL(open_dentries, &reader, dir.data, size, 0, DENTRY_CHUNK);
+
+    dentry_head head;
+    char name[UINT8_MAX + 1];
+    off_t offset;
+    while ((rc = next_dentry(&reader, &offset, &head, name)) > 0) {
+        fcb_v3 child;
+        rc = read_fcb_record(head.id, KEY_SIZE, &child);
+        if (!rc && S_ISDIR(child.mode)) rc = merge_inodes(child);
+        if (!rc) rc = merge_inode(child);
+        if (!rc && unqlite_kv_delete(pDb, head.id, KEY_SIZE)) rc = -EIO;
+        if (!rc) rc = set_dent(dir.data, name, child.data, (uint64_t) offset);
+        if (!rc && unqlite_kv_store_range(pDb, dir.data, KEY_SIZE, (unqlite_int64) (offset + offsetof(dentry_head, id)),
+                                          child.data, KEY_SIZE)) {
+            rc = -EIO;
+        }
+        if (rc) break;
+    }
+    close_dentries(&reader);
 
+    return rc;
+}
 
+/**
+ * Moves the contents of a file that the first databases kept in one record under the uuid of the file,
+ * zero filled up to MY_MAX_FILE_SIZE back then, into blocks, a block at a time.
+ *
+ * @param data the uuid of the file's data
+ * @param md the meta data of the file, its block count is updated and stored
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int split_contents(uuid_t data, meta_data* md) {
+    int iLog = 0;
+    unqlite_int64 len;
+    int rc = unqlite_kv_fetch(pDb, data, KEY_SIZE, NULL, &len);
+    if (rc == UNQLITE_NOTFOUND) return 0;  // Split already through another link, or never written.
+    TEST_CONDITION(rc, "\tsplit_contents - failed to read the contents", -EIO);
+
+    uint8_t* block = malloc(MY_BLOCK_SIZE);
+    TEST_CONDITION(block == NULL, "\tsplit_contents - out of memory", -ENOMEM);
+    for (off_t from = 0; rc == 0 && from < md->size && from < len; from += MY_BLOCK_SIZE) {
+        unqlite_int64 n = md->size - from < MY_BLOCK_SIZE ? md->size - from : MY_BLOCK_SIZE;
+        if (unqlite_kv_fetch_range(pDb, data, KEY_SIZE, (unqlite_int64) from, &n, block)) {
+            rc = -EIO;
+            break;
+        }
+        struct fuse_bufvec src = FUSE_BUFVEC_INIT((size_t) n);
+        src.buf[0].mem = block;
+        if (n) rc = write_blocks(data, md, &src, (size_t) n, from);
+    }
+    free(block);
+    if (rc) return rc;
+    CHECKED_CALL(set_meta, data, md);
+    rc = unqlite_kv_delete(pDb, data, KEY_SIZE);
+    TEST_CONDITION(rc, "\tsplit_contents - failed to remove the old contents", -EIO);
 
+    return 0;
+}
 
-/** ======================== FUSE setup ======================== */
-/** ======================== FUSE setup ======================== */
-/** ======================== FUSE setup ======================== */
+/**
+ * Splits the contents of the files of a directory, and of every directory below it, into blocks,
+ * see split_contents.
+ *
+ * @param dir the uuid of the directory
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int split_files(uuid_t dir) {
+    meta_data md;
+    int CHECKED_CALL(get_meta, dir, &md);
+    dentry_reader reader;
+    CHECKED_CALL(open_dentries, &reader, dir, md.size, 0, DENTRY_CHUNK);
+
+    dentry_head head;
+    char name[UINT8_MAX + 1];
+    off_t offset;
+    while ((rc = next_dentry(&reader, &offset, &head, name)) > 0) {
+        rc = get_meta(head.id, &md);
+        if (!rc && S_ISDIR(md.mode)) rc = split_files(head.id);
+        if (!rc && S_ISREG(md.mode)) rc = split_contents(head.id, &md);
+        if (rc) break;
+    }
+    close_dentries(&reader);
 
-// This struct contains pointers to all the functions defined above
-// It is used to pass the function pointers to fuse
-// fuse will then execute the methods as required 
-static struct fuse_operations myfs_oper = {
-        .getattr    = myfs_getattr,
-
-        .mkdir      = myfs_mkdir,
-        .readdir    = myfs_readdir,
-        .rmdir      = myfs_rmdir,
-
-        .create     = myfs_create,
-        .open       = myfs_open,
-        .read       = myfs_read,
-        .write      = myfs_write,
-        .truncate   = myfs_truncate,
-        .flush      = myfs_flush,
-        .release    = myfs_release,
-
-        .unlink     = myfs_unlink,
-        .link       = myfs_link,
-        .readlink   = myfs_readlink,
-        .symlink    = myfs_symlink,
-
-        .utime      = myfs_utime,
-        .chmod      = myfs_chmod,
-        .chown      = myfs_chown,
-        .rename     = myfs_rename,
+    return rc;
+}
 
-};
+/**
+ * Brings a database written by an older version of MyFS up to FORMAT_VERSION.
+ *
+ * @param version the format version of the database
+ * @return 0 on success, an appropriate error code otherwise
+ */
+static int upgrade_format(uint32_t version) {
+    // Every older version had an fcb for the root.
+    fcb_v3 root;
+    int CHECKED_CALL(read_fcb_record, ROOT_OBJECT_KEY, ROOT_OBJECT_KEY_SIZE, &root);
+
+    // Version 1 only added the directory indexes, which the conversion to version 2 rebuilds anyway.
+    if (version < 2) {
+        printf("upgrade_format: converting directories\n");
+        CHECKED_CALL(convert_directory, root);
+    }
+    if (version < 3) {
+        printf("upgrade_format: removing paths from fcbs\n");
+        CHECKED_CALL(store, ROOT_OBJECT_KEY, ROOT_OBJECT_KEY_SIZE, &root, sizeof(fcb_v3));
+        CHECKED_CALL(strip_paths, root);
+    }
+    if (version < 4) {
+        printf("upgrade_format: merging fcbs into inodes\n");
+        CHECKED_CALL(merge_inodes, root);
+        CHECKED_CALL(merge_inode, root);
+        rc = unqlite_kv_delete(pDb, ROOT_OBJECT_KEY, ROOT_OBJECT_KEY_SIZE);
+        if (rc) return -EIO;
+    }
+    // The first databases kept the contents of a file in one record, before there were blocks.
+    if (version < 1) {
+        printf("upgrade_format: splitting file contents into blocks\n");
+        CHECKED_CALL(split_files, root.data);
+    }
 
+    uint32_t current = FORMAT_VERSION;
+    CHECKED_CALL(store, FORMAT_KEY, FORMAT_KEY_SIZE, &current, sizeof(current));
+    return 0;
+}
 
 // Initialise the in-memory data structures from the store. If the root object (from the store) is empty then create a root fcb (directory)
 // and write it to the store. Note that this code is executed outide of fuse. If there is a failure then we have failed toi initlaise the 
@@ -1029,6 +3074,10 @@ void init_fs() {
     //Initialise the store.
 
     uuid_clear(zero_uuid);
+    dcache_init(config.dcache_max);
+    icache_init(config.icache_max, META_DATA_SIZE);
+    dirty_init(META_DATA_SIZE);
+    last_flush = time(0);
 
     // Open the database.
     rc = unqlite_open(&pDb, DATABASE_NAME, UNQLITE_OPEN_CREATE);
@@ -1036,39 +3085,34 @@ void init_fs() {
 
     unqlite_int64 nBytes;  // Data length
 
-    // Try to fetch the root element
-    // The last parameter is a pointer to a variable which will hold the number of bytes actually read
-    rc = unqlite_kv_fetch(pDb, ROOT_OBJECT_KEY, ROOT_OBJECT_KEY_SIZE, &the_root_fcb, &nBytes);
+    // Try to fetch the root element, which older databases kept in an fcb
+    memset(&the_root_fcb, 0, MYFCB_SIZE);
+    memcpy(the_root_fcb.data, ROOT_DATA_KEY, KEY_SIZE);
+    meta_data md;
+    rc = get_meta(the_root_fcb.data, &md);
+    fcb_v3 old_root;
+    if (rc == -ENOENT) rc = read_fcb_record(ROOT_OBJECT_KEY, ROOT_OBJECT_KEY_SIZE, &old_root);
+    uint32_t version = FORMAT_VERSION;
 
     // if it doesn't exist, we need to create one and put it into the database. This will be the root
     // directory of our filesystem i.e. "/"
-    if (rc == UNQLITE_NOTFOUND) {
+    if (rc == -ENOENT) {
 
         printf("init_store: root object was not found\n");
 
-        // clear everything in the_root_fcb
-        memset(&the_root_fcb, 0, MYFCB_SIZE);
-
-        // Sensible initialisation for the root FCB
+        // Sensible initialisation for the root inode
         //See 'man 2 stat' and 'man 2 chmod'.
-        the_root_fcb.mode |= S_IFDIR |
-                             S_IRUSR | S_IWUSR | S_IXUSR |
-                             S_IRGRP | S_IWGRP | S_IXGRP |
-                             S_IROTH | S_IWOTH | S_IXOTH;
-        the_root_fcb.uid = getuid();
-        the_root_fcb.gid = getgid();
-        memcpy(the_root_fcb.file_data_id, ROOT_OBJECT_KEY, ROOT_OBJECT_KEY_SIZE);
-        memcpy(the_root_fcb.data, "root_direntries", KEY_SIZE);
-
+        mode_t mode = S_IFDIR |
+                      S_IRUSR | S_IWUSR | S_IXUSR |
+                      S_IRGRP | S_IWGRP | S_IXGRP |
+                      S_IROTH | S_IWOTH | S_IXOTH;
+        md = create_meta_data(getuid(), getgid(), mode);
+
+        // Write the root inode
+        printf("init_fs: writing root inode\n");
         char key[META_KEY_SIZE];
-        memcpy(key, META_PREFIX, META_PREFIX_SIZE);
-        memcpy(key + META_PREFIX_SIZE, the_root_fcb.data, KEY_SIZE);
-        meta_data md = create_meta_data();
-        unqlite_kv_store(pDb, key, META_KEY_SIZE, &md, META_DATA_SIZE);
-
-        // Write the root FCB
-        printf("init_fs: writing root fcb\n");
-        rc = unqlite_kv_store(pDb, ROOT_OBJECT_KEY, ROOT_OBJECT_KEY_SIZE, &the_root_fcb, MYFCB_SIZE);
+        make_meta_key(the_root_fcb.data, key);
+        rc = unqlite_kv_store(pDb, key, META_KEY_SIZE, &md, META_DATA_SIZE);
         if (rc != UNQLITE_OK) error_handler(rc);
 
         void* empty = 0;
@@ -1079,118 +3123,165 @@ void init_fs() {
         }
         else printf("initial empty storage is successful\n");
 
+        rc = unqlite_kv_store(pDb, FORMAT_KEY, FORMAT_KEY_SIZE, &version, sizeof(version));
+        if (rc != UNQLITE_OK) error_handler(rc);
     }
     else {
-        if (rc == UNQLITE_OK) {
-            printf("init_store: root object was found\n");
-        }
-        if (nBytes != sizeof(myfcb)) {
+        if (rc) {
             printf("Data object has unexpected size. Doing nothing.\n");
             exit(-1);
         }
+        printf("init_store: root object was found\n");
+
+        nBytes = sizeof(version);
+        rc = unqlite_kv_fetch(pDb, FORMAT_KEY, FORMAT_KEY_SIZE, &version, &nBytes);
+        if (rc == UNQLITE_NOTFOUND) version = 0;
+        else if (rc != UNQLITE_OK) error_handler(rc);
+        if (version > FORMAT_VERSION) {
+            printf("The database was written by a newer version of MyFS. Doing nothing.\n");
+            exit(-1);
+        }
+    }
+    if (version < FORMAT_VERSION) {
+        rc = upgrade_format(version);
+        if (!rc) rc = get_meta(the_root_fcb.data, &md);
+        if (rc) {
+            printf("init_fs could not upgrade the database\n");
+            exit(-1);
+        }
+    }
+    the_root_fcb = fcb_of(the_root_fcb.data, md);
+    itable_init(the_root_fcb.data);
+
+    // The deduplication counters are only there once a block was shared.
+    nBytes = sizeof(dedup_stats);
+    rc = unqlite_kv_fetch(pDb, DEDUP_STATS_KEY, DEDUP_STATS_KEY_SIZE, &dedup_stats, &nBytes);
+    if (rc != UNQLITE_OK || nBytes != sizeof(dedup_stats)) memset(&dedup_stats, 0, sizeof(dedup_stats));
+
+    // Inodes unlinked while open, which the file system went down before the kernel forgot.
+    nBytes = sizeof(orphans);
+    rc = unqlite_kv_fetch(pDb, ORPHANS_KEY, ORPHANS_KEY_SIZE, &orphans, &nBytes);
+    if (rc != UNQLITE_OK || nBytes != sizeof(orphans)) orphans = 0;
+    if (orphans) {
+        printf("init_fs: removing %llu files that were unlinked while open\n", (unsigned long long) orphans);
+        if (remove_orphans()) printf("init_fs could not remove them\n");
     }
 }
 
 void shutdown_fs() {
+    flush_dirty();
     unqlite_close(pDb);
+    dcache_destroy();
+    icache_destroy();
+    itable_destroy();
+    dirty_destroy();
+}
+
+/**
+ * Serves the requests one at a time, like fuse_session_loop: the database, the caches and the tables
+ * are not shared between threads, so the file system is never run multithreaded.
+ * While no request comes the loop still wakes up to store the dirty table dirty_expire seconds
+ * after the last batch, so changed inodes do not wait for the next change to reach the database, see dirty.h.
+ *
+ * @param se the session
+ * @return 0 when the session ends, -1 on an error
+ */
+static int session_loop(struct fuse_session* se) {
+    int iLog = 0;
+    struct fuse_chan* ch = fuse_session_next_chan(se, NULL);
+    size_t bufsize = fuse_chan_bufsize(ch);
+    char* buf = malloc(bufsize);
+    TEST_CONDITION(buf == NULL, "session_loop - out of memory", -1);
+
+    struct pollfd pfd = {.fd = fuse_chan_fd(ch), .events = POLLIN};
+    int res = 0;
+    while (!fuse_session_exited(se)) {
+        int timeout = -1;
+        if (config.dirty_max && config.dirty_expire) {
+            time_t left = last_flush + (time_t) config.dirty_expire - time(0);
+            timeout = left > 0 ? (int) left * 1000 : 0;
+        }
+        res = poll(&pfd, 1, timeout);
+        if (res == 0) {
+            if (flush_dirty()) LOG_ERR("session_loop - failed to store the dirty table\n");
+            continue;
+        }
+        if (res == -1) {
+            res = errno == EINTR ? 0 : -errno;
+            if (res) break;
+            continue;
+        }
+
+        struct fuse_chan* tmpch = ch;
+        struct fuse_buf fbuf = {.mem = buf, .size = bufsize};
+        res = fuse_session_receive_buf(se, &fbuf, &tmpch);
+        if (res == -EINTR) continue;
+        if (res <= 0) break;
+        fuse_session_process_buf(se, &fbuf, tmpch);
+    }
+    free(buf);
+    fuse_session_reset(se);
+
+    return res < 0 ? -1 : 0;
 }
 
 int main(int argc, char* argv[]) {
-    int fuserc;
+    int err = -1;
     struct myfs_state* myfs_internal_state;
 
     //Setup the log file and store the FILE* in the private data object for the file system.
     myfs_internal_state = malloc(sizeof(struct myfs_state));
     myfs_internal_state->logfile = init_log_file();
 
+    // Take our own options out of the arguments, the rest are for FUSE.
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    config.inline_max = MY_INLINE_DEFAULT;
+    config.dcache_max = DCACHE_DEFAULT_MAX;
+    config.icache_max = ICACHE_DEFAULT_MAX;
+    config.dirty_max = DIRTY_DEFAULT_MAX;
+    config.dirty_expire = DIRTY_DEFAULT_EXPIRE;
+    config.entry_timeout = 1.0;
+    config.attr_timeout = 1.0;
+    if (fuse_opt_parse(&args, &config, myfs_opts, NULL) == -1) {
+        printf("Could not parse the mount options.\n");
+        exit(-1);
+    }
+    if (config.inline_max > MY_INLINE_MAX) config.inline_max = MY_INLINE_MAX;
+    if (config.no_write_buf) myfs_oper.write_buf = NULL;
+
+    char* mountpoint;
+    // Requests are served one at a time whatever the command line says, see session_loop.
+    int multithreaded, foreground;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1) {
+        printf("Could not parse the command line.\n");
+        exit(-1);
+    }
+
     //Initialise the file system. This is being done outside of fuse for ease of debugging.
     init_fs();
 
     // Now pass our function pointers over to FUSE, so they can be called whenever someone
     // tries to interact with our filesystem. The internal state contains a file handle
     // for the logging mechanism
-    fuserc = fuse_main(argc, argv, &myfs_oper, myfs_internal_state);
-
-    //Shutdown the file system.
-    shutdown_fs();
-
-    return fuserc;
-}
-
-
-/** Caching that does not work. */
-/*
-static int remove_unused_cache_entries(int to_remove) {
-    int iLog = 1;
-    LOG_FUNC("\t\tREMOVE UNUSED CACHE ENTRIES  to_remove=%d\n", to_remove);
-    if (!is_cache_full()) {
-        LOG_CLARIFY("\t\t\tcache not full\n");
-        return 0;
-    }
-
-    shift_cache_refbits();
-    for (int i = 0; i < to_remove; ++i) {
-        cache_entry ce;
-        int index = get_least_used_cache(&ce);
-        LOG_GENERAL("\t\t\tce.key=\"");
-        for (int j = 0; j < ce.key_size; ++j) {
-            LOG_GENERAL("%c", ce.key[j]);
-        }
-        LOG_GENERAL("\"\n");
-        LOG_GENERAL("\t\tputting in DB\n");
-        int rc = unqlite_kv_store(pDb, ce.key, (int) ce.key_size, ce.value, ce.value_size);
-        TEST_CONDITION(rc, "\tremove_unused_cache_entries - failed", -EIO);
-        LOG_GENERAL("\t\tcalling remove %d from cache\n", index);
-        remove_from_cache(index);
-
-        LOG_GENERAL("\t\treturned from remove from cache\n");
-    }
-
-    return 0;
-}
-
-static int store2(void* key, int key_len, void* data, unqlite_int64 data_len) {
-    int iLog = 1;
-    LOG_FUNC("\tSTORE  key=\"");
-    for (int i = 0; i < key_len; ++i) {
-        LOG_FUNC("%c", ((char*) key)[i]);
-    }
-    LOG_FUNC("\"\n");
-
-    if (get_from_cache(key, (size_t) key_len, NULL, NULL) == -1 && is_cache_full()) {
-        LOG_CLARIFY("\t\tcache full\n");
-        int CHECKED_CALL(remove_unused_cache_entries, MAX_CACHE_SIZE / 2 + 1);
-    }
-    put_in_cache(key, (size_t) key_len, data, (size_t) data_len);
-
-    return 0;
-}
-
-static int fetch2(void* key, int key_len, void* data, unqlite_int64* data_len) {
-    int iLog = 1;
-    LOG_FUNC("\tFETCH key=\"");
-    for (int i = 0; i < key_len; ++i) {
-        LOG_FUNC("%c", ((char*) key)[i]);
-    }
-    LOG_FUNC("\"\n");
-
-
-    size_t* data_received;
-    int index = get_from_cache(key, (size_t) key_len, data, data_received);
-    if (index == -1) {  // Get failed.
-        LOG_CLARIFY("\t\tKey-Value pair is not in cache - get it from DB.\n");
-        int rc = unqlite_kv_fetch(pDb, key, key_len, data, data_len);
-        TEST_CONDITION(rc == UNQLITE_NOTFOUND, "\tfetch - entry not found", -ENOENT);
-        TEST_CONDITION(rc == UNQLITE_IOERR, "\tfetch - os error", -EIO);
-        TEST_CONDITION(rc == UNQLITE_NOMEM, "\tfetch - out of memory", -ENOMEM);
-
-        if (cache_size == MAX_CACHE_SIZE) {
-            CHECKED_CALL(remove_unused_cache_entries, MAX_CACHE_SIZE / 2 + 1);
+    struct fuse_chan* ch = fuse_mount(mountpoint, &args);
+    if (ch != NULL) {
+        struct fuse_session* se = fuse_lowlevel_new(&args, &myfs_oper, sizeof(myfs_oper), myfs_internal_state);
+        if (se != NULL) {
+            fuse_session_add_chan(se, ch);
+            if (fuse_daemonize(foreground) != -1 && fuse_set_signal_handlers(se) != -1) {
+                err = session_loop(se);
+                fuse_remove_signal_handlers(se);
+            }
+            fuse_session_remove_chan(ch);
+            fuse_session_destroy(se);
         }
-        put_in_cache(key, (size_t) key_len, data, (size_t) *data_len);
+        fuse_unmount(mountpoint, ch);
     }
+    free(mountpoint);
+    fuse_opt_free_args(&args);
 
-    return 0;
+    //Shutdown the file system.
+    shutdown_fs();
 
+    return err ? 1 : 0;
 }
-//*/
\ No newline at end of file
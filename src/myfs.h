@@ -1,314 +1,396 @@
-//#include "fs.h"
-#include <uuid/uuid.h>
-//#include <unqlite.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <unistd.h>
-#include <time.h>
-#include <fuse.h>
-#include "unqlite.h"
-#include "logging_macros.h"
-
-#define MY_MAX_PATH FILENAME_MAX
-#define MY_MAX_FILE_SIZE 4194304
-// 4*1024*1024          (4*2^20 Bytes == 4MB)
-
-extern void write_log(const char*, ...);
-
-typedef struct _meta_data {
-    off_t size;
-    __nlink_t nlinks;
-    time_t atime;   /* time of last access*/
-    time_t mtime;   /* time of last modification */
-    time_t ctime;   /* time of last change to meta-data (status) */
-} meta_data;
-#define META_DATA_SIZE (sizeof(meta_data))
-
-void print_meta(meta_data md) {
-    write_log("\t\tmeta data:\n");
-    write_log("\t\tsize=%lld\n", md.size);
-    write_log("\t\tnlinks=%lld\n", md.nlinks);
-    write_log("\t\tmtime=%ld\n", md.mtime);
-    write_log("\t\tctime=%ld\n", md.ctime);
-}
-
-meta_data create_meta_data() {
-    meta_data md = {
-            .size = 0,
-            .nlinks = 1,
-            .atime = time(0),
-            .mtime = time(0),
-            .ctime = time(0),
-    };
-
-    return md;
-}
-
-typedef struct _myfcb {
-    char path[MY_MAX_PATH];
-    uuid_t file_data_id;
-    uuid_t data;
-
-    uid_t uid;     /* user */
-    gid_t gid;     /* group */
-    mode_t mode;    /* protection */
-
-} myfcb;
-
-#define MYFCB_SIZE (sizeof(struct _myfcb))
-
-void print_fcb(myfcb fcb) {
-    write_log("\t\tFile Control Block:\n");
-    write_log("\t\tpath:%s\n", fcb.path);
-
-    write_log("\t\tfile_data_id:\"");
-    for (int i = 0; i < sizeof(uuid_t); ++i) write_log("%c", fcb.file_data_id[i]);
-    write_log("\"\n");
-
-    write_log("\t\tdata:\"");
-    for (int i = 0; i < sizeof(uuid_t); ++i) write_log("%c", fcb.data[i]);
-    write_log("\"\n");
-
-    write_log("\t\tmode:0%03o\n", fcb.mode);
-    write_log("\t\t--------------------\n");
-}
-
-myfcb create_fcb(const char* path, uid_t uid, gid_t gid, mode_t mode) {
-    myfcb new_fcb = {
-            .uid = uid,
-            .gid = gid,
-            .mode = mode,
-    };
-
-    sprintf(new_fcb.path, path);
-    uuid_generate(new_fcb.file_data_id);
-    uuid_generate(new_fcb.data);
-
-    return new_fcb;
-}
-
-// Some other useful definitions we might need
-
-extern unqlite_int64 root_object_size_value;
-
-// We need to use a well-known value as a key for the root object.
-#define ROOT_OBJECT_KEY "root_object_key"
-#define ROOT_OBJECT_KEY_SIZE ((int)strlen(ROOT_OBJECT_KEY) +1)
-
-// This is the size of a regular key used to fetch things from the 
-// database. We use uuids as keys, so 16 bytes each
-#define KEY_SIZE 16
-
-#define META_PREFIX "meta "
-#define META_PREFIX_SIZE strlen(META_PREFIX)
-#define META_KEY_SIZE ((int) (META_PREFIX_SIZE + KEY_SIZE))
-
-// The length of a direntry that is stored in the db.
-#define MY_DENTRY_SIZE ((KEY_SIZE + MY_MAX_PATH)*sizeof(char))
-#define OPEN_CALLED 1
-// The name of the file which will hold our filesystem
-// If things get corrupted, unmount it and delete the file
-// to start over with a fresh filesystem
-#define DATABASE_NAME "myfs.db"
-
-extern unqlite* pDb;
-
-extern void error_handler(int);
-
-extern FILE* init_log_file();
-
-extern uuid_t zero_uuid;
-
-// We can use the fs_state struct to pass information to fuse, which our handler functions can
-// then access. In this case, we use it to pass a file handle for the file used for logging
-struct myfs_state {
-    FILE* logfile;
-};
-#define NEWFS_PRIVATE_DATA ((struct myfs_state *) fuse_get_context()->private_data)
-
-
-// Some helper functions for logging etc.
-
-// In order to log actions while running through FUSE, we have to give
-// it a file handle to use. We define a couple of helper functions to do
-// logging. No need to change this if you don't see a need
-//
-
-FILE* logfile;
-
-// Open a file for writing so we can obtain a handle
-FILE* init_log_file() {
-    //Open logfile.
-    logfile = fopen("myfs.log", "w");
-    if (logfile == NULL) {
-        perror("Unable to open log file. Life is not worth living.");
-        exit(EXIT_FAILURE);
-    }
-    //Use line buffering
-    setvbuf(logfile, NULL, _IOLBF, 0);
-    return logfile;
-}
-
-// Write to the provided handle
-void write_log(const char* format, ...) {
-    va_list ap;
-    va_start(ap, format);
-    vfprintf(NEWFS_PRIVATE_DATA->logfile, format, ap);
-}
-
-// Simple error handler which cleans up and quits
-void error_handler(int rc) {
-    if (rc != UNQLITE_OK) {
-        const char* zBuf;
-        int iLen;
-        unqlite_config(pDb, UNQLITE_CONFIG_ERR_LOG, &zBuf, &iLen);
-        if (iLen > 0) {
-            perror("error_handler: ");
-            perror(zBuf);
-        }
-        if (rc != UNQLITE_BUSY && rc != UNQLITE_NOTIMPLEMENTED) {
-            /* Rollback */
-            unqlite_rollback(pDb);
-        }
-        exit(rc);
-    }
-}
-
-
-
-
-/** Caching that does not work. */
-/*  Comment and uncomment the whole code by toggling the first of the forward slashes on this line.
-typedef struct _cache_entry {
-    long key_size;
-    long value_size;
-    char value[MY_MAX_FILE_SIZE];
-    char key[CONST_MKS];
-    unsigned char reference_bits;
-} cache_entry;
-
-#define CACHE_ENTRY_SIZE (sizeof(cache_entry))
-#define MAX_CACHE_SIZE 10
-cache_entry cache[MAX_CACHE_SIZE];
-int cache_size = 0;
-
-int is_cache_full() {
-    return cache_size == MAX_CACHE_SIZE;
-}
-//*/
-/**
- * Retrieves the data associated with the given key from the cache.
- * Stores the data in the buffer buf and returns the index of the key in the cache.
- * If the buffer is NULL (in which case data_length can be 0) only the index is returned.
- *
- * @param k the key of the data
- * @param ks the size of the key
- * @param buf the buffer where to put the data or NULL
- * @param data_length the length of the data to read
- * @return the index of the cache entry
- */
-/*
-int get_from_cache(void* k, size_t ks, void* buf, size_t* data_length) {
-    int iLog = 1;
-    LOG_FUNC("\t\t\t\tGET from CACHE\n");
-    LOG_GENERAL("\t\t\t\t\tKey:\"");
-    for (int i = 0; i < ks; ++i) {
-        LOG_GENERAL("%c", ((char*) k)[i]);
-    }
-    LOG_GENERAL("\"\n");
-    int i;
-    for (i = 0; i < cache_size; ++i) {
-        // Find entry of this key.
-        if (!memcmp(cache[i].key, k, ks))
-            break;
-    }
-    if (i == cache_size) return -1;
-    LOG_CLARIFY("\t\t\t\t\ti=%d\n", i);
-    if (buf != NULL) {
-        LOG_CLARIFY("\t\t\t\t\tbuf is not NULL");
-        if (data_length != NULL) {
-            LOG_CLARIFY("\t\t\t\t\tdata length is not NULL   data_length=%d\n", *data_length);
-            *data_length = (size_t) cache[i].value_size;
-        }
-
-        memcpy(buf, cache[i].value, (size_t) cache[i].value_size);
-        cache[i].reference_bits |= (1 << (sizeof(cache[i].reference_bits) - 1));
-    }
-    return i;
-}
-
-void put_in_cache(void* k, size_t ks, void* v, size_t vs) {
-    int iLog = 1;
-    int index = get_from_cache(k, ks, NULL, NULL);
-    if (index == -1) {
-        index = cache_size;
-        cache_size++;
-    }
-
-    LOG_FUNC("\t\t\t\tPUT in CACHE i=%d\n", index);
-    memcpy(cache[index].key, k, ks);
-    cache[index].key_size = ks;
-    LOG_GENERAL("\t\t\t\t\tKey put:\"");
-    for (int i = 0; i < ks; ++i) {
-        LOG_GENERAL("%c", cache[index].key[i]);
-    }
-    LOG_GENERAL("\"\n");
-    cache_entry* ce = cache+index;
-    LOG_GENERAL("\t\t\t\t\tCache entry obtained\n");
-    char * cache_location = ce->value;
-    LOG_GENERAL("\t\t\t\t\tGot address=%p\n", cache_location);
-    memcpy(cache_location, v, vs);
-//    memcpy(cache[index].value, v, vs);
-    cache[index].value_size = vs;
-    LOG_CLARIFY("\t\t\t\t\tValue put\n");
-
-}
-
-void shift_cache_refbits() {
-    for (int i = 0; i < cache_size; ++i)
-        cache[i].reference_bits >>= 1;
-}
-
-int get_least_used_cache(cache_entry* entry) {
-    int iLog = 1;
-    LOG_FUNC("\t\t\t\tGET LAST USED CACHE\n");
-    int index = 0;
-    for (int i = 1; i < cache_size; ++i)
-        if (cache[i].reference_bits < cache[index].reference_bits)
-            index = i;
-    LOG_GENERAL("\t\t\t\t\tindex=%d\n", index);
-    LOG_GENERAL("\t\t\t\t\tcache+index=%d\n", cache + index);
-    LOG_GENERAL("\t\t\t\t\tcache+index*CACHE_ENTRY_SIZE=%d\n", cache + index * CACHE_ENTRY_SIZE);
-
-    memcpy(entry, cache + index, CACHE_ENTRY_SIZE);
-    return index;
-}
-
-void remove_from_cache(int index) {
-    int iLog = 1;
-    LOG_FUNC("\t\t\t\tREMOVE from CACHE  index=%d\n", index);
-    LOG_FUNC("\t\t\t\t\tcache_size=%d\n", cache_size);
-    cache_size--;
-    for (int i = index; i < cache_size; ++i) {
-//        cache_entry ce = cache[i];
-//        LOG_GENERAL("\t\t\t\t\tce.key=\"");
-//        for (int j = 0; j < ce.key_size; ++j) {
-//            LOG_GENERAL("%c", ce.key[j]);
-//        }
-//        LOG_GENERAL("\"\n");
-        cache[i] = cache[i+1];
-//        memcpy(cache+i*CACHE_ENTRY_SIZE, cache+(i+1)*CACHE_ENTRY_SIZE, CACHE_ENTRY_SIZE);
-//        memcpy(cache+i, cache+(i+1), 1);
-//        cache[i].key_size = cache[i + 1].key_size;
-//        LOG_GENERAL("\t\t\t\t\tkey_size moved\n");
-//        memcpy(cache[i].key, cache[i + 1].key, CONST_MKS);
-//        LOG_GENERAL("\t\t\t\t\tkey moved\n");
-//        cache[i].value_size = cache[i + 1].value_size;
-//        memcpy(cache[i].value, cache[i + 1].value, CONST_MKS);
-//        LOG_GENERAL("\t\t\t\t\tvalue moved\n");
-    }
-}
-//*/
\ No newline at end of file
+//#include "fs.h"
+#include <uuid/uuid.h>
+//#include <unqlite.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+#include <fuse_lowlevel.h>
+#include "unqlite.h"
+#include "logging_macros.h"
+#include "myfs_ioctl.h"
+#include "sha256.h"
+#include "compress.h"
+#include "dcache.h"
+#include "icache.h"
+#include "itable.h"
+#include "dirty.h"
+
+#define MY_MAX_PATH FILENAME_MAX
+#define MY_MAX_FILE_SIZE 1099511627776LL
+// 1024*1024*1024*1024  (2^40 Bytes == 1TB)
+
+extern void write_log(const char*, ...);
+
+// The inode of a file, stored under META_PREFIX + the file's uuid, which is also the key of its data.
+// The dentries of a file hold that uuid: hard links are dentries with the same uuid, counted in nlinks.
+typedef struct _meta_data {
+    mode_t mode;    /* type and permissions */
+    uid_t uid;      /* user */
+    gid_t gid;      /* group */
+    off_t size;
+    __nlink_t nlinks;
+    time_t atime;   /* time of last access*/
+    time_t mtime;   /* time of last modification */
+    time_t ctime;   /* time of last change to meta-data (status) */
+    uint64_t blocks;  /* number of data blocks actually stored, holes excluded */
+    uint32_t inlined;  /* the contents are kept in the meta record, right after the meta data */
+    union {
+        uint64_t saved;  /* of a file: bytes that compression saves on the stored blocks, see st_blocks */
+        uint64_t dead;   /* of a directory: bytes of removed dentries still in its list, see remove_dentry */
+    };
+} meta_data;
+#define META_DATA_SIZE (sizeof(meta_data))
+
+void print_meta(meta_data md) {
+    write_log("\t\tmeta data:\n");
+    write_log("\t\tmode:0%03o\n", md.mode);
+    write_log("\t\tsize=%lld\n", md.size);
+    write_log("\t\tnlinks=%lld\n", md.nlinks);
+    write_log("\t\tmtime=%ld\n", md.mtime);
+    write_log("\t\tctime=%ld\n", md.ctime);
+    write_log("\t\tblocks=%llu\n", md.blocks);
+    write_log("\t\tinlined=%u\n", md.inlined);
+    write_log("\t\tsaved=%llu\n", md.saved);
+}
+
+meta_data create_meta_data(uid_t uid, gid_t gid, mode_t mode) {
+    meta_data md = {
+            .mode = mode,
+            .uid = uid,
+            .gid = gid,
+            .size = 0,
+            .nlinks = 1,
+            .atime = time(0),
+            .mtime = time(0),
+            .ctime = time(0),
+            .blocks = 0,
+            .inlined = 0,
+            .saved = 0,
+    };
+
+    return md;
+}
+
+// A file as it is handled in memory: its uuid, and the fields of its inode that checking access needs.
+// It is filled from the inode, see fcb_of, and is not stored.
+typedef struct _myfcb {
+    uuid_t data;
+
+    uid_t uid;     /* user */
+    gid_t gid;     /* group */
+    mode_t mode;    /* protection */
+
+} myfcb;
+
+#define MYFCB_SIZE (sizeof(struct _myfcb))
+
+myfcb fcb_of(const unsigned char* id, meta_data md) {
+    myfcb fcb = {
+            .uid = md.uid,
+            .gid = md.gid,
+            .mode = md.mode,
+    };
+    memcpy(fcb.data, id, sizeof(uuid_t));
+
+    return fcb;
+}
+
+// Before version 4, each dentry led to an fcb record under its own uuid, which held the uuid of the
+// meta record and of the data. Before version 3 the record also started with the full path of the file.
+typedef struct _fcb_v3 {
+    uuid_t file_data_id;
+    uuid_t data;
+    uid_t uid;
+    gid_t gid;
+    mode_t mode;
+} fcb_v3;
+typedef struct _path_fcb {
+    char path[MY_MAX_PATH];
+    fcb_v3 fcb;
+} path_fcb;
+
+void print_fcb(myfcb fcb) {
+    write_log("\t\tFile Control Block:\n");
+
+    write_log("\t\tdata:\"");
+    for (int i = 0; i < sizeof(uuid_t); ++i) write_log("%c", fcb.data[i]);
+    write_log("\"\n");
+
+    write_log("\t\tmode:0%03o\n", fcb.mode);
+    write_log("\t\t--------------------\n");
+}
+
+myfcb create_fcb(uid_t uid, gid_t gid, mode_t mode) {
+    myfcb new_fcb = {
+            .uid = uid,
+            .gid = gid,
+            .mode = mode,
+    };
+
+    uuid_generate(new_fcb.data);
+
+    return new_fcb;
+}
+
+// Some other useful definitions we might need
+
+extern unqlite_int64 root_object_size_value;
+
+// The key of the fcb of the root before version 4.
+#define ROOT_OBJECT_KEY "root_object_key"
+#define ROOT_OBJECT_KEY_SIZE ((int)strlen(ROOT_OBJECT_KEY) +1)
+// The uuid of the root directory.
+#define ROOT_DATA_KEY "root_direntries"
+
+// This is the size of a regular key used to fetch things from the 
+// database. We use uuids as keys, so 16 bytes each
+#define KEY_SIZE 16
+
+#define META_PREFIX "inode "
+#define META_PREFIX_SIZE strlen(META_PREFIX)
+#define META_KEY_SIZE ((int) (META_PREFIX_SIZE + KEY_SIZE))
+
+// The meta records of databases before version 4, under OLD_META_PREFIX, without the mode and the owner.
+// The first version of MyFS stored only the fields up to ctime.
+typedef struct _meta_data_v3 {
+    off_t size;
+    __nlink_t nlinks;
+    time_t atime;
+    time_t mtime;
+    time_t ctime;
+    uint64_t blocks;
+    uint32_t inlined;
+    uint64_t saved;
+} meta_data_v3;
+#define OLD_META_PREFIX "meta "
+#define OLD_META_PREFIX_SIZE strlen(OLD_META_PREFIX)
+#define OLD_META_KEY_SIZE ((int) (OLD_META_PREFIX_SIZE + KEY_SIZE))
+
+// Small files keep their contents in the meta record, after the meta data, instead of in blocks.
+// Reading one then takes a single lookup once its dentry is found.
+// A file stays inline while it has no stored blocks and is no bigger than the inline_max
+// mount option, which is MY_INLINE_DEFAULT unless given and at most MY_INLINE_MAX.
+#define MY_INLINE_DEFAULT 1024
+#define MY_INLINE_MAX 4096
+
+// A meta record together with the contents of an inline file.
+typedef struct _inline_record {
+    meta_data md;
+    uint8_t contents[MY_INLINE_MAX];
+} inline_record;
+
+// File data is split into blocks of MY_BLOCK_SIZE bytes.
+// Each block is stored under the file's data uuid followed by the block index,
+// so reads and writes only touch the blocks that they overlap.
+// A block may be stored shorter than MY_BLOCK_SIZE, the missing tail reads as zeros.
+#define MY_BLOCK_SIZE 65536
+// 64*1024              (64*2^10 Bytes == 64KB)
+#define BLOCK_KEY_SIZE ((int) (KEY_SIZE + sizeof(uint64_t)))
+#define BLOCK_INDEX(offset) ((uint64_t) ((offset) / MY_BLOCK_SIZE))
+#define NUMBER_OF_BLOCKS(size) ((uint64_t) (((size) + MY_BLOCK_SIZE - 1) / MY_BLOCK_SIZE))
+
+// Each file has a block map which records which of its blocks are stored.
+// The map is split into pages of MY_BMAP_SPAN entries (256MB of file data each),
+// stored under BMAP_PREFIX + data uuid + page index, so that the map entry for
+// any block is found with one small fetch whatever the size of the file.
+// Pages with no stored blocks are not kept.
+#define MY_BMAP_SPAN 4096
+#define BMAP_PREFIX "bmap "
+#define BMAP_PREFIX_SIZE strlen(BMAP_PREFIX)
+#define BMAP_KEY_SIZE ((int) (BMAP_PREFIX_SIZE + KEY_SIZE + sizeof(uint64_t)))
+#define BMAP_PAGE(block) ((block) / MY_BMAP_SPAN)
+#define BMAP_ENTRY(block) ((block) % MY_BMAP_SPAN)
+
+// The states of a block in the block map.
+#define BLOCK_HOLE 0
+#define BLOCK_STORED 1
+#define BLOCK_SHARED 2  /* deduplicated, the block's record holds the hash of its contents */
+// With -o compress=<codec>, blocks that compress well are stored compressed, in state
+// BLOCK_COMPRESSED + codec - 1 so that each block is read back with the codec it was written with.
+#define BLOCK_COMPRESSED 3
+#define IS_COMPRESSED(state) ((state) >= BLOCK_COMPRESSED)
+#define BLOCK_CODEC(state) ((state) - BLOCK_COMPRESSED + 1)
+
+// With -o dedup, the contents of blocks are stored once per distinct content,
+// under CAS_PREFIX + the SHA-256 of the contents. The record starts with a count
+// of the blocks that refer to it, followed by the contents.
+#define CAS_PREFIX "cas "
+#define CAS_PREFIX_SIZE strlen(CAS_PREFIX)
+#define CAS_KEY_SIZE ((int) (CAS_PREFIX_SIZE + SHA256_SIZE))
+#define CAS_HEADER_SIZE sizeof(uint64_t)
+// The struct myfs_dedup_stats kept up to date as blocks are shared and released.
+#define DEDUP_STATS_KEY "dedup stats"
+#define DEDUP_STATS_KEY_SIZE ((int) strlen(DEDUP_STATS_KEY))
+
+// An in-memory copy of one page of a block map.
+typedef struct _bmap_page {
+    uint64_t index;  /* page index, BMAP_NONE if nothing is loaded */
+    int dirty;      /* entries changed since the page was loaded */
+    uint8_t entries[MY_BMAP_SPAN];
+} bmap_page;
+#define BMAP_NONE UINT64_MAX
+#define BMAP_PAGE_INIT {.index = BMAP_NONE, .dirty = 0}
+
+// The length of a direntry in databases before version 2: the fcb id followed by the full path.
+#define MY_DENTRY_SIZE ((KEY_SIZE + MY_MAX_PATH)*sizeof(char))
+
+// A directory's data is its list of dentries, each a dentry_head followed by the name and a copy of rec_len.
+// rec_len covers the whole dentry and any free space after it, and the trailing copy lets the list be walked
+// back from its end. The size of a directory is the number of bytes in its list.
+// New dentries are added at the end. A removed one stays in place with the type DENTRY_FREE,
+// so that no other dentry moves, until the free ones take up most of the list and it is compacted
+// while no listing of the directory is open.
+typedef struct _dentry_head {
+    uuid_t id;         /* the id of the entry's fcb */
+    uint32_t rec_len;  /* the bytes from this dentry to the next one */
+    uint8_t type;      /* the file type bits of the entry's mode, see DENTRY_TYPE */
+    uint8_t name_len;  /* the length of the name, which is not null terminated */
+} dentry_head;
+#define DENTRY_LEN(name_len) (sizeof(dentry_head) + (name_len) + sizeof(uint32_t))
+#define DENTRY_MAX_LEN DENTRY_LEN(UINT8_MAX)
+#define DENTRY_TYPE(mode) ((uint8_t) (((mode) & S_IFMT) >> 12))
+#define DENTRY_MODE(type) ((mode_t) (type) << 12)
+#define DENTRY_FREE 0
+// Lists with fewer bytes of free dentries than this are not worth compacting.
+#define DENTRY_COMPACT_MIN 4096
+
+// Goes through a list of dentries a part at a time, so that a list of any size is read with a bounded buffer,
+// see open_dentries and next_dentry.
+typedef struct _dentry_reader {
+    const unsigned char* dir;  /* the data uuid of the directory */
+    off_t size;                /* the size of the list */
+    off_t next;                /* the offset of the next dentry */
+    off_t start;               /* the offset in the list of the part in buf */
+    unqlite_int64 len;         /* the bytes of the part in buf */
+    size_t chunk;              /* the most bytes read at a time */
+    char* buf;
+} dentry_reader;
+// The part of a list that is read at a time when going through all of it.
+#define DENTRY_CHUNK 65536
+
+// Each directory has an index from the names of its entries to their fcb ids and their offsets
+// in the directory's list of dentries, stored under DENT_PREFIX + the directory's data uuid + the name.
+// A child is found, added or removed with a few lookups however big the directory is.
+// readdir still goes through the list.
+#define DENT_PREFIX "dent "
+#define DENT_PREFIX_SIZE strlen(DENT_PREFIX)
+#define DENT_KEY_SIZE(name_len) ((int) (DENT_PREFIX_SIZE + KEY_SIZE + (name_len)))
+
+// The value stored in a directory index for each entry.
+typedef struct _dent {
+    uuid_t id;        /* the id of the entry's fcb */
+    uint64_t offset;  /* the position of the entry's dentry in the directory's list */
+} dent;
+
+// An inode that loses its last link while the kernel still has a number for it stays until the kernel forgets it,
+// see drop_link. Meanwhile it is recorded under ORPHAN_PREFIX + its uuid, so that init_fs removes it if the file
+// system went down before the forget. Finding the records takes a walk over the whole database,
+// so ORPHANS_KEY counts them and the walk only happens when there are some.
+#define ORPHAN_PREFIX "orphan "
+#define ORPHAN_PREFIX_SIZE strlen(ORPHAN_PREFIX)
+#define ORPHAN_KEY_SIZE ((int) (ORPHAN_PREFIX_SIZE + KEY_SIZE))
+#define ORPHANS_KEY "orphans"
+#define ORPHANS_KEY_SIZE ((int) strlen(ORPHANS_KEY))
+
+// The version of the layout of the database, stored under FORMAT_KEY.
+// Databases from before the version was stored are version 0. Older databases are upgraded when mounted.
+#define FORMAT_KEY "format"
+#define FORMAT_KEY_SIZE ((int) strlen(FORMAT_KEY))
+#define FORMAT_VERSION 4  /* 1: directory indexes, 2: variable length dentries, 3: fcbs without paths,
+                             4: fcbs merged into the meta records */
+#define OPEN_CALLED 1
+// When reads and listings update the access time, see the atime mount options and touch_atime.
+#define ATIME_RELATIVE 0  /* only when it is older than the last change, or than a day, as the kernel's relatime */
+#define ATIME_STRICT 1    /* on every access */
+#define ATIME_NONE 2      /* never */
+// The inode number that readdir gives the entries, which only get numbers when they are looked up, see itable.h.
+#define MYFS_UNKNOWN_INO 0xffffffff
+// The name of the file which will hold our filesystem
+// If things get corrupted, unmount it and delete the file
+// to start over with a fresh filesystem
+#define DATABASE_NAME "myfs.db"
+
+extern unqlite* pDb;
+
+extern void error_handler(int);
+
+extern FILE* init_log_file();
+
+extern uuid_t zero_uuid;
+
+// We can use the fs_state struct to pass information to fuse, which our handler functions can
+// then access. In this case, we use it to pass a file handle for the file used for logging
+struct myfs_state {
+    FILE* logfile;
+};
+
+// The options given with -o when mounting. See myfs_opts in myfs.c.
+struct myfs_config {
+    int no_write_buf;  /* nowrite_buf: take writes through .write instead of .write_buf */
+    int no_prefetch;   /* noprefetch: readdir does not load the inodes of the entries it lists */
+    int dedup;         /* dedup: share the blocks that have identical contents */
+    unsigned int inline_max;  /* inline_max=N: files of up to N bytes are kept inline, 0 turns it off */
+    int codec;         /* compress=none|lz: the codec that new blocks are compressed with */
+    unsigned int dcache_max;  /* dcache_max=N: the dentry cache takes up to N bytes, 0 turns it off */
+    unsigned int icache_max;  /* icache_max=N: the inode cache takes up to N bytes, 0 turns it off */
+    double entry_timeout;     /* entry_timeout=T: the kernel keeps the names it looked up for T seconds */
+    double attr_timeout;      /* attr_timeout=T: the kernel keeps the attributes it got for T seconds */
+    double negative_timeout;  /* negative_timeout=T: the kernel keeps the names it did not find for T seconds */
+    int atime;         /* strictatime|relatime|noatime: when reads update the access time, see ATIME_RELATIVE */
+    int lazytime;      /* lazytime: access times are kept in memory and stored in batches */
+    unsigned int dirty_max;     /* dirty_max=N: up to N changed inodes are kept in memory, 0 stores every change */
+    unsigned int dirty_expire;  /* dirty_expire=S: they are all stored S seconds after the last batch */
+};
+extern struct myfs_config config;
+
+
+// Some helper functions for logging etc.
+
+// In order to log actions while running through FUSE, we have to give
+// it a file handle to use. We define a couple of helper functions to do
+// logging. No need to change this if you don't see a need
+//
+
+FILE* logfile;
+
+// Open a file for writing so we can obtain a handle
+FILE* init_log_file() {
+    //Open logfile.
+    logfile = fopen("myfs.log", "w");
+    if (logfile == NULL) {
+        perror("Unable to open log file. Life is not worth living.");
+        exit(EXIT_FAILURE);
+    }
+    //Use line buffering
+    setvbuf(logfile, NULL, _IOLBF, 0);
+    return logfile;
+}
+
+// Write to the provided handle
+void write_log(const char* format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(logfile, format, ap);
+}
+
+// Simple error handler which cleans up and quits
+void error_handler(int rc) {
+    if (rc != UNQLITE_OK) {
+        const char* zBuf;
+        int iLen;
+        unqlite_config(pDb, UNQLITE_CONFIG_ERR_LOG, &zBuf, &iLen);
+        if (iLen > 0) {
+            perror("error_handler: ");
+            perror(zBuf);
+        }
+        if (rc != UNQLITE_BUSY && rc != UNQLITE_NOTIMPLEMENTED) {
+            /* Rollback */
+            unqlite_rollback(pDb);
+        }
+        exit(rc);
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef PROJECT_MYFS_IOCTL_H
+#define PROJECT_MYFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+
+/* FUSE 2 does not pass lseek through to the file system,
+ * so SEEK_DATA and SEEK_HOLE are answered with these ioctls instead.
+ * The argument is an off_t holding the offset to search from,
+ * which is replaced with the start of the next data range or hole.
+ * Like lseek, they fail with ENXIO when the offset is at or past the end of the file,
+ * and SEEK_DATA also fails with ENXIO when there is no more data.
+ */
+#define MYFS_IOC_SEEK_DATA _IOWR('M', 1, off_t)
+#define MYFS_IOC_SEEK_HOLE _IOWR('M', 2, off_t)
+
+/* The deduplication counters of the whole file system, see the dedup mount option.
+ * The dedup ratio is referenced_bytes / stored_bytes.
+ * Works on any file of the mount.
+ */
+struct myfs_dedup_stats {
+    uint64_t references;        /* blocks of files that refer to shared contents */
+    uint64_t shared;            /* distinct shared contents actually stored */
+    uint64_t referenced_bytes;  /* bytes of file data in shared blocks */
+    uint64_t stored_bytes;      /* bytes taken by the shared contents */
+};
+#define MYFS_IOC_DEDUP_STATS _IOR('M', 3, struct myfs_dedup_stats)
+
+/* The number of reads answered since the file system was mounted,
+ * and the number of records fetched from the database for all requests in that time.
+ * Works on any file of the mount.
+ */
+struct myfs_lookup_stats {
+    uint64_t reads;    /* read requests answered */
+    uint64_t lookups;  /* records fetched from the database */
+};
+#define MYFS_IOC_LOOKUP_STATS _IOR('M', 4, struct myfs_lookup_stats)
+
+/* The counters of the inode cache since the file system was mounted, see the icache_max mount option.
+ * Works on any file of the mount.
+ */
+struct myfs_icache_stats {
+    uint64_t hits;    /* meta data found in the cache */
+    uint64_t misses;  /* meta data fetched from the database */
+};
+#define MYFS_IOC_ICACHE_STATS _IOR('M', 5, struct myfs_icache_stats)
+
+#endif //PROJECT_MYFS_IOCTL_H
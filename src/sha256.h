@@ -0,0 +1,18 @@
+#ifndef PROJECT_SHA256_H
+#define PROJECT_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE 32
+
+/**
+ * Computes the SHA-256 digest of a buffer.
+ *
+ * @param data the bytes to hash
+ * @param len the number of bytes
+ * @param digest receives the SHA256_SIZE bytes of the digest
+ */
+void sha256(const void* data, size_t len, uint8_t digest[SHA256_SIZE]);
+
+#endif //PROJECT_SHA256_H
@@ -1,5 +1,6 @@
 #!/usr/bin/env bash
 _user="$USER"
+_src="$PWD"
 
 # This function is used to facilitate reading the command line output.
 run_cmd() {
@@ -84,9 +85,50 @@ echo "line2" >> c
 run_cmd "ln -s c d"
 run_cmd "cat d"
 
+# A directory that is open when its last entry is removed is empty, and can be removed while still open
+run_cmd "mkdir held"
+touch held/last
+exec 3<held
+run_cmd "rm held/last"
+run_cmd "rmdir held"
+exec 3<&-
+
+# Sparse files
+run_cmd "truncate -s 1G sparse"
+run_cmd "du -h sparse"
+echo 'data' | dd of=sparse bs=1 seek=100000000 conv=notrunc
+run_cmd "du -h sparse"
+run_cmd "truncate -s 4096 sparse"
+run_cmd "du -h sparse"
+
 # Many touches
 for i in {1..100}
 do
     touch /cs/scratch/gg50/mnt/a$i
 done
-run_cmd "stat ."
\ No newline at end of file
+run_cmd "stat ."
+
+# Crash: what was synced survives a kill, the change after it is rolled back.
+# The file that was still open when it was removed is removed for good when mounted again (init_fs says so).
+run_cmd "cd /cs/scratch/$_user/mnt"
+exec 3> orphan
+echo 'open' >&3
+run_cmd "rm orphan"
+echo 'synced' > durable
+run_cmd "sync durable"
+echo 'lost' >> durable
+run_cmd "pkill -9 -x myfs"
+exec 3>&-
+run_cmd "fusermount -u /cs/scratch/$_user/mnt"
+run_cmd "cd $_src"
+run_cmd "./myfs -s /cs/scratch/$_user/mnt"
+run_cmd "cat /cs/scratch/$_user/mnt/durable"
+
+# Upgrading: format0.db.gz holds a database written by the first version of MyFS, with the files
+# /hello, /empty, /dir/notes and /dir/big (200000 bytes) and the directory /dir/sub. It is upgraded when mounted.
+run_cmd "fusermount -u /cs/scratch/$_user/mnt"
+gunzip -c format0.db.gz > myfs.db
+run_cmd "./myfs -s /cs/scratch/$_user/mnt"
+run_cmd "ls -lR /cs/scratch/$_user/mnt"
+run_cmd "cat /cs/scratch/$_user/mnt/hello /cs/scratch/$_user/mnt/dir/notes"
+run_cmd "wc -c /cs/scratch/$_user/mnt/dir/big"
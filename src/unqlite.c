@@ -850,6 +850,14 @@ struct unqlite_kv_methods
   int (*xData)(unqlite_kv_cursor *,int (*xConsumer)(const void *,unsigned int,void *),void *pUserData);
   void (*xReset)(unqlite_kv_cursor *);
   void (*xCursorRelease)(unqlite_kv_cursor *);
+  /* Optional methods, NULL when not implemented by the engine */
+  int (*xDataRange)(unqlite_kv_cursor *,unqlite_int64 iOfft,unqlite_int64 nLen,int (*xConsumer)(const void *,unsigned int,void *),void *pUserData);
+  int (*xReplaceRange)(
+	  unqlite_kv_engine *,
+	  const void *pKey,int nKeyLen,
+	  unqlite_int64 iOfft,
+	  const void *pData,unqlite_int64 nDataLen
+	  );
 };
 /*
  * UnQLite journal file suffix.
@@ -881,11 +889,14 @@ UNQLITE_APIEXPORT int unqlite_close(unqlite *pDb);
 /* Key/Value (KV) Store Interfaces */
 UNQLITE_APIEXPORT int unqlite_kv_store(unqlite *pDb,const void *pKey,int nKeyLen,const void *pData,unqlite_int64 nDataLen);
 UNQLITE_APIEXPORT int unqlite_kv_append(unqlite *pDb,const void *pKey,int nKeyLen,const void *pData,unqlite_int64 nDataLen);
+UNQLITE_APIEXPORT int unqlite_kv_store_range(unqlite *pDb,const void *pKey,int nKeyLen,unqlite_int64 iOfft,const void *pData,unqlite_int64 nDataLen);
 UNQLITE_APIEXPORT int unqlite_kv_store_fmt(unqlite *pDb,const void *pKey,int nKeyLen,const char *zFormat,...);
 UNQLITE_APIEXPORT int unqlite_kv_append_fmt(unqlite *pDb,const void *pKey,int nKeyLen,const char *zFormat,...);
 UNQLITE_APIEXPORT int unqlite_kv_fetch(unqlite *pDb,const void *pKey,int nKeyLen,void *pBuf,unqlite_int64 /* in|out */*pBufLen);
 UNQLITE_APIEXPORT int unqlite_kv_fetch_callback(unqlite *pDb,const void *pKey,
 	                    int nKeyLen,int (*xConsumer)(const void *,unsigned int,void *),void *pUserData);
+UNQLITE_APIEXPORT int unqlite_kv_fetch_range(unqlite *pDb,const void *pKey,int nKeyLen,
+	                    unqlite_int64 iOfft,unqlite_int64 /* in|out */*pLen,void *pBuf);
 UNQLITE_APIEXPORT int unqlite_kv_delete(unqlite *pDb,const void *pKey,int nKeyLen);
 UNQLITE_APIEXPORT int unqlite_kv_config(unqlite *pDb,int iOp,...);
 
@@ -5470,6 +5481,52 @@ int unqlite_kv_store(unqlite *pDb,const void *pKey,int nKeyLen,const void *pData
 #endif
 	return rc;
 }
+/*
+ * [CAPIREF: unqlite_kv_store_range()]
+ * Overwrite nDataLen bytes of an existing record starting at offset iOfft.
+ * The record grows when the range crosses its end, but iOfft must not be past the end.
+ * Only the pages covering the range are dirtied, so only they get journaled.
+ */
+int unqlite_kv_store_range(unqlite *pDb,const void *pKey,int nKeyLen,unqlite_int64 iOfft,const void *pData,unqlite_int64 nDataLen)
+{
+	unqlite_kv_engine *pEngine;
+	int rc;
+	if( UNQLITE_DB_MISUSE(pDb) ){
+		return UNQLITE_CORRUPT;
+	}
+#if defined(UNQLITE_ENABLE_THREADS)
+	 /* Acquire DB mutex */
+	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
+		 UNQLITE_THRD_DB_RELEASE(pDb) ){
+			 return UNQLITE_ABORT; /* Another thread have released this instance */
+	 }
+#endif
+	 /* Point to the underlying storage engine */
+	 pEngine = unqlitePagerGetKvEngine(pDb);
+	 if( pEngine->pIo->pMethods->xReplaceRange == 0 ){
+		 /* Storage engine does not implement such method */
+		 unqliteGenError(pDb,"xReplaceRange() method not implemented in the underlying storage engine");
+		 rc = UNQLITE_NOTIMPLEMENTED;
+	 }else{
+		 if( nKeyLen < 0 ){
+			 /* Assume a null terminated string and compute it's length */
+			 nKeyLen = SyStrlen((const char *)pKey);
+		 }
+		 if( !nKeyLen ){
+			 unqliteGenError(pDb,"Empty key");
+			 rc = UNQLITE_EMPTY;
+		 }else{
+			 /* Perform the requested operation */
+			 rc = pEngine->pIo->pMethods->xReplaceRange(pEngine,pKey,nKeyLen,iOfft,pData,nDataLen);
+		 }
+	 }
+#if defined(UNQLITE_ENABLE_THREADS)
+	 /* Leave DB mutex */
+	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+#endif
+	return rc;
+}
 /*
  * [CAPIREF: unqlite_kv_store_fmt()]
  * Please refer to the official documentation for function purpose and expected parameters.
@@ -5724,6 +5781,108 @@ int unqlite_kv_fetch_callback(unqlite *pDb,const void *pKey,int nKeyLen,int (*xC
 #endif
 	return rc;
 }
+/*
+ * Data consumer used by unqlite_kv_fetch_range() when the storage engine
+ * does not implement xDataRange: skip up to the offset and stop once the
+ * range is copied.
+ */
+struct unqlite_range_consumer
+{
+	sxu64 nSkip;  /* Bytes left to skip before the range */
+	sxu64 nLeft;  /* Bytes left to copy */
+	SyBlob *pOut; /* Destination */
+};
+static int unqliteRangeConsumer(const void *pData,unsigned int nDatalen,void *pUserData)
+{
+	struct unqlite_range_consumer *pRange = (struct unqlite_range_consumer *)pUserData;
+	const char *zData = (const char *)pData;
+	if( pRange->nSkip >= (sxu64)nDatalen ){
+		pRange->nSkip -= nDatalen;
+		return UNQLITE_OK;
+	}
+	zData += pRange->nSkip;
+	nDatalen -= (unsigned int)pRange->nSkip;
+	pRange->nSkip = 0;
+	if( (sxu64)nDatalen > pRange->nLeft ){
+		nDatalen = (unsigned int)pRange->nLeft;
+	}
+	SyBlobAppend(pRange->pOut,(const void *)zData,nDatalen);
+	pRange->nLeft -= nDatalen;
+	return pRange->nLeft > 0 ? UNQLITE_OK : UNQLITE_ABORT;
+}
+/*
+ * [CAPIREF: unqlite_kv_fetch_range()]
+ * Copy up to *pLen bytes of the record data starting at offset iOfft into pBuf.
+ * On return *pLen holds the number of bytes copied, which is short when the
+ * range crosses the end of the record. Only the pages covering the range are read.
+ */
+int unqlite_kv_fetch_range(unqlite *pDb,const void *pKey,int nKeyLen,unqlite_int64 iOfft,unqlite_int64 *pLen,void *pBuf)
+{
+	unqlite_kv_methods *pMethods;
+	unqlite_kv_engine *pEngine;
+	unqlite_kv_cursor *pCur;
+	int rc;
+	if( UNQLITE_DB_MISUSE(pDb) ){
+		return UNQLITE_CORRUPT;
+	}
+	if( pLen == 0 || pBuf == 0 || iOfft < 0 || *pLen < 0 ){
+		return UNQLITE_INVALID;
+	}
+#if defined(UNQLITE_ENABLE_THREADS)
+	 /* Acquire DB mutex */
+	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
+		 UNQLITE_THRD_DB_RELEASE(pDb) ){
+			 return UNQLITE_ABORT; /* Another thread have released this instance */
+	 }
+#endif
+	 /* Point to the underlying storage engine */
+	 pEngine = unqlitePagerGetKvEngine(pDb);
+	 pMethods = pEngine->pIo->pMethods;
+	 pCur = pDb->sDB.pCursor;
+	 if( nKeyLen < 0 ){
+		 /* Assume a null terminated string and compute it's length */
+		 nKeyLen = SyStrlen((const char *)pKey);
+	 }
+	 if( !nKeyLen ){
+		 unqliteGenError(pDb,"Empty key");
+		 rc = UNQLITE_EMPTY;
+	 }else{
+		 /* Seek to the record position */
+		 rc = pMethods->xSeek(pCur,pKey,nKeyLen,UNQLITE_CURSOR_MATCH_EXACT);
+	 }
+	 if( rc == UNQLITE_OK ){
+		 SyBlob sBlob;
+		 /* Initialize the data consumer */
+		 SyBlobInitFromBuf(&sBlob,pBuf,(sxu32)*pLen);
+		 if( pMethods->xDataRange ){
+			 /* Let the engine read only the pages covering the range */
+			 rc = pMethods->xDataRange(pCur,iOfft,*pLen,unqliteDataConsumer,&sBlob);
+		 }else{
+			 struct unqlite_range_consumer sRange;
+			 sRange.nSkip = (sxu64)iOfft;
+			 sRange.nLeft = (sxu64)*pLen;
+			 sRange.pOut = &sBlob;
+			 rc = UNQLITE_OK;
+			 if( sRange.nLeft > 0 ){
+				 rc = pMethods->xData(pCur,unqliteRangeConsumer,&sRange);
+				 if( rc == UNQLITE_ABORT && sRange.nLeft < 1 ){
+					 /* Stopped at the end of the range */
+					 rc = UNQLITE_OK;
+				 }
+			 }
+		 }
+		 /* Data length */
+		 *pLen = (unqlite_int64)SyBlobLength(&sBlob);
+		 /* Cleanup */
+		 SyBlobRelease(&sBlob);
+	 }
+#if defined(UNQLITE_ENABLE_THREADS)
+	 /* Leave DB mutex */
+	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+#endif
+	return rc;
+}
 /*
  * [CAPIREF: unqlite_kv_delete()]
  * Please refer to the official documentation for function purpose and expected parameters.
@@ -48722,6 +48881,8 @@ struct lhcell
 	sxu16 iStart;      /* Offset of this cell */
 	pgno iDataPage;    /* Data page number when overflow */
 	sxu16 iDataOfft;   /* Offset of the data in iDataPage */
+	pgno iLastPage;    /* Last overflow page of the data when known, 0 otherwise */
+	sxu64 iLastData;   /* Offset in the data of the first byte held by iLastPage */
 	SyBlob sKey;       /* Record key for fast lookup (Kept in-memory if < 256KB ) */
 	lhcell *pNext,*pPrev;         /* Linked list of the loaded memory cells */
 	lhcell *pNextCol,*pPrevCol;   /* Collison chain  */
@@ -49524,6 +49685,86 @@ static int lhConsumeCellData(
 	}
 	return rc;
 }
+/*
+ * Given a cell, consume nLen bytes of its data starting at offset iOfft.
+ * Overflow pages that lie before the range are only visited for their next page
+ * pointer and the pages past the end of the range are never loaded.
+ */
+static int lhConsumeCellDataRange(
+	lhcell *pCell, /* Target cell */
+	sxu64 iOfft,   /* Offset of the first byte to consume */
+	sxu64 nLen,    /* Number of bytes to consume */
+	int (*xConsumer)(const void *,unsigned int,void *), /* Data consumer callback */
+	void *pUserData /* Last argument to xConsumer() */
+	)
+{
+	lhpage *pPage = pCell->pPage;
+	const unsigned char *zPayload;
+	int rc;
+	if( iOfft >= pCell->nData || nLen < 1 ){
+		/* Nothing to consume */
+		return UNQLITE_OK;
+	}
+	if( nLen > pCell->nData - iOfft ){
+		/* Stop at the end of the record */
+		nLen = pCell->nData - iOfft;
+	}
+	if( pCell->iOvfl == 0 ){
+		/* Local payload, consume the range directly */
+		zPayload = &pPage->pRaw->zData[pCell->iStart + L_HASH_CELL_SZ + pCell->nKey + (sxu32)iOfft];
+		rc = xConsumer((const void *)zPayload,(sxu32)nLen,pUserData);
+		if( rc != UNQLITE_OK ){
+			rc = UNQLITE_ABORT;
+		}
+	}else{
+		lhash_kv_engine *pEngine = pPage->pHash;
+		unqlite_page *pOvfl;
+		sxu32 iStart,nByte;
+		pgno iOvfl;
+		/* Overflow page where data is stored */
+		iOvfl = pCell->iDataPage;
+		iStart = pCell->iDataOfft;
+		for(;;){
+			if( iOvfl == 0 || nLen < 1 ){
+				/* no more overflow page or the range is complete */
+				break;
+			}
+			/* Point to the overflow page */
+			rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iOvfl,&pOvfl);
+			if( rc != UNQLITE_OK ){
+				return rc;
+			}
+			/* Usable bytes in this page */
+			nByte = pEngine->iPageSize - iStart;
+			if( iOfft >= (sxu64)nByte ){
+				/* The range starts past this page */
+				iOfft -= nByte;
+			}else{
+				zPayload = &pOvfl->zData[iStart + (sxu32)iOfft];
+				nByte -= (sxu32)iOfft;
+				iOfft = 0;
+				if( (sxu64)nByte > nLen ){
+					nByte = (sxu32)nLen;
+				}
+				/* Consume the data */
+				rc = xConsumer((const void *)zPayload,nByte,pUserData);
+				if( rc != UNQLITE_OK ){
+					pEngine->pIo->xPageUnref(pOvfl);
+					return UNQLITE_ABORT;
+				}
+				nLen -= nByte;
+			}
+			/* Next overflow page in the chain */
+			SyBigEndianUnpack64(pOvfl->zData,&iOvfl);
+			/* Unref the page */
+			pEngine->pIo->xPageUnref(pOvfl);
+			/* Payload of the next pages starts after the next page pointer */
+			iStart = 8;
+		}
+		rc = UNQLITE_OK;
+	}
+	return rc;
+}
 /*
  * Read the linear hash header (Page one of the database).
  */
@@ -50072,6 +50313,8 @@ static int lhCellWriteOvflPayload(lhcell *pCell,const void *pKey,sxu32 nKeylen,.
 	va_start(ap,nKeylen);
 	pCell->iDataPage = pNew->pgno;
 	pCell->iDataOfft = (sxu16)(zRaw-pNew->zData);
+	/* A new chain, its last page is found again by the next append */
+	pCell->iLastPage = 0;
 	/* Write the data page and its offset */
 	SyBigEndianPack64(&pFirst->zData[8/*Next ovfl*/],pCell->iDataPage);
 	SyBigEndianPack16(&pFirst->zData[8/*Next ovfl*/+8/*Data page*/],pCell->iDataOfft);
@@ -50317,6 +50560,8 @@ static int lhRecordOverwrite(
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
+	/* The chain is rewritten */
+	pCell->iLastPage = 0;
 	if( pCell->iOvfl == 0 ){
 		/* Local payload, try to deal with the free space issues */
 		zPayload = &pPage->pRaw->zData[pCell->iStart + L_HASH_CELL_SZ + pCell->nKey];
@@ -50440,6 +50685,106 @@ static int lhRecordOverwrite(
 	/* All done */
 	return UNQLITE_OK;
 }
+/* Forward declaration */
+static int lhRecordAppend(lhcell *pCell,const void *pData,unqlite_int64 nByte);
+/*
+ * Overwrite nByte bytes of an existing record starting at offset iOfft.
+ * Only the pages holding the range are marked dirty, so only those pages get
+ * journaled and written back. Bytes that land past the end of the record are appended.
+ */
+static int lhRecordOverwriteRange(
+	lhcell *pCell,
+	sxu64 iOfft,
+	const void *pData,unqlite_int64 nByte
+	)
+{
+	lhash_kv_engine *pEngine = pCell->pPage->pHash;
+	const unsigned char *zPtr = (const unsigned char *)pData;
+	lhpage *pPage = pCell->pPage;
+	unqlite_page *pOvfl;
+	sxu32 iStart,nAvail;
+	sxu64 nLen,nIn;
+	pgno iOvfl;
+	int rc;
+	if( iOfft > pCell->nData ){
+		/* Would leave a gap in the record */
+		pEngine->pIo->xErr(pEngine->pIo->pHandle,"Range overwrite past the end of the record");
+		return UNQLITE_INVALID;
+	}
+	/* Bytes overwritten in place, the rest is appended */
+	nIn = pCell->nData - iOfft;
+	if( nIn > (sxu64)nByte ){
+		nIn = (sxu64)nByte;
+	}
+	if( nIn > 0 && pCell->iOvfl == 0 ){
+		/* Local payload, acquire a writer lock on this page only */
+		rc = pEngine->pIo->xWrite(pPage->pRaw);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		SyMemcpy((const void *)zPtr,(void *)&pPage->pRaw->zData[pCell->iStart + L_HASH_CELL_SZ + pCell->nKey + (sxu32)iOfft],(sxu32)nIn);
+		zPtr += nIn;
+	}else if( nIn > 0 ){
+		/* Walk the overflow chain and touch only the pages covering the range */
+		iOvfl = pCell->iDataPage;
+		iStart = pCell->iDataOfft;
+		if( pCell->iLastPage != 0 && iOfft >= pCell->iLastData ){
+			/* The range starts in the last page, no need to walk there */
+			iOvfl = pCell->iLastPage;
+			if( iOvfl != pCell->iDataPage ){
+				iStart = 8;
+			}
+			iOfft -= pCell->iLastData;
+		}
+		nLen = nIn;
+		for(;;){
+			if( nLen < 1 ){
+				break;
+			}
+			if( iOvfl == 0 ){
+				/* Cant happen */
+				pEngine->pIo->xErr(pEngine->pIo->pHandle,"Corrupt overflow page");
+				return UNQLITE_CORRUPT;
+			}
+			rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iOvfl,&pOvfl);
+			if( rc != UNQLITE_OK ){
+				return rc;
+			}
+			/* Usable bytes in this page */
+			nAvail = pEngine->iPageSize - iStart;
+			if( iOfft >= (sxu64)nAvail ){
+				/* The range starts past this page, leave it clean */
+				iOfft -= nAvail;
+			}else{
+				/* Acquire a writer lock */
+				rc = pEngine->pIo->xWrite(pOvfl);
+				if( rc != UNQLITE_OK ){
+					pEngine->pIo->xPageUnref(pOvfl);
+					return rc;
+				}
+				nAvail -= (sxu32)iOfft;
+				if( (sxu64)nAvail > nLen ){
+					nAvail = (sxu32)nLen;
+				}
+				SyMemcpy((const void *)zPtr,(void *)&pOvfl->zData[iStart + (sxu32)iOfft],nAvail);
+				zPtr += nAvail;
+				nLen -= nAvail;
+				iOfft = 0;
+			}
+			/* Next overflow page in the chain */
+			SyBigEndianUnpack64(pOvfl->zData,&iOvfl);
+			pEngine->pIo->xPageUnref(pOvfl);
+			/* Payload of the next pages starts after the next page pointer */
+			iStart = 8;
+		}
+	}
+	if( (sxu64)nByte > nIn ){
+		/* Grow the record with the remaining bytes */
+		rc = lhRecordAppend(pCell,(const void *)zPtr,nByte - (unqlite_int64)nIn);
+		return rc;
+	}
+	return UNQLITE_OK;
+}
 /*
  * Append data to an existing record.
  */
@@ -50453,9 +50798,9 @@ static int lhRecordAppend(
 	lhpage *pPage = pCell->pPage;
 	unsigned char *zRaw,*zRawEnd;
 	unqlite_page *pOvfl,*pNew;
-	sxu64 nDatalen;
+	sxu64 nDatalen,iData;
 	sxu32 nAvail;
-	pgno iOvfl;
+	pgno iOvfl,iPage;
 	int rc;
 	if( pCell->nData + nByte < pCell->nData ){
 		/* Overflow */
@@ -50511,17 +50856,24 @@ static int lhRecordAppend(
 		}
 		return UNQLITE_OK;
 	}
-	/* Point to the overflow page which hold the data */
-	rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,pCell->iDataPage,&pOvfl);
+	/* Point to the overflow page which hold the data, or straight to the last one when it is known,
+	 * so that appending to a long record does not walk its whole chain every time */
+	iPage = pCell->iDataPage;
+	iData = 0;
+	if( pCell->iLastPage != 0 ){
+		iPage = pCell->iLastPage;
+		iData = pCell->iLastData;
+	}
+	rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iPage,&pOvfl);
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
 	/* Next overflow page in the chain */
 	SyBigEndianUnpack64(pOvfl->zData,&iOvfl);
 	/* Point to the end of the chunk */
-	zRaw = &pOvfl->zData[pCell->iDataOfft];
+	zRaw = &pOvfl->zData[iPage == pCell->iDataPage ? pCell->iDataOfft : 8];
 	zRawEnd = &pOvfl->zData[pEngine->iPageSize];
-	nDatalen = pCell->nData;
+	nDatalen = pCell->nData - iData;
 	nAvail = (sxu32)(zRawEnd - zRaw);
 	for(;;){
 		if( zRaw >= zRawEnd ){
@@ -50543,8 +50895,10 @@ static int lhRecordAppend(
 			zRawEnd = &pNew->zData[pCell->pPage->pHash->iPageSize];
 			nAvail = L_HASH_OVERFLOW_SIZE(pCell->pPage->pHash->iPageSize);
 			pOvfl = pNew;
+			iData = pCell->nData - nDatalen;
 		}
-		if( (sxu64)nAvail > nDatalen ){
+		if( (sxu64)nAvail >= nDatalen ){
+			/* The data may end exactly at the end of the last page, a new page is then linked below */
 			zRaw += nDatalen;
 			break;
 		}else{
@@ -50582,6 +50936,7 @@ static int lhRecordAppend(
 			pOvfl = pNew;
 			zRaw = &pNew->zData[8];
 			zRawEnd = &pNew->zData[pEngine->iPageSize];
+			iData = pCell->nData + (sxu64)(zPtr - (const unsigned char *)pData);
 		}
 		nAvail = (sxu32)(zRawEnd-zRaw);
 		nLen = (sxu32)(zEnd-zPtr);
@@ -50593,6 +50948,9 @@ static int lhRecordAppend(
 		zPtr += nLen;
 		zRaw += nLen;
 	}
+	/* Remember where the chain ends for the next append */
+	pCell->iLastPage = pOvfl->pgno;
+	pCell->iLastData = iData;
 	/* Unref the last overflow page */
 	pEngine->pIo->xPageUnref(pOvfl);
 	/* Finally, update the cell header */
@@ -51152,6 +51510,34 @@ static int lhash_kv_append(
 	rc = lh_record_insert(pKv,pKey,(sxu32)nKeyLen,pData,nDataLen,1);
 	return rc;
 }
+/*
+ * Range overwrite method.
+ */
+static int lhash_kv_replace_range(
+	  unqlite_kv_engine *pKv,
+	  const void *pKey,int nKeyLen,
+	  unqlite_int64 iOfft,
+	  const void *pData,unqlite_int64 nDataLen
+	  )
+{
+	lhash_kv_engine *pEngine = (lhash_kv_engine *)pKv;
+	lhcell *pCell;
+	int rc;
+	if( iOfft < 0 || nDataLen < 0 ){
+		return UNQLITE_INVALID;
+	}
+	/* Locate the record */
+	rc = lhRecordLookup(pEngine,pKey,(sxu32)nKeyLen,&pCell);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	if( nDataLen < 1 ){
+		/* Nothing to write */
+		return UNQLITE_OK;
+	}
+	rc = lhRecordOverwriteRange(pCell,(sxu64)iOfft,pData,nDataLen);
+	return rc;
+}
 /*
  * Write the hash header (Page one).
  */
@@ -51656,6 +52042,21 @@ static int lhCursorData(unqlite_kv_cursor *pCursor,int (*xConsumer)(const void *
 	rc = lhConsumeCellData(pCell,xConsumer,pUserData);
 	return rc;
 }
+/*
+ * Consume a range of the data.
+ */
+static int lhCursorDataRange(unqlite_kv_cursor *pCursor,unqlite_int64 iOfft,unqlite_int64 nLen,int (*xConsumer)(const void *,unsigned int,void *),void *pUserData)
+{
+	lhash_kv_cursor *pCur = (lhash_kv_cursor *)pCursor;
+	int rc;
+	if( pCur->iState != L_HASH_CURSOR_STATE_CELL || pCur->pCell == 0 || iOfft < 0 || nLen < 0 ){
+		/* Invalid state */
+		return UNQLITE_INVALID;
+	}
+	/* Consume the range */
+	rc = lhConsumeCellDataRange(pCur->pCell,(sxu64)iOfft,(sxu64)nLen,xConsumer,pUserData);
+	return rc;
+}
 /*
  * Find a partiuclar record.
  */
@@ -51723,7 +52124,9 @@ UNQLITE_PRIVATE const unqlite_kv_methods * unqliteExportDiskKvStorage(void)
 		lhCursorDataLength,         /* xDataLength */
 		lhCursorData,               /* xData */
 		lhCursorReset,              /* xReset */
-		0                           /* xRelease */                        
+		0,                          /* xRelease */
+		lhCursorDataRange,          /* xDataRange */
+		lhash_kv_replace_range      /* xReplaceRange */
 	};
 	return &sDiskStore;
 }
@@ -52128,6 +52531,31 @@ static int MemHashCursorData(unqlite_kv_cursor *pCursor,int (*xConsumer)(const v
 	/* Callback result */
 	return rc;
 }
+/*
+ * Consume a range of the data.
+ */
+static int MemHashCursorDataRange(unqlite_kv_cursor *pCursor,unqlite_int64 iOfft,unqlite_int64 nLen,int (*xConsumer)(const void *,unsigned int,void *),void *pUserData)
+{
+	mem_hash_cursor *pMem = (mem_hash_cursor *)pCursor;
+	int rc;
+	if( pMem->pCur == 0){
+		 return UNQLITE_EOF;
+	}
+	if( iOfft < 0 || nLen < 0 ){
+		return UNQLITE_INVALID;
+	}
+	if( iOfft >= (unqlite_int64)pMem->pCur->nDataLen || nLen < 1 ){
+		/* Nothing to consume */
+		return UNQLITE_OK;
+	}
+	if( nLen > (unqlite_int64)pMem->pCur->nDataLen - iOfft ){
+		nLen = (unqlite_int64)pMem->pCur->nDataLen - iOfft;
+	}
+	/* Invoke the callback */
+	rc = xConsumer(&((const char *)pMem->pCur->pData)[iOfft],(unsigned int)nLen,pUserData);
+	/* Callback result */
+	return rc;
+}
 /*
  * Reset the cursor.
  */
@@ -52407,7 +52835,9 @@ UNQLITE_PRIVATE const unqlite_kv_methods * unqliteExportMemKvStorage(void)
 		MemHashCursorDataLength,    /* xDataLength */
 		MemHashCursorData,          /* xData */
 		MemHashCursorReset,         /* xReset */
-		0        /* xRelease */                        
+		0,                          /* xRelease */
+		MemHashCursorDataRange,     /* xDataRange */
+		0                           /* xReplaceRange */
 	};
 	return &sMemStore;
 }
@@ -57055,6 +57485,15 @@ static int pager_write_hot_dirty_pages(Pager *pPager,Page *pDirty)
 		}
 		/* Point to the next page */
 		pNext = pDirty->pPrevHot; /* Not a bug: Reverse link */
+		if( pDirty->nRef > 0 ){
+			/* Referenced again since it was made hot: the caller may still
+			 * modify it, so leave it dirty and linked. It will be made hot
+			 * again when released.
+			 */
+			pDirty->flags &= ~PAGE_HOT_DIRTY;
+			pDirty = pNext;
+			continue;
+		}
 		if( (pDirty->flags & PAGE_DONT_WRITE) == 0 ){
 			rc = unqliteOsWrite(pPager->pfd,pDirty->zData,pPager->iPageSize,pDirty->pgno * pPager->iPageSize);
 			if( rc != UNQLITE_OK ){